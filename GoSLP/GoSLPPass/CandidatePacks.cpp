@@ -1,13 +1,21 @@
 #include "CandidatePacks.hpp"
+#include "ControlEquivalence.hpp"
 
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/InstrTypes.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Intrinsics.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include <bitset>
+#include <map>
+#include <tuple>
+
 using namespace llvm;
 
 namespace {
@@ -70,200 +78,225 @@ static bool packsOverlap(const std::vector<const Instruction *> &A,
   return false;
 }
 
+// A memory pair is only worth a candidate slot if its lanes feed (loads) or
+// are fed by (stores) an isomorphic pair, the way the fields of an
+// array-of-structs do.
+static bool feedsIsomorphicPair(const Instruction *I1, const Instruction *I2) {
+  if (isa<StoreInst>(I1)) {
+    auto *V1 = dyn_cast<Instruction>(cast<StoreInst>(I1)->getValueOperand());
+    auto *V2 = dyn_cast<Instruction>(cast<StoreInst>(I2)->getValueOperand());
+    return V1 && V2 && areIsomorphic(V1, V2);
+  }
+  if (!I1->hasOneUse() || !I2->hasOneUse())
+    return false;
+  auto *U1 = cast<Instruction>(*I1->user_begin());
+  auto *U2 = cast<Instruction>(*I2->user_begin());
+  return U1 != U2 && areIsomorphic(U1, U2);
+}
+
 static bool canMergePacks(const std::vector<const Instruction *> &P1,
                           const std::vector<const Instruction *> &P2,
-                          const DataLayout &DL, AAResults &AA,
-                          MemorySSA &MSSA) {
-  if (P1.size() != P2.size() || P1.empty())
+                          const DataLayout &DL, MemorySSA &MSSA,
+                          const ControlEquivalence *CE, WorkBudget &Budget) {
+  if (P1.empty() || P2.empty())
     return false;
 
   if (packsOverlap(P1, P2))
     return false;
 
-  for (unsigned Lane = 0; Lane < P1.size(); ++Lane) {
-    Instruction *I1 = const_cast<Instruction *>(P1[Lane]);
-    Instruction *I2 = const_cast<Instruction *>(P2[Lane]);
-    if (!legalGoSLPPair(I1, I2, DL, AA, MSSA))
+  // The halves may differ in width, so every lane of P2 is checked against
+  // P1's first lane, which all of P1 is isomorphic to.
+  Instruction *Lead = const_cast<Instruction *>(P1.front());
+  for (const Instruction *I : P2) {
+    Instruction *I2 = const_cast<Instruction *>(I);
+    if (!areIsomorphic(Lead, I2) || !areSchedulableTogether(Lead, I2, CE))
       return false;
   }
 
-  return true;
-}
-
-static void widenPacks(CandidatePairs &C, const DataLayout &DL, AAResults &AA,
-                       MemorySSA &MSSA, unsigned MaxWidth,
-                       std::unordered_map<ValuePackKey, uint32_t,
-                                          ValuePackKeyHash> &PackToIdx) {
-  bool Changed = true;
-  while (Changed) {
-    Changed = false;
-    std::vector<std::vector<const Instruction *>> NewPacks;
-
-    for (size_t I = 0; I < C.Packs.size(); ++I) {
-      const auto &P1 = C.Packs[I];
-      if (P1.empty() || P1.size() >= MaxWidth)
-        continue;
-
-      for (size_t J = I + 1; J < C.Packs.size(); ++J) {
-        const auto &P2 = C.Packs[J];
-        if (P1.size() != P2.size())
-          continue;
-
-        if (!canMergePacks(P1, P2, DL, AA, MSSA))
-          continue;
-
-        std::vector<const Instruction *> Wider;
-        Wider.reserve(P1.size() + P2.size());
-        Wider.insert(Wider.end(), P1.begin(), P1.end());
-        Wider.insert(Wider.end(), P2.begin(), P2.end());
-
-        ValuePackKey K = canonicalizeLaneInsts(Wider);
-        if (PackToIdx.find(K) != PackToIdx.end())
-          continue;
-
-        NewPacks.push_back(std::move(Wider));
-        PackToIdx.emplace(std::move(K),
-                          static_cast<uint32_t>(C.Packs.size() +
-                                                NewPacks.size() - 1));
-      }
+  // Every lane of the wider pack must be independent of every other lane,
+  // not only of its counterpart in the other half.
+  for (const Instruction *A : P1) {
+    for (const Instruction *B : P2) {
+      if (!areIndependent(const_cast<Instruction *>(A),
+                          const_cast<Instruction *>(B), MSSA, &Budget))
+        return false;
     }
+  }
 
-    if (!NewPacks.empty()) {
-      Changed = true;
-      for (auto &P : NewPacks)
-        C.Packs.push_back(std::move(P));
-    }
+  if (accessesMemory(P1.front())) {
+    std::vector<const Instruction *> Union(P1);
+    Union.insert(Union.end(), P2.begin(), P2.end());
+    MemPackLayout Layout;
+    return analyzeMemPack(Union, DL, Layout);
   }
+
+  return true;
 }
 
-static void buildUseMaps(CandidatePairs &C) {
+static void resetUseMaps(CandidatePairs &C) {
   C.VecVecUses.clear();
   C.NonVecPacks.clear();
   C.NonVecPackToIndex.clear();
   C.NonVecVecUses.clear();
-
+  C.NonVecAssemblies.clear();
   C.LaneUses.assign(C.Packs.size(), {});
-  for (size_t P = 0; P < C.Packs.size(); ++P)
-    C.LaneUses[P].assign(C.Packs[P].size(), LaneUseInfo{});
+  C.OperandsBuilt.assign(C.Packs.size(), false);
+  C.UsesBuilt.assign(C.Packs.size(), false);
+}
 
-  std::unordered_map<ValuePackKey, std::vector<uint32_t>, ValuePackKeyHash>
-      CandidateByKey;
-  CandidateByKey.reserve(C.Packs.size() * 2 + 1);
-  for (uint32_t P = 0; P < C.Packs.size(); ++P) {
-    CandidateByKey[canonicalizeLaneInsts(C.Packs[P])].push_back(P);
-  }
+// Sizes LaneUses[P] and registers every scalar user of each lane. The vector
+// packs that can absorb a user are filled in by ensurePackOperands.
+static void initLaneUses(CandidatePairs &C, uint32_t P) {
+  auto &Lanes = C.LaneUses[P];
+  if (!Lanes.empty())
+    return;
 
-  for (uint32_t P = 0; P < C.Packs.size(); ++P) {
-    const auto &Pack = C.Packs[P];
-    for (uint32_t Lane = 0; Lane < Pack.size(); ++Lane) {
-      const Instruction *I = Pack[Lane];
-      LaneUseInfo &Info = C.LaneUses[P][Lane];
-      for (const User *U : I->users()) {
-        auto *UI = dyn_cast<Instruction>(U);
-        if (!UI) {
-          Info.HasOutsideUse = true;
-          continue;
-        }
-        (void)Info.UserToVectorUses[UI];
+  const auto &Pack = C.Packs[P];
+  Lanes.assign(Pack.size(), LaneUseInfo{});
+  for (uint32_t Lane = 0; Lane < Pack.size(); ++Lane) {
+    LaneUseInfo &Info = Lanes[Lane];
+    for (const User *U : Pack[Lane]->users()) {
+      auto *UI = dyn_cast<Instruction>(U);
+      if (!UI) {
+        Info.HasOutsideUse = true;
+        continue;
       }
+      (void)Info.UserToVectorUses[UI];
     }
   }
+}
 
-  auto getOrCreateNonVec = [&](const ValuePackKey &Key) {
-    auto It = C.NonVecPackToIndex.find(Key);
-    if (It != C.NonVecPackToIndex.end())
-      return It->second;
-
-    uint32_t Idx = static_cast<uint32_t>(C.NonVecPacks.size());
-    C.NonVecPacks.push_back(Key);
-    C.NonVecPackToIndex.emplace(Key, Idx);
-    return Idx;
-  };
-
-  for (uint32_t UsePackIdx = 0; UsePackIdx < C.Packs.size(); ++UsePackIdx) {
-    const auto &UsePack = C.Packs[UsePackIdx];
-    if (UsePack.empty())
+// Candidate packs whose lanes are exactly OperandLanes (in any order).
+static void findCandidatesWithLanes(const CandidatePairs &C,
+                                    ArrayRef<const Value *> OperandLanes,
+                                    const ValuePackKey &Key,
+                                    SmallVectorImpl<uint32_t> &Out) {
+  auto *First = dyn_cast<Instruction>(OperandLanes.front());
+  if (!First)
+    return;
+  auto It = C.InstToCandidates.find(First);
+  if (It == C.InstToCandidates.end())
+    return;
+  for (const CandidateId &Id : It->second) {
+    if (Id.Width != OperandLanes.size())
       continue;
+    if (canonicalizeLaneInsts(C.Packs[Id.Index]) == Key)
+      Out.push_back(Id.Index);
+  }
+}
 
-    SmallVector<unsigned, 4> OpIndices;
-    if (isa<LoadInst>(UsePack.front())) {
-      // Vector loads don't require explicit operand packing in IR.
+// Ways to build an operand pack from producers that do not match it
+// exactly: one producer holding every lane (a subvector of a wider pack, or
+// a permute), two producers (back to back, or permuted), or one producer
+// covering at least half the lanes with the rest inserted.
+static std::vector<OperandAssembly>
+findOperandAssemblies(const CandidatePairs &C,
+                      ArrayRef<const Value *> OperandLanes,
+                      uint32_t UsePackIdx) {
+  const size_t MaxAssemblies = 4;
+  const uint32_t Width = static_cast<uint32_t>(OperandLanes.size());
+  std::vector<OperandAssembly> Out;
+  if (Width < 2 || Width > 32)
+    return Out;
+  const uint32_t Full = Width == 32 ? ~0u : (1u << Width) - 1;
+
+  // Lanes each producer candidate covers, keyed by pack index for a
+  // deterministic order.
+  std::map<uint32_t, uint32_t> Cover;
+  for (uint32_t Lane = 0; Lane < Width; ++Lane) {
+    auto *I = dyn_cast<Instruction>(OperandLanes[Lane]);
+    if (!I || isa<StoreInst>(I))
       continue;
-    } else if (isa<StoreInst>(UsePack.front())) {
-      // Only the stored value contributes to vector operand packing.
-      OpIndices.push_back(0);
-    } else if (auto *CI = dyn_cast<CallInst>(UsePack.front())) {
-      for (unsigned ArgIdx = 0; ArgIdx < CI->arg_size(); ++ArgIdx)
-        OpIndices.push_back(ArgIdx);
-    } else {
-      for (unsigned OpIdx = 0; OpIdx < UsePack.front()->getNumOperands(); ++OpIdx)
-        OpIndices.push_back(OpIdx);
+    auto It = C.InstToCandidates.find(I);
+    if (It == C.InstToCandidates.end())
+      continue;
+    for (const CandidateId &Id : It->second) {
+      if (Id.Index != UsePackIdx)
+        Cover[Id.Index] |= 1u << Lane;
     }
+  }
 
-    for (unsigned OpIdx : OpIndices) {
-      SmallVector<const Value *, 8> OperandLanes;
-      OperandLanes.reserve(UsePack.size());
-      bool AllInst = true;
-
-      for (const Instruction *I : UsePack) {
-        const Value *Op = nullptr;
-        if (auto *CI = dyn_cast<CallInst>(I))
-          Op = CI->getArgOperand(OpIdx);
-        else
-          Op = I->getOperand(OpIdx);
-        OperandLanes.push_back(Op);
-        if (!isa<Instruction>(Op))
-          AllInst = false;
-      }
-
-      ValuePackKey OpKey = canonicalizeLaneValues(OperandLanes);
-      auto CandIt = CandidateByKey.find(OpKey);
-
-      if (AllInst && CandIt != CandidateByKey.end()) {
-        for (uint32_t SrcPackIdx : CandIt->second) {
-          if (SrcPackIdx == UsePackIdx)
-            continue;
-
-          appendUnique(C.VecVecUses[SrcPackIdx], UsePackIdx);
+  auto laneIndex = [&](uint32_t P, const Value *V) {
+    const auto &Pack = C.Packs[P];
+    return static_cast<uint32_t>(llvm::find(Pack, V) - Pack.begin());
+  };
+  auto isRunOf = [&](uint32_t P, uint32_t Offset, uint32_t From, uint32_t N) {
+    for (uint32_t K = 0; K < N; ++K) {
+      if (laneIndex(P, OperandLanes[From + K]) != Offset + K)
+        return false;
+    }
+    return true;
+  };
 
-          const auto &SrcPack = C.Packs[SrcPackIdx];
-          for (uint32_t UseLane = 0; UseLane < UsePack.size(); ++UseLane) {
-            const Instruction *UseInst = UsePack[UseLane];
-            const Value *OpVal = nullptr;
-            if (auto *CI = dyn_cast<CallInst>(UseInst))
-              OpVal = CI->getArgOperand(OpIdx);
-            else
-              OpVal = UseInst->getOperand(OpIdx);
-            auto *OpInst = dyn_cast<Instruction>(OpVal);
-            if (!OpInst)
-              continue;
+  for (const auto &Entry : Cover) {
+    if (Entry.second != Full || Out.size() >= MaxAssemblies)
+      continue;
+    OperandAssembly A;
+    A.Sources.push_back(Entry.first);
+    uint32_t First = laneIndex(Entry.first, OperandLanes[0]);
+    if (C.Packs[Entry.first].size() > Width && First % Width == 0 &&
+        isRunOf(Entry.first, First, 0, Width)) {
+      A.Shape = OperandAssembly::SubvectorOfOne;
+      A.SubvectorIndex = First;
+    }
+    Out.push_back(std::move(A));
+  }
 
-            for (uint32_t SrcLane = 0; SrcLane < SrcPack.size(); ++SrcLane) {
-              if (SrcPack[SrcLane] != OpInst)
-                continue;
-              auto &LanesMap = C.LaneUses[SrcPackIdx][SrcLane].UserToVectorUses;
-              const Instruction *UserInst = UseInst;
-              appendUnique(LanesMap[UserInst], UsePackIdx);
-            }
-          }
+  for (auto I = Cover.begin(); I != Cover.end(); ++I) {
+    for (auto J = std::next(I); J != Cover.end(); ++J) {
+      if (Out.size() >= MaxAssemblies || I->second == Full ||
+          J->second == Full || (I->second | J->second) != Full ||
+          C.Packs[I->first].size() != C.Packs[J->first].size() ||
+          packsOverlap(C.Packs[I->first], C.Packs[J->first]))
+        continue;
+      OperandAssembly A;
+      A.Shape = OperandAssembly::PermuteTwo;
+      A.Sources = {I->first, J->first};
+      const uint32_t Half = Width / 2;
+      if (Width % 2 == 0 && C.Packs[I->first].size() == Half) {
+        if (isRunOf(I->first, 0, 0, Half) && isRunOf(J->first, 0, Half, Half)) {
+          A.Shape = OperandAssembly::ConcatTwo;
+        } else if (isRunOf(J->first, 0, 0, Half) &&
+                   isRunOf(I->first, 0, Half, Half)) {
+          A.Shape = OperandAssembly::ConcatTwo;
+          std::swap(A.Sources[0], A.Sources[1]);
         }
-      } else {
-        uint32_t NonVecIdx = getOrCreateNonVec(OpKey);
-        appendUnique(C.NonVecVecUses[NonVecIdx], UsePackIdx);
       }
+      Out.push_back(std::move(A));
     }
   }
+
+  for (const auto &Entry : Cover) {
+    uint32_t Covered = static_cast<uint32_t>(std::bitset<32>(Entry.second).count());
+    if (Out.size() >= MaxAssemblies || Entry.second == Full ||
+        Covered * 2 < Width)
+      continue;
+    OperandAssembly A;
+    A.Sources.push_back(Entry.first);
+    A.NumInserts = Width - Covered;
+    Out.push_back(std::move(A));
+  }
+  return Out;
 }
 
-static void buildCircularConflicts(CandidatePairs &C, MemorySSA &MSSA) {
+static void buildCircularConflicts(CandidatePairs &C, MemorySSA &MSSA,
+                                   WorkBudget &Budget) {
   const size_t ConflictBuildLimit = 96;
   C.CircularConflicts.assign(C.Packs.size(), {});
   if (C.Packs.size() > ConflictBuildLimit)
     return;
 
+  // A PHI pack sits at the top of its block and reads its operands on the
+  // incoming edges, so a path back to it (through a loop's back-edge) is not
+  // a cycle in the schedule.
+  auto isPhiPack = [&](uint32_t P) {
+    return !C.Packs[P].empty() && isa<PHINode>(C.Packs[P].front());
+  };
   for (uint32_t I = 0; I < C.Packs.size(); ++I) {
+    if (isPhiPack(I))
+      continue;
     for (uint32_t J = I + 1; J < C.Packs.size(); ++J) {
-      if (packsOverlap(C.Packs[I], C.Packs[J]))
+      if (isPhiPack(J) || packsOverlap(C.Packs[I], C.Packs[J]))
         continue;
 
       bool DepIJ = false;
@@ -271,9 +304,11 @@ static void buildCircularConflicts(CandidatePairs &C, MemorySSA &MSSA) {
       for (const Instruction *A : C.Packs[I]) {
         for (const Instruction *B : C.Packs[J]) {
           DepIJ |= isTransitivelyDependent(const_cast<Instruction *>(A),
-                                           const_cast<Instruction *>(B), MSSA);
+                                           const_cast<Instruction *>(B), MSSA,
+                                           &Budget);
           DepJI |= isTransitivelyDependent(const_cast<Instruction *>(B),
-                                           const_cast<Instruction *>(A), MSSA);
+                                           const_cast<Instruction *>(A), MSSA,
+                                           &Budget);
           if (DepIJ && DepJI)
             break;
         }
@@ -289,8 +324,203 @@ static void buildCircularConflicts(CandidatePairs &C, MemorySSA &MSSA) {
   }
 }
 
+// Statements whose first two pack operands may be exchanged.
+static bool hasCommutativeOperands(const Instruction *I) {
+  if (isa<BinaryOperator>(I))
+    return I->isCommutative();
+  auto *II = dyn_cast<IntrinsicInst>(I);
+  return II && getPackableIntrinsic(II) != Intrinsic::not_intrinsic &&
+         II->isCommutative();
+}
+
+static bool shareCandidatePack(const CandidatePairs &C, const Instruction *A,
+                               const Instruction *B) {
+  auto It = C.InstToCandidates.find(A);
+  if (It == C.InstToCandidates.end())
+    return false;
+  return llvm::any_of(It->second, [&](const CandidateId &Id) {
+    return llvm::is_contained(C.Packs[Id.Index], B);
+  });
+}
+
+// How well A and B line up as the same operand of two lanes. Lanes of one
+// candidate pack score highest, then splats and constants, then isomorphic
+// statements, which look one level further into their own operands.
+static int operandMatchScore(const CandidatePairs &C, const Value *A,
+                             const Value *B, unsigned Depth) {
+  if (A == B || (isa<Constant>(A) && isa<Constant>(B)))
+    return 2;
+  auto *IA = dyn_cast<Instruction>(A);
+  auto *IB = dyn_cast<Instruction>(B);
+  if (!IA || !IB)
+    return 0;
+  if (shareCandidatePack(C, IA, IB))
+    return 4;
+  if (!areIsomorphic(IA, IB))
+    return 0;
+
+  int Score = 1;
+  if (Depth == 0 || accessesMemory(IA))
+    return Score;
+  for (unsigned Op = 0; Op < getNumPackOperands(IA); ++Op)
+    Score += operandMatchScore(C, getPackOperand(C, IA, Op),
+                               getPackOperand(C, IB, Op), Depth - 1);
+  return Score;
+}
+
+// Look-ahead operand reordering: every lane of a commutative pack takes the
+// operand order that best matches its first lane, so operand packs line up
+// with producer candidates instead of needing a permutation or a rebuild.
+// The choice is recorded in C.SwappedOperands rather than in the IR, so
+// functions where nothing is packed stay unchanged. Packs are visited in
+// candidate order, and a lane keeps the order chosen by the first pack that
+// reaches it.
+static void reorderCommutativeOperands(CandidatePairs &C) {
+  std::unordered_set<const Instruction *> Fixed;
+  for (const auto &Pack : C.Packs) {
+    if (Pack.size() < 2 || !llvm::all_of(Pack, hasCommutativeOperands))
+      continue;
+    const Instruction *Ref = Pack.front();
+    Fixed.insert(Ref);
+    for (size_t Lane = 1; Lane < Pack.size(); ++Lane) {
+      const Instruction *I = Pack[Lane];
+      if (!Fixed.insert(I).second)
+        continue;
+      Value *Ref0 = getPackOperand(C, Ref, 0);
+      Value *Ref1 = getPackOperand(C, Ref, 1);
+      Value *Op0 = getPackOperand(C, I, 0);
+      Value *Op1 = getPackOperand(C, I, 1);
+      int Keep = operandMatchScore(C, Ref0, Op0, 1) +
+                 operandMatchScore(C, Ref1, Op1, 1);
+      int Swap = operandMatchScore(C, Ref0, Op1, 1) +
+                 operandMatchScore(C, Ref1, Op0, 1);
+      if (Swap > Keep && !C.SwappedOperands.erase(I))
+        C.SwappedOperands.insert(I);
+    }
+  }
+}
+
+// Per-round bookkeeping shared by the pairing round and every widening round.
+// The first Keep packs are exempt from the candidate cap.
+static void finalizeCandidatePairs(CandidatePairs &C, MemorySSA &MSSA,
+                                   WorkBudget &Budget, bool debug,
+                                   size_t Keep = 0) {
+  const size_t MaxPacks = std::max(maxCandidatePacks(debug), Keep);
+  if (C.Packs.size() > MaxPacks)
+    C.Packs.resize(MaxPacks);
+
+  rebuildInstToCandidates(C);
+  reorderCommutativeOperands(C);
+  resetUseMaps(C);
+  buildCircularConflicts(C, MSSA, Budget);
+}
+
 } // namespace
 
+size_t maxCandidatePacks(bool debug) {
+  // Keep the ILP tractable and deterministic on large functions.
+  return debug ? 256 : 96;
+}
+
+Intrinsic::ID getPackableIntrinsic(const Instruction *I) {
+  auto *CI = dyn_cast<CallInst>(I);
+  if (!CI)
+    return Intrinsic::not_intrinsic;
+  Function *F = CI->getCalledFunction();
+  if (!F)
+    return Intrinsic::not_intrinsic;
+  switch (F->getIntrinsicID()) {
+  case Intrinsic::fmuladd:
+  case Intrinsic::fma:
+  case Intrinsic::sqrt:
+  case Intrinsic::fabs:
+  case Intrinsic::minnum:
+  case Intrinsic::maxnum:
+  case Intrinsic::copysign:
+  case Intrinsic::abs:
+  case Intrinsic::smin:
+  case Intrinsic::smax:
+  case Intrinsic::umin:
+  case Intrinsic::umax:
+    return F->getIntrinsicID();
+  default:
+    return Intrinsic::not_intrinsic;
+  }
+}
+
+bool isVectorLibraryCall(const Instruction *I, const TargetLibraryInfo *TLI) {
+  auto *CI = dyn_cast<CallInst>(I);
+  if (!TLI || !CI || CI->getIntrinsicID() != Intrinsic::not_intrinsic)
+    return false;
+  Function *F = CI->getCalledFunction();
+  if (!F || CI->mayReadOrWriteMemory() || !CI->getType()->isFloatingPointTy())
+    return false;
+  for (const Value *Arg : CI->args()) {
+    if (!Arg->getType()->isFloatingPointTy())
+      return false;
+  }
+  return TLI->isFunctionVectorizable(F->getName());
+}
+
+StringRef getVectorLibraryVariant(const Instruction *I,
+                                  const TargetLibraryInfo &TLI, unsigned Width,
+                                  unsigned &VF) {
+  StringRef ScalarName = cast<CallInst>(I)->getCalledFunction()->getName();
+  for (VF = static_cast<unsigned>(PowerOf2Ceil(Width)); VF <= 64; VF *= 2) {
+    StringRef Name =
+        TLI.getVectorizedFunction(ScalarName, ElementCount::getFixed(VF));
+    if (!Name.empty())
+      return Name;
+  }
+  VF = 0;
+  return StringRef();
+}
+
+unsigned getNumPackOperands(const Instruction *I) {
+  if (auto *CI = dyn_cast<CallInst>(I)) {
+    if (getPackableIntrinsic(CI) == Intrinsic::abs)
+      return 1;
+    return CI->arg_size();
+  }
+  return I->getNumOperands();
+}
+
+Value *getPackOperand(const Instruction *I, unsigned OpIdx) {
+  if (auto *CI = dyn_cast<CallInst>(I))
+    return CI->getArgOperand(OpIdx);
+  return I->getOperand(OpIdx);
+}
+
+Value *getPackOperand(const CandidatePairs &C, const Instruction *I,
+                      unsigned OpIdx) {
+  if (OpIdx < 2 && C.SwappedOperands.count(I))
+    OpIdx = 1 - OpIdx;
+  return getPackOperand(I, OpIdx);
+}
+
+unsigned getAlternateOpcode(unsigned Opcode) {
+  switch (Opcode) {
+  case Instruction::Add:
+    return Instruction::Sub;
+  case Instruction::Sub:
+    return Instruction::Add;
+  case Instruction::FAdd:
+    return Instruction::FSub;
+  case Instruction::FSub:
+    return Instruction::FAdd;
+  default:
+    return 0;
+  }
+}
+
+bool isAlternatingPack(const std::vector<const Instruction *> &Pack) {
+  if (Pack.empty() || !isa<BinaryOperator>(Pack.front()))
+    return false;
+  return llvm::any_of(Pack, [&](const Instruction *I) {
+    return I->getOpcode() != Pack.front()->getOpcode();
+  });
+}
+
 bool accessesMemory(const Instruction *I) {
   return isa<LoadInst>(I) || isa<StoreInst>(I);
 }
@@ -335,7 +565,8 @@ bool areIsomorphic(const Instruction *I1, const Instruction *I2) {
     if (!BO2)
       return false;
 
-    if (BO1->getOpcode() != BO2->getOpcode())
+    if (BO1->getOpcode() != BO2->getOpcode() &&
+        getAlternateOpcode(BO1->getOpcode()) != BO2->getOpcode())
       return false;
     if (BO1->getType() != BO2->getType())
       return false;
@@ -351,16 +582,54 @@ bool areIsomorphic(const Instruction *I1, const Instruction *I2) {
     return true;
   }
 
+  if (auto *UO1 = dyn_cast<UnaryOperator>(I1)) {
+    auto *UO2 = dyn_cast<UnaryOperator>(I2);
+    return UO2 && UO1->getOpcode() == UO2->getOpcode() &&
+           UO1->getType() == UO2->getType();
+  }
+
+  // Type-changing packs: both lanes must convert between the same types.
+  if (auto *Cast1 = dyn_cast<CastInst>(I1)) {
+    auto *Cast2 = dyn_cast<CastInst>(I2);
+    return Cast2 && Cast1->getOpcode() == Cast2->getOpcode() &&
+           Cast1->getSrcTy() == Cast2->getSrcTy() &&
+           Cast1->getDestTy() == Cast2->getDestTy();
+  }
+
+  if (auto *Cmp1 = dyn_cast<CmpInst>(I1)) {
+    auto *Cmp2 = dyn_cast<CmpInst>(I2);
+    return Cmp2 && Cmp1->getOpcode() == Cmp2->getOpcode() &&
+           Cmp1->getPredicate() == Cmp2->getPredicate() &&
+           Cmp1->getOperand(0)->getType() == Cmp2->getOperand(0)->getType();
+  }
+
+  // PHIs of one block that merge the same incoming edges in the same order,
+  // so incoming value K of every lane arrives along the same edge.
+  if (auto *Phi1 = dyn_cast<PHINode>(I1)) {
+    auto *Phi2 = dyn_cast<PHINode>(I2);
+    return Phi2 && Phi1->getType() == Phi2->getType() &&
+           Phi1->getParent() == Phi2->getParent() &&
+           llvm::equal(Phi1->blocks(), Phi2->blocks());
+  }
+
+  if (auto *Sel1 = dyn_cast<SelectInst>(I1)) {
+    auto *Sel2 = dyn_cast<SelectInst>(I2);
+    return Sel2 && Sel1->getType() == Sel2->getType() &&
+           Sel1->getCondition()->getType() == Sel2->getCondition()->getType();
+  }
+
   if (auto *CI1 = dyn_cast<CallInst>(I1)) {
     auto *CI2 = dyn_cast<CallInst>(I2);
     if (!CI2)
       return false;
-    Function *F1 = CI1->getCalledFunction();
-    Function *F2 = CI2->getCalledFunction();
-    if (!F1 || !F2)
+    // Library calls reach here only as candidates, so the same callee is
+    // enough; intrinsics must match on the ID.
+    Intrinsic::ID ID = getPackableIntrinsic(CI1);
+    if (getPackableIntrinsic(CI2) != ID)
       return false;
-    if (F1->getIntrinsicID() != Intrinsic::fmuladd ||
-        F2->getIntrinsicID() != Intrinsic::fmuladd)
+    if (ID == Intrinsic::not_intrinsic &&
+        (!CI1->getCalledFunction() ||
+         CI1->getCalledFunction() != CI2->getCalledFunction()))
       return false;
 
     if (CI1->getType() != CI2->getType())
@@ -371,6 +640,11 @@ bool areIsomorphic(const Instruction *I1, const Instruction *I2) {
       if (CI1->getArgOperand(I)->getType() != CI2->getArgOperand(I)->getType())
         return false;
     }
+    // Arguments that stay scalar in the vector call must agree.
+    for (unsigned I = getNumPackOperands(CI1); I < CI1->arg_size(); ++I) {
+      if (CI1->getArgOperand(I) != CI2->getArgOperand(I))
+        return false;
+    }
     return true;
   }
 
@@ -395,49 +669,205 @@ bool getAddrBaseAndOffset(const Instruction *I, const DataLayout &DL,
   if (!ElemTy->isSized())
     return false;
 
+  // The stripped pointer, not its underlying object: two addresses that
+  // share an object through different variable indices are not comparable.
   APInt Offset(DL.getIndexTypeSizeInBits(Ptr->getType()), 0);
-  const Value *PtrNoConstGEP =
-      Ptr->stripAndAccumulateInBoundsConstantOffsets(DL, Offset);
-  Base = getUnderlyingObject(PtrNoConstGEP);
+  Base = Ptr->stripAndAccumulateInBoundsConstantOffsets(DL, Offset);
   ByteOffset = Offset.getSExtValue();
   return true;
 }
 
-bool areAdjacentMemoryAccesses(const Instruction *I1, const Instruction *I2,
-                               const DataLayout &DL, AAResults &AA) {
-  if (!accessesMemory(I1) || !accessesMemory(I2))
-    return false;
+// Memory packs may reach this many lane-sized elements past their lowest
+// lane; seed pairs may be at most MaxMemPairStride elements apart.
+static constexpr int64_t MaxMemPackReach = 64;
+static constexpr int64_t MaxMemPairStride = 4;
 
-  bool IsLoad1 = isa<LoadInst>(I1);
-  bool IsLoad2 = isa<LoadInst>(I2);
-  if (IsLoad1 != IsLoad2)
-    return false;
+SmallVector<unsigned, 4> splitIntoPow2Parts(unsigned Width) {
+  SmallVector<unsigned, 4> Parts;
+  for (unsigned Bit = Width ? 1u << Log2_32(Width) : 0; Bit; Bit >>= 1) {
+    if (Width & Bit)
+      Parts.push_back(Bit);
+  }
+  return Parts;
+}
 
-  const Value *Base1 = nullptr;
-  const Value *Base2 = nullptr;
-  int64_t Off1 = 0;
-  int64_t Off2 = 0;
-  if (!getAddrBaseAndOffset(I1, DL, Base1, Off1) ||
-      !getAddrBaseAndOffset(I2, DL, Base2, Off2))
+bool analyzeMemPack(const std::vector<const Instruction *> &Lanes,
+                    const DataLayout &DL, MemPackLayout &Layout) {
+  if (Lanes.empty() || !accessesMemory(Lanes.front()))
     return false;
 
-  if (Base1 != Base2)
+  const bool IsLoad = isa<LoadInst>(Lanes.front());
+  Type *LaneTy = IsLoad
+                     ? Lanes.front()->getType()
+                     : cast<StoreInst>(Lanes.front())->getValueOperand()->getType();
+  // Lanes are addressed as elements of a vector, so padding would skew them.
+  if (!LaneTy->isSized() || !DL.typeSizeEqualsStoreSize(LaneTy))
+    return false;
+  const int64_t ElemSize = static_cast<int64_t>(DL.getTypeStoreSize(LaneTy));
+  if (ElemSize == 0)
     return false;
 
-  Type *ElemTy = nullptr;
-  if (auto *L = dyn_cast<LoadInst>(I1))
-    ElemTy = L->getType();
-  else
-    ElemTy = cast<StoreInst>(I1)->getValueOperand()->getType();
+  const int64_t Width = static_cast<int64_t>(Lanes.size());
+  std::vector<int64_t> Offsets;
+  Offsets.reserve(Width);
+  Layout.Base = nullptr;
+  for (const Instruction *I : Lanes) {
+    if (isa<LoadInst>(I) != IsLoad)
+      return false;
+    const Value *B = nullptr;
+    int64_t Off = 0;
+    if (!getAddrBaseAndOffset(I, DL, B, Off))
+      return false;
+    if (Layout.Base && B != Layout.Base)
+      return false;
+    Layout.Base = B;
+    Offsets.push_back(Off);
+  }
 
-  if (!ElemTy->isSized())
+  Layout.LaneTy = LaneTy;
+  Layout.BaseOffset = *std::min_element(Offsets.begin(), Offsets.end());
+  Layout.Elem.assign(Width, 0);
+  for (int64_t L = 0; L < Width; ++L) {
+    int64_t Diff = Offsets[L] - Layout.BaseOffset;
+    if (Diff % ElemSize != 0 || Diff / ElemSize >= MaxMemPackReach)
+      return false;
+    Layout.Elem[L] = Diff / ElemSize;
+  }
+
+  std::vector<int> Order(Width);
+  for (int L = 0; L < Width; ++L)
+    Order[L] = L;
+  llvm::sort(Order, [&](int A, int B) { return Layout.Elem[A] < Layout.Elem[B]; });
+  Layout.Rank.assign(Width, 0);
+  Layout.Stride = Width > 1 ? Layout.Elem[Order[1]] - Layout.Elem[Order[0]] : 1;
+  for (int K = 0; K < Width; ++K) {
+    Layout.Rank[Order[K]] = K;
+    if (K == 0)
+      continue;
+    int64_t Gap = Layout.Elem[Order[K]] - Layout.Elem[Order[K - 1]];
+    if (Gap == 0)
+      return false;
+    if (Gap != Layout.Stride)
+      Layout.Stride = 0;
+  }
+
+  const int64_t End = Layout.Elem[Order.back()] + 1;
+  Layout.Spans.clear();
+  if (End == Width) {
+    Layout.Shape = MemPackShape::Contiguous;
+    Layout.Spans.push_back({0, End});
+    return true;
+  }
+
+  // A run is worth reading (or masked-writing) whole while at least half of
+  // the elements it covers are lanes.
+  // Masked-off store lanes touch no memory, so a store run can be rounded up
+  // to a register-friendly length.
+  if (End <= 2 * Width) {
+    Layout.Shape = MemPackShape::Spans;
+    Layout.Spans.push_back(
+        {0, IsLoad ? End : static_cast<int64_t>(PowerOf2Ceil(End))});
+    return true;
+  }
+
+  if (IsLoad) {
+    int Cut = 1;
+    for (int K = 2; K < Width; ++K) {
+      if (Layout.Elem[Order[K]] - Layout.Elem[Order[K - 1]] >
+          Layout.Elem[Order[Cut]] - Layout.Elem[Order[Cut - 1]])
+        Cut = K;
+    }
+    int64_t LoEnd = Layout.Elem[Order[Cut - 1]] + 1;
+    int64_t HiBegin = Layout.Elem[Order[Cut]];
+    if (Cut >= 2 && Width - Cut >= 2 && LoEnd <= 2 * Cut &&
+        End - HiBegin <= 2 * (Width - Cut)) {
+      Layout.Shape = MemPackShape::Spans;
+      Layout.Spans.push_back({0, LoEnd});
+      Layout.Spans.push_back({HiBegin, End});
+      return true;
+    }
+  }
+
+  if (LaneTy->isVectorTy())
     return false;
+  Layout.Shape = MemPackShape::Gather;
+  return true;
+}
+
+std::vector<std::vector<uint32_t>> findInterleaveGroups(
+    const std::vector<std::vector<const Instruction *>> &Packs,
+    const DataLayout &DL) {
+  struct GroupKey {
+    bool IsLoad;
+    const Value *Base;
+    Type *LaneTy;
+    size_t Width;
+    int64_t Stride;
+    const BasicBlock *BB;
+    bool operator<(const GroupKey &O) const {
+      return std::tie(IsLoad, Base, LaneTy, Width, Stride, BB) <
+             std::tie(O.IsLoad, O.Base, O.LaneTy, O.Width, O.Stride, O.BB);
+    }
+  };
+
+  // Same-shaped strided packs, by the offset of their first field.
+  std::map<GroupKey, std::vector<std::pair<int64_t, uint32_t>>> Fields;
+  for (uint32_t P = 0; P < Packs.size(); ++P) {
+    MemPackLayout Layout;
+    // Predicated packs need a lane mask, which a group access lacks.
+    if (Packs[P].size() < 2 || isPredicatedPack(Packs[P]) ||
+        !analyzeMemPack(Packs[P], DL, Layout))
+      continue;
+    if (Layout.Stride < 2 || Layout.Stride > 4 || Layout.LaneTy->isVectorTy())
+      continue;
+    GroupKey Key{isa<LoadInst>(Packs[P].front()), Layout.Base, Layout.LaneTy,
+                 Packs[P].size(), Layout.Stride, Packs[P].front()->getParent()};
+    Fields[Key].push_back({Layout.BaseOffset, P});
+  }
+
+  std::vector<std::vector<uint32_t>> Groups;
+  for (auto &Entry : Fields) {
+    const int64_t Stride = Entry.first.Stride;
+    const int64_t ElemSize =
+        static_cast<int64_t>(DL.getTypeStoreSize(Entry.first.LaneTy));
+    auto &List = Entry.second;
+    llvm::sort(List);
+    List.erase(std::unique(List.begin(), List.end(),
+                           [](const auto &A, const auto &B) {
+                             return A.first == B.first;
+                           }),
+               List.end());
+
+    // A group needs every field, so Stride packs at consecutive offsets.
+    size_t J = 0;
+    while (J + Stride <= List.size()) {
+      bool Complete = true;
+      for (int64_t F = 1; F < Stride && Complete; ++F)
+        Complete = List[J + F].first == List[J].first + F * ElemSize;
+      if (!Complete) {
+        ++J;
+        continue;
+      }
+      std::vector<uint32_t> Group;
+      for (int64_t F = 0; F < Stride; ++F)
+        Group.push_back(List[J + F].second);
+      Groups.push_back(std::move(Group));
+      J += Stride;
+    }
+  }
+  return Groups;
+}
 
-  int64_t ElemSize = static_cast<int64_t>(DL.getTypeStoreSize(ElemTy));
-  return std::abs(Off1 - Off2) == ElemSize;
+bool arePackableMemoryAccesses(const Instruction *I1, const Instruction *I2,
+                               const DataLayout &DL) {
+  MemPackLayout Layout;
+  if (!analyzeMemPack({I1, I2}, DL, Layout))
+    return false;
+  return std::abs(Layout.Elem[0] - Layout.Elem[1]) <= MaxMemPairStride;
 }
 
-bool isTransitivelyDependent(Instruction *From, Instruction *To, MemorySSA &MSSA) {
+bool isTransitivelyDependent(Instruction *From, Instruction *To, MemorySSA &MSSA,
+                             WorkBudget *Budget) {
   if (From == To)
     return true;
 
@@ -452,6 +882,8 @@ bool isTransitivelyDependent(Instruction *From, Instruction *To, MemorySSA &MSSA
 
     if (Cur == To)
       return true;
+    if (Budget && !Budget->charge())
+      return true;
 
     for (User *U : Cur->users()) {
       if (auto *UI = dyn_cast<Instruction>(U)) {
@@ -480,9 +912,16 @@ bool isTransitivelyDependent(Instruction *From, Instruction *To, MemorySSA &MSSA
   return false;
 }
 
-bool areIndependent(Instruction *I1, Instruction *I2, MemorySSA &MSSA) {
-  if (isTransitivelyDependent(I1, I2, MSSA) ||
-      isTransitivelyDependent(I2, I1, MSSA))
+bool areIndependent(Instruction *I1, Instruction *I2, MemorySSA &MSSA,
+                    WorkBudget *Budget) {
+  // The PHIs of a block all take their values on entry, at once; a path
+  // from one to the other runs through a later entry (a loop's back-edge).
+  if (isa<PHINode>(I1) && isa<PHINode>(I2) &&
+      I1->getParent() == I2->getParent())
+    return true;
+
+  if (isTransitivelyDependent(I1, I2, MSSA, Budget) ||
+      isTransitivelyDependent(I2, I1, MSSA, Budget))
     return false;
 
   if (!I1->mayWriteToMemory() && !I2->mayWriteToMemory())
@@ -503,8 +942,42 @@ bool areIndependent(Instruction *I1, Instruction *I2, MemorySSA &MSSA) {
   return true;
 }
 
-bool areSchedulableTogether(Instruction *I1, Instruction *I2) {
-  return I1->getParent() == I2->getParent();
+bool areSchedulableTogether(Instruction *I1, Instruction *I2,
+                            const ControlEquivalence *CE) {
+  if (I1->getParent() == I2->getParent())
+    return true;
+  if (!CE)
+    return false;
+
+  Instruction *Upper = CE->comesBefore(I1, I2) ? I1 : I2;
+  Instruction *Lower = Upper == I1 ? I2 : I1;
+  if (CE->equivalent(I1->getParent(), I2->getParent())) {
+    if (isa<StoreInst>(I1))
+      return true;
+    return llvm::all_of(Lower->operands(), [&](const Value *Op) {
+      return CE->isAvailableAt(Op, Upper->getParent());
+    });
+  }
+
+  // Lanes of different guarded blocks are emitted together after the later
+  // guard: memory accesses get a mask, anything else runs unconditionally
+  // and so must be safe to speculate. Operands must exist there already or
+  // come from other lanes of the same guards.
+  if (!CE->guardedTogether(I1->getParent(), I2->getParent()))
+    return false;
+  if (!isa<LoadInst>(I1) && !isa<StoreInst>(I1) &&
+      (!isSafeToSpeculativelyExecute(I1) || !isSafeToSpeculativelyExecute(I2)))
+    return false;
+  BlockGuard G;
+  getBlockGuard(Lower->getParent(), G);
+  auto available = [&](const Value *Op) {
+    auto *OpI = dyn_cast<Instruction>(Op);
+    return !OpI || CE->DT.dominates(OpI, G.Head->getTerminator()) ||
+           OpI->getParent() == Lower->getParent() ||
+           CE->guardedTogether(OpI->getParent(), Lower->getParent());
+  };
+  return llvm::all_of(I1->operands(), available) &&
+         llvm::all_of(I2->operands(), available);
 }
 
 void addPack(CandidatePairs &C, const Instruction *I1, const Instruction *I2) {
@@ -514,7 +987,7 @@ void addPack(CandidatePairs &C, const Instruction *I1, const Instruction *I2) {
   C.Packs.push_back(std::move(Pack));
 }
 
-bool isCandidateStatement(Instruction *I) {
+bool isCandidateStatement(Instruction *I, const TargetLibraryInfo *TLI) {
   if (auto *L = dyn_cast<LoadInst>(I))
     return isScalarOrVectorIntOrFP(L->getType());
 
@@ -524,32 +997,70 @@ bool isCandidateStatement(Instruction *I) {
   if (auto *BO = dyn_cast<BinaryOperator>(I))
     return isScalarOrVectorIntOrFP(BO->getType());
 
-  if (auto *CI = dyn_cast<CallInst>(I)) {
-    if (Function *F = CI->getCalledFunction()) {
-      if (F->getIntrinsicID() == Intrinsic::fmuladd)
-        return true;
+  if (auto *UO = dyn_cast<UnaryOperator>(I))
+    return isScalarOrVectorIntOrFP(UO->getType());
+
+  // Value conversions only; pointer casts and bitcasts are not lane-wise.
+  if (auto *Cast = dyn_cast<CastInst>(I)) {
+    switch (Cast->getOpcode()) {
+    case Instruction::SExt:
+    case Instruction::ZExt:
+    case Instruction::Trunc:
+    case Instruction::FPExt:
+    case Instruction::FPTrunc:
+    case Instruction::SIToFP:
+    case Instruction::UIToFP:
+    case Instruction::FPToSI:
+    case Instruction::FPToUI:
+      return isScalarOrVectorIntOrFP(Cast->getSrcTy()) &&
+             isScalarOrVectorIntOrFP(Cast->getDestTy());
+    default:
+      return false;
     }
   }
 
+  if (auto *Cmp = dyn_cast<CmpInst>(I))
+    return isScalarOrVectorIntOrFP(Cmp->getOperand(0)->getType());
+
+  // A scalar condition selecting between vector lanes does not widen
+  // lane-wise, so the condition must have the shape of the values.
+  if (auto *Sel = dyn_cast<SelectInst>(I))
+    return isScalarOrVectorIntOrFP(Sel->getType()) &&
+           Sel->getCondition()->getType()->isVectorTy() ==
+               Sel->getType()->isVectorTy();
+
+  if (getPackableIntrinsic(I) != Intrinsic::not_intrinsic)
+    return isScalarOrVectorIntOrFP(I->getType());
+
+  if (isVectorLibraryCall(I, TLI))
+    return true;
+
+  // Loop-carried values (accumulators, running sums) become one vector PHI
+  // whose incoming values are packs built at the end of each predecessor.
+  if (auto *Phi = dyn_cast<PHINode>(I))
+    return isScalarOrVectorIntOrFP(Phi->getType()) &&
+           !Phi->getParent()->isEHPad();
+
   return false;
 }
 
 bool legalGoSLPPair(Instruction *I1, Instruction *I2, const DataLayout &DL,
-                    AAResults &AA, MemorySSA &MSSA) {
+                    AAResults &AA, MemorySSA &MSSA, WorkBudget *Budget,
+                    const ControlEquivalence *CE) {
   if (I1 == I2)
     return false;
 
   if (!areIsomorphic(I1, I2))
     return false;
 
-  if (!areIndependent(I1, I2, MSSA))
+  if (!areIndependent(I1, I2, MSSA, Budget))
     return false;
 
-  if (!areSchedulableTogether(I1, I2))
+  if (!areSchedulableTogether(I1, I2, CE))
     return false;
 
   if (accessesMemory(I1) || accessesMemory(I2)) {
-    if (!areAdjacentMemoryAccesses(I1, I2, DL, AA))
+    if (!arePackableMemoryAccesses(I1, I2, DL))
       return false;
   }
 
@@ -557,7 +1068,9 @@ bool legalGoSLPPair(Instruction *I1, Instruction *I2, const DataLayout &DL,
 }
 
 CandidatePairs collectCandidatePairs(Function &F, AAResults &AA, MemorySSA &MSSA,
-                                     bool debug) {
+                                     const TargetLibraryInfo *TLI,
+                                     const ControlEquivalence *CE,
+                                     WorkBudget &Budget, bool debug) {
   CandidatePairs Result;
   Module *M = F.getParent();
   if (!M)
@@ -565,10 +1078,48 @@ CandidatePairs collectCandidatePairs(Function &F, AAResults &AA, MemorySSA &MSSA
 
   const DataLayout &DL = M->getDataLayout();
   std::unordered_map<ValuePackKey, uint32_t, ValuePackKeyHash> PackToIdx;
+  std::vector<std::vector<const Instruction *>> Alternating;
+  std::vector<std::vector<const Instruction *>> Strided;
+
+  // Statements pair up within a block, or within a control-equivalence
+  // class whose blocks always run together. The guarded blocks hanging off
+  // one class form a group of their own, so runs of per-element guards can
+  // form predicated packs; those groups come last, and are the first to go
+  // when the candidate cap binds.
+  std::vector<std::vector<BasicBlock *>> Groups;
+  if (CE) {
+    std::vector<std::vector<BasicBlock *>> GuardedGroups;
+    std::unordered_map<const BasicBlock *, size_t> ClassIdx;
+    std::unordered_map<size_t, size_t> GuardedIdx;
+    for (const auto &Class : CE->classes()) {
+      BlockGuard G;
+      if (Class.size() == 1 && getBlockGuard(Class.front(), G)) {
+        auto It = ClassIdx.find(G.Head);
+        if (It != ClassIdx.end()) {
+          auto [GIt, New] =
+              GuardedIdx.try_emplace(It->second, GuardedGroups.size());
+          if (New)
+            GuardedGroups.emplace_back();
+          GuardedGroups[GIt->second].push_back(Class.front());
+          continue;
+        }
+      }
+      for (BasicBlock *BB : Class)
+        ClassIdx[BB] = Groups.size();
+      Groups.push_back(Class);
+    }
+    for (auto &Guarded : GuardedGroups)
+      Groups.push_back(std::move(Guarded));
+  } else {
+    for (BasicBlock &BB : F)
+      Groups.push_back({&BB});
+  }
 
-  for (BasicBlock &BB : F) {
+  for (const auto &Group : Groups) {
     struct IsoBucketKey {
-      unsigned Kind = 0; // 0 load, 1 store, 2 binop, 3 call
+      // 0 load, 1 store, 2 unary/binary op, 3 call, 4 cast, 5 cmp, 6 select,
+      // 7 phi
+      unsigned Kind = 0;
       unsigned OpcodeOrIntrinsic = 0;
       Type *Ty = nullptr;
       unsigned AddrSpace = 0;
@@ -590,41 +1141,80 @@ CandidatePairs collectCandidatePairs(Function &F, AAResults &AA, MemorySSA &MSSA
       }
     };
 
-    std::unordered_map<IsoBucketKey, std::vector<Instruction *>, IsoBucketHash>
-        Buckets;
+    // Buckets are kept in the order of their first statement; the hash only
+    // finds a key's bucket. Pack indices, the budget spent per bucket and
+    // which packs the candidate cap keeps all follow bucket order, so it
+    // must not depend on where the IR types were allocated.
+    std::unordered_map<IsoBucketKey, size_t, IsoBucketHash> BucketIdx;
+    std::vector<std::vector<Instruction *>> Buckets;
 
-    for (Instruction &I : BB) {
-      if (!isCandidateStatement(&I))
-        continue;
+    for (BasicBlock *BB : Group) {
+      for (Instruction &I : *BB) {
+        if (!isCandidateStatement(&I, TLI))
+          continue;
 
-      IsoBucketKey Key;
-      if (auto *LI = dyn_cast<LoadInst>(&I)) {
-        Key.Kind = 0;
-        Key.OpcodeOrIntrinsic = Instruction::Load;
-        Key.Ty = LI->getType();
-        Key.AddrSpace = LI->getPointerAddressSpace();
-      } else if (auto *SI = dyn_cast<StoreInst>(&I)) {
-        Key.Kind = 1;
-        Key.OpcodeOrIntrinsic = Instruction::Store;
-        Key.Ty = SI->getValueOperand()->getType();
-        Key.AddrSpace = SI->getPointerAddressSpace();
-      } else if (auto *BO = dyn_cast<BinaryOperator>(&I)) {
-        Key.Kind = 2;
-        Key.OpcodeOrIntrinsic = BO->getOpcode();
-        Key.Ty = BO->getType();
-      } else if (auto *CI = dyn_cast<CallInst>(&I)) {
-        Key.Kind = 3;
-        Key.OpcodeOrIntrinsic = CI->getIntrinsicID();
-        Key.Ty = CI->getType();
-      } else {
-        continue;
-      }
+        IsoBucketKey Key;
+        if (auto *LI = dyn_cast<LoadInst>(&I)) {
+          Key.Kind = 0;
+          Key.OpcodeOrIntrinsic = Instruction::Load;
+          Key.Ty = LI->getType();
+          Key.AddrSpace = LI->getPointerAddressSpace();
+        } else if (auto *SI = dyn_cast<StoreInst>(&I)) {
+          Key.Kind = 1;
+          Key.OpcodeOrIntrinsic = Instruction::Store;
+          Key.Ty = SI->getValueOperand()->getType();
+          Key.AddrSpace = SI->getPointerAddressSpace();
+        } else if (auto *BO = dyn_cast<BinaryOperator>(&I)) {
+          // add and sub (fadd and fsub) share a bucket so they can form
+          // alternating packs.
+          unsigned Alt = getAlternateOpcode(BO->getOpcode());
+          Key.Kind = 2;
+          Key.OpcodeOrIntrinsic =
+              Alt ? std::min<unsigned>(BO->getOpcode(), Alt) : BO->getOpcode();
+          Key.Ty = BO->getType();
+        } else if (auto *UO = dyn_cast<UnaryOperator>(&I)) {
+          Key.Kind = 2;
+          Key.OpcodeOrIntrinsic = UO->getOpcode();
+          Key.Ty = UO->getType();
+        } else if (auto *Cast = dyn_cast<CastInst>(&I)) {
+          // Same destination type; areIsomorphic also checks the source type.
+          Key.Kind = 4;
+          Key.OpcodeOrIntrinsic = Cast->getOpcode();
+          Key.Ty = Cast->getDestTy();
+        } else if (auto *Cmp = dyn_cast<CmpInst>(&I)) {
+          Key.Kind = 5;
+          Key.OpcodeOrIntrinsic = Cmp->getPredicate();
+          Key.Ty = Cmp->getOperand(0)->getType();
+        } else if (auto *Sel = dyn_cast<SelectInst>(&I)) {
+          Key.Kind = 6;
+          Key.OpcodeOrIntrinsic = Instruction::Select;
+          Key.Ty = Sel->getType();
+        } else if (auto *CI = dyn_cast<CallInst>(&I)) {
+          Key.Kind = 3;
+          Key.OpcodeOrIntrinsic = CI->getIntrinsicID();
+          Key.Ty = CI->getType();
+        } else if (auto *Phi = dyn_cast<PHINode>(&I)) {
+          Key.Kind = 7;
+          Key.OpcodeOrIntrinsic = Instruction::PHI;
+          Key.Ty = Phi->getType();
+        } else {
+          continue;
+        }
 
-      Buckets[Key].push_back(&I);
+        auto [It, New] = BucketIdx.try_emplace(Key, Buckets.size());
+        if (New)
+          Buckets.emplace_back();
+        Buckets[It->second].push_back(&I);
+      }
     }
 
-    for (auto &Entry : Buckets) {
-      auto &Stmts = Entry.second;
+    // Uniform pairs are added a pair from each bucket at a time, so one
+    // wide bucket (every fmul of the block, say) cannot use up the candidate
+    // cap before the stores that seed the packs are reached.
+    std::vector<std::vector<std::vector<const Instruction *>>> Uniform(
+        Buckets.size());
+    for (size_t B = 0; B < Buckets.size(); ++B) {
+      auto &Stmts = Buckets[B];
       const size_t PairBudgetPerBucket = debug ? 1000000 : 4096;
       size_t PairChecks = 0;
       for (size_t I = 0; I < Stmts.size(); ++I) {
@@ -633,33 +1223,311 @@ CandidatePairs collectCandidatePairs(Function &F, AAResults &AA, MemorySSA &MSSA
             break;
           Instruction *S1 = Stmts[I];
           Instruction *S2 = Stmts[J];
-          if (!legalGoSLPPair(S1, S2, DL, AA, MSSA))
+          if (!legalGoSLPPair(S1, S2, DL, AA, MSSA, &Budget, CE))
             continue;
 
           std::vector<const Instruction *> Pack{S1, S2};
-          addPackUnique(Result, PackToIdx, Pack);
+          MemPackLayout Layout;
+          if (accessesMemory(S1) && analyzeMemPack(Pack, DL, Layout) &&
+              Layout.Shape != MemPackShape::Contiguous)
+            Strided.push_back(std::move(Pack));
+          else if (S1->getOpcode() != S2->getOpcode())
+            Alternating.push_back(std::move(Pack));
+          else
+            Uniform[B].push_back(std::move(Pack));
         }
         if (PairChecks > PairBudgetPerBucket)
           break;
       }
     }
+    for (size_t K = 0;; ++K) {
+      bool Any = false;
+      for (const auto &Pairs : Uniform) {
+        if (K >= Pairs.size())
+          continue;
+        addPackUnique(Result, PackToIdx, Pairs[K]);
+        Any = true;
+      }
+      if (!Any)
+        break;
+    }
   }
 
-  if (!debug && Result.Packs.size() <= 96)
-    widenPacks(Result, DL, AA, MSSA, /*MaxWidth=*/8, PackToIdx);
+  // Alternating-opcode pairs and then non-adjacent memory pairs go last so
+  // the candidate cap drops them before any uniform pair. Among the memory
+  // pairs, those with isomorphic users (the fields of an interleaved group)
+  // come first.
+  for (const auto &Pack : Alternating)
+    addPackUnique(Result, PackToIdx, Pack);
+  std::stable_partition(Strided.begin(), Strided.end(), [](const auto &Pack) {
+    return feedsIsomorphicPair(Pack[0], Pack[1]);
+  });
+  for (const auto &Pack : Strided)
+    addPackUnique(Result, PackToIdx, Pack);
 
-  // Keep the ILP tractable and deterministic on large functions.
-  const size_t MaxPacks = debug ? 256 : 96;
-  if (Result.Packs.size() > MaxPacks)
-    Result.Packs.resize(MaxPacks);
+  finalizeCandidatePairs(Result, MSSA, Budget, debug);
+  return Result;
+}
 
-  rebuildInstToCandidates(Result);
-  buildUseMaps(Result);
-  buildCircularConflicts(Result, MSSA);
+CandidatePairs widenSelectedPacks(Function &F, const CandidatePairs &Prev,
+                                  const std::vector<bool> &Chosen,
+                                  MemorySSA &MSSA, WorkBudget &Budget,
+                                  const std::function<unsigned(const Instruction *)> &MaxWidthFor,
+                                  const ControlEquivalence *CE, bool debug,
+                                  bool &Widened) {
+  CandidatePairs Result;
+  Widened = false;
+  Module *M = F.getParent();
+  if (!M)
+    return Result;
+
+  const DataLayout &DL = M->getDataLayout();
+  std::unordered_map<ValuePackKey, uint32_t, ValuePackKeyHash> PackToIdx;
+
+  // The selected packs become this round's statements. They stay candidates
+  // themselves so the ILP can still keep a pack at its current width.
+  std::vector<std::vector<const Instruction *>> Survivors;
+  for (uint32_t P = 0; P < Prev.Packs.size() && P < Chosen.size(); ++P) {
+    if (Chosen[P] && !Prev.Packs[P].empty())
+      Survivors.push_back(Prev.Packs[P]);
+  }
+
+  // Orient each merge by program order so producer and consumer packs built
+  // from corresponding halves keep matching lane orders.
+  auto comesFirst = [CE](const std::vector<const Instruction *> &A,
+                         const std::vector<const Instruction *> &B) {
+    if (CE)
+      return CE->comesBefore(A.front(), B.front());
+    return A.front()->comesBefore(B.front());
+  };
+
+  // Statements of the previous round that no selected pack covers can still
+  // extend a survivor by one lane, which is how the 3-wide packs of xyz and
+  // rgb code form.
+  std::unordered_set<const Instruction *> Covered;
+  for (const auto &P : Survivors)
+    Covered.insert(P.begin(), P.end());
+  std::vector<std::vector<const Instruction *>> Loose;
+  for (const auto &P : Prev.Packs) {
+    for (const Instruction *I : P) {
+      if (Covered.insert(I).second)
+        Loose.push_back({I});
+    }
+  }
+
+  // Merges of equal halves keep power-of-two widths; uneven ones (4 + 2,
+  // 2 + 1, 8 + 4) give the odd widths in between.
+  std::vector<std::vector<const Instruction *>> Merged;
+  std::vector<std::vector<const Instruction *>> Uneven;
+  auto tryMerge = [&](const std::vector<const Instruction *> &P1,
+                      const std::vector<const Instruction *> &P2) {
+    if (P1.size() + P2.size() > MaxWidthFor(P1.front()))
+      return;
+    if (!canMergePacks(P1, P2, DL, MSSA, CE, Budget))
+      return;
+
+    const auto &Lo = comesFirst(P1, P2) ? P1 : P2;
+    const auto &Hi = &Lo == &P1 ? P2 : P1;
+    std::vector<const Instruction *> Wider;
+    Wider.reserve(Lo.size() + Hi.size());
+    Wider.insert(Wider.end(), Lo.begin(), Lo.end());
+    Wider.insert(Wider.end(), Hi.begin(), Hi.end());
+    (P1.size() == P2.size() ? Merged : Uneven).push_back(std::move(Wider));
+  };
+  for (size_t I = 0; I < Survivors.size(); ++I) {
+    for (size_t J = I + 1; J < Survivors.size() && !Budget.exhausted(); ++J)
+      tryMerge(Survivors[I], Survivors[J]);
+    for (size_t L = 0; L < Loose.size() && !Budget.exhausted(); ++L)
+      tryMerge(Survivors[I], Loose[L]);
+  }
 
+  if (Merged.empty() && Uneven.empty())
+    return Result;
+
+  // Survivors go first and are exempt from the candidate cap, so this round
+  // can always keep the previous selection; the cap only drops merges,
+  // uneven ones first.
+  for (const auto &P : Survivors)
+    addPackUnique(Result, PackToIdx, P);
+  const size_t NumSurvivors = Result.Packs.size();
+  for (const auto &P : Merged)
+    addPackUnique(Result, PackToIdx, P);
+  for (const auto &P : Uneven)
+    addPackUnique(Result, PackToIdx, P);
+
+  Widened = true;
+  // Lanes keep the operand order earlier rounds chose for them.
+  Result.SwappedOperands = Prev.SwappedOperands;
+  finalizeCandidatePairs(Result, MSSA, Budget, debug, NumSurvivors);
   return Result;
 }
 
+void ensurePackOperands(CandidatePairs &C, uint32_t UsePackIdx) {
+  if (UsePackIdx >= C.OperandsBuilt.size() || C.OperandsBuilt[UsePackIdx])
+    return;
+  C.OperandsBuilt[UsePackIdx] = true;
+
+  const auto &UsePack = C.Packs[UsePackIdx];
+  if (UsePack.empty())
+    return;
+
+  // A predicated load or store also reads its lanes' guard conditions, as
+  // its mask. They are only priced as an operand pack; the branches keep
+  // their scalar uses, so no lane use is recorded.
+  if (isa<LoadInst, StoreInst>(UsePack.front()) && isPredicatedPack(UsePack)) {
+    SmallVector<const Value *, 8> CondLanes;
+    bool AllInst = true;
+    for (const Instruction *I : UsePack) {
+      BlockGuard G;
+      getBlockGuard(I->getParent(), G);
+      CondLanes.push_back(G.Cond);
+      AllInst &= isa<Instruction>(G.Cond);
+    }
+    ValuePackKey CondKey = canonicalizeLaneValues(CondLanes);
+    SmallVector<uint32_t, 4> Sources;
+    if (AllInst)
+      findCandidatesWithLanes(C, CondLanes, CondKey, Sources);
+    for (uint32_t SrcPackIdx : Sources)
+      appendUnique(C.VecVecUses[SrcPackIdx], UsePackIdx);
+    if (Sources.empty()) {
+      auto It = C.NonVecPackToIndex.find(CondKey);
+      uint32_t NonVecIdx = It != C.NonVecPackToIndex.end()
+                               ? It->second
+                               : static_cast<uint32_t>(C.NonVecPacks.size());
+      if (It == C.NonVecPackToIndex.end()) {
+        C.NonVecPacks.push_back(CondKey);
+        C.NonVecPackToIndex.emplace(std::move(CondKey), NonVecIdx);
+      }
+      appendUnique(C.NonVecVecUses[NonVecIdx], UsePackIdx);
+    }
+  }
+
+  SmallVector<unsigned, 4> OpIndices;
+  if (isa<LoadInst>(UsePack.front())) {
+    // Vector loads don't require explicit operand packing in IR.
+    return;
+  } else if (isa<StoreInst>(UsePack.front())) {
+    // Only the stored value contributes to vector operand packing.
+    OpIndices.push_back(0);
+  } else {
+    for (unsigned OpIdx = 0; OpIdx < getNumPackOperands(UsePack.front()); ++OpIdx)
+      OpIndices.push_back(OpIdx);
+  }
+
+  for (unsigned OpIdx : OpIndices) {
+    SmallVector<const Value *, 8> OperandLanes;
+    OperandLanes.reserve(UsePack.size());
+    bool AllInst = true;
+    for (const Instruction *I : UsePack) {
+      const Value *Op = getPackOperand(C, I, OpIdx);
+      OperandLanes.push_back(Op);
+      if (!isa<Instruction>(Op))
+        AllInst = false;
+    }
+
+    ValuePackKey OpKey = canonicalizeLaneValues(OperandLanes);
+    SmallVector<uint32_t, 4> Sources;
+    if (AllInst)
+      findCandidatesWithLanes(C, OperandLanes, OpKey, Sources);
+
+    if (Sources.empty()) {
+      uint32_t NonVecIdx = 0;
+      auto It = C.NonVecPackToIndex.find(OpKey);
+      if (It != C.NonVecPackToIndex.end()) {
+        NonVecIdx = It->second;
+      } else {
+        NonVecIdx = static_cast<uint32_t>(C.NonVecPacks.size());
+        C.NonVecPacks.push_back(OpKey);
+        C.NonVecPackToIndex.emplace(std::move(OpKey), NonVecIdx);
+        auto Assemblies = findOperandAssemblies(C, OperandLanes, UsePackIdx);
+        if (!Assemblies.empty())
+          C.NonVecAssemblies[NonVecIdx] = std::move(Assemblies);
+      }
+      appendUnique(C.NonVecVecUses[NonVecIdx], UsePackIdx);
+
+      // Producer lanes an assembly reads stay in their vector when the user
+      // pack is selected, so they need no extract for this use.
+      auto AsmIt = C.NonVecAssemblies.find(NonVecIdx);
+      if (AsmIt == C.NonVecAssemblies.end())
+        continue;
+      for (const OperandAssembly &A : AsmIt->second) {
+        for (uint32_t SrcPackIdx : A.Sources) {
+          initLaneUses(C, SrcPackIdx);
+          const auto &SrcPack = C.Packs[SrcPackIdx];
+          for (const Instruction *UseInst : UsePack) {
+            const Value *OpVal = getPackOperand(C, UseInst, OpIdx);
+            for (uint32_t SrcLane = 0; SrcLane < SrcPack.size(); ++SrcLane) {
+              if (SrcPack[SrcLane] == OpVal)
+                appendUnique(C.LaneUses[SrcPackIdx][SrcLane].UserToVectorUses[UseInst],
+                             UsePackIdx);
+            }
+          }
+        }
+      }
+      continue;
+    }
+
+    for (uint32_t SrcPackIdx : Sources) {
+      if (SrcPackIdx == UsePackIdx)
+        continue;
+
+      appendUnique(C.VecVecUses[SrcPackIdx], UsePackIdx);
+
+      initLaneUses(C, SrcPackIdx);
+      const auto &SrcPack = C.Packs[SrcPackIdx];
+      for (const Instruction *UseInst : UsePack) {
+        const Value *OpVal = getPackOperand(C, UseInst, OpIdx);
+        for (uint32_t SrcLane = 0; SrcLane < SrcPack.size(); ++SrcLane) {
+          if (SrcPack[SrcLane] != OpVal)
+            continue;
+          auto &LanesMap = C.LaneUses[SrcPackIdx][SrcLane].UserToVectorUses;
+          appendUnique(LanesMap[UseInst], UsePackIdx);
+        }
+      }
+    }
+  }
+}
+
+void ensurePackUses(CandidatePairs &C, uint32_t P) {
+  if (P >= C.UsesBuilt.size() || C.UsesBuilt[P])
+    return;
+  C.UsesBuilt[P] = true;
+
+  initLaneUses(C, P);
+  // Any pack that consumes P as an operand contains a scalar user of one of
+  // P's lanes, so materializing those packs' operands completes P's entries.
+  for (const Instruction *I : C.Packs[P]) {
+    for (const User *U : I->users()) {
+      auto *UI = dyn_cast<Instruction>(U);
+      if (!UI)
+        continue;
+      // A guard condition is also read, as a mask, by predicated loads and
+      // stores of the blocks its branch guards.
+      if (auto *Br = dyn_cast<BranchInst>(UI)) {
+        for (const BasicBlock *Succ : successors(Br)) {
+          BlockGuard G;
+          if (!getBlockGuard(Succ, G) || G.Head != Br->getParent())
+            continue;
+          for (const Instruction &GI : *Succ) {
+            auto GIt = C.InstToCandidates.find(&GI);
+            if (!isa<LoadInst, StoreInst>(GI) ||
+                GIt == C.InstToCandidates.end())
+              continue;
+            for (const CandidateId &Id : GIt->second)
+              ensurePackOperands(C, Id.Index);
+          }
+        }
+        continue;
+      }
+      auto It = C.InstToCandidates.find(UI);
+      if (It == C.InstToCandidates.end())
+        continue;
+      for (const CandidateId &Id : It->second)
+        ensurePackOperands(C, Id.Index);
+    }
+  }
+}
+
 void printCandidatePairs(const CandidatePairs &CP) {
   errs() << "===== CandidatePairs =====\n";
 
@@ -3,12 +3,14 @@
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/Operator.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/MemorySSA.h"
 #include "llvm/Analysis/MemoryLocation.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
 #include "llvm/Analysis/ValueTracking.h"
 #include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/ArrayRef.h"
@@ -18,11 +20,16 @@
 #include <unordered_set>
 #include <cstdint>
 #include <algorithm>
+#include <functional>
 #include <utility>
 #include <queue>
 
+#include "WorkBudget.hpp"
+
 using namespace llvm;
 
+class ControlEquivalence;
+
 struct CandidateId {
   uint32_t Width;  // current pack width
   uint32_t Index;  // index
@@ -51,10 +58,29 @@ struct LaneUseInfo {
   std::unordered_map<const Instruction *, std::vector<uint32_t>> UserToVectorUses;
 };
 
+// A way to build a non-vector operand pack from candidate producer vectors
+// rather than scalar inserts. It applies once every Source is selected.
+struct OperandAssembly {
+  enum ShapeKind {
+    SubvectorOfOne, // an aligned run of one wider producer
+    PermuteOne,     // lanes of one producer in another order or width
+    ConcatTwo,      // two half-width producers back to back
+    PermuteTwo      // lanes picked from two producers
+  };
+  ShapeKind Shape = PermuteOne;
+  SmallVector<uint32_t, 2> Sources; // candidate pack indices
+  uint32_t SubvectorIndex = 0;      // first producer lane for SubvectorOfOne
+  uint32_t NumInserts = 0;          // lanes no source covers
+};
+
 struct CandidatePairs {
   std::vector<std::vector<const Instruction *>> Packs;
   std::unordered_map<const Instruction *, std::vector<CandidateId>> InstToCandidates;
 
+  // The use maps below are built lazily and memoized per pack; see
+  // ensurePackOperands() and ensurePackUses(). Entries only cover the packs
+  // that have been materialized so far.
+
   // Candidate vector pack -> vectorized user packs that can consume it.
   std::unordered_map<uint32_t, std::vector<uint32_t>> VecVecUses;
 
@@ -62,29 +88,144 @@ struct CandidatePairs {
   std::vector<ValuePackKey> NonVecPacks;
   std::unordered_map<ValuePackKey, uint32_t, ValuePackKeyHash> NonVecPackToIndex;
   std::unordered_map<uint32_t, std::vector<uint32_t>> NonVecVecUses;
+  // Non-vector pack -> cheaper ways to assemble it from partial or multiple
+  // producer packs.
+  std::unordered_map<uint32_t, std::vector<OperandAssembly>> NonVecAssemblies;
 
-  // Per pack/lane extraction analysis data.
+  // Per pack/lane extraction analysis data (empty until materialized).
   std::vector<std::vector<LaneUseInfo>> LaneUses;
 
   // Circular dependency conflicts between candidate packs.
   std::vector<std::vector<uint32_t>> CircularConflicts;
+
+  // Memoization state for the lazy use maps.
+  std::vector<bool> OperandsBuilt;
+  std::vector<bool> UsesBuilt;
+
+  // Commutative lanes whose first two pack operands are read in swapped
+  // order, as chosen by operand reordering. The IR is left untouched; the
+  // use maps, shuffle costs and emission read operands through
+  // getPackOperand(C, I, OpIdx).
+  std::unordered_set<const Instruction *> SwappedOperands;
 };
 
+// Intrinsic ID if I is a call to an intrinsic GoSLP can pack, else
+// Intrinsic::not_intrinsic.
+Intrinsic::ID getPackableIntrinsic(const Instruction *I);
+// True if I is a direct call to a library function (expf, logf, ...) that
+// does not touch memory and has a vector variant in TLI.
+bool isVectorLibraryCall(const Instruction *I, const TargetLibraryInfo *TLI);
+// Name of the vector variant a Width-lane pack of library call I uses: the
+// narrowest one with at least Width lanes, whose lane count is returned in VF
+// (extra lanes are padding). Empty if TLI has none.
+StringRef getVectorLibraryVariant(const Instruction *I,
+    const TargetLibraryInfo &TLI, unsigned Width, unsigned &VF);
+// Lane operands of a packable statement: call arguments for calls (the callee
+// is not an operand, nor are trailing flags such as llvm.abs's
+// is_int_min_poison, which stay scalar), all operands otherwise.
+unsigned getNumPackOperands(const Instruction *I);
+Value *getPackOperand(const Instruction *I, unsigned OpIdx);
+// Pack operand OpIdx of I in the order operand reordering chose for it.
+Value *getPackOperand(const CandidatePairs &C, const Instruction *I,
+                      unsigned OpIdx);
 bool accessesMemory(const Instruction *I);
 bool isScalarOrVectorIntOrFP(Type *Ty);
+// The opcode an alternating pack may mix with Opcode (add with sub, fadd
+// with fsub), or 0 if there is none.
+unsigned getAlternateOpcode(unsigned Opcode);
+// True if Pack mixes an opcode with its alternate; such packs are emitted as
+// both vector ops plus a blend.
+bool isAlternatingPack(const std::vector<const Instruction *> &Pack);
 bool areIsomorphic(const Instruction *I1, const Instruction *I2);
+// Base is the address with its constant inbounds offsets stripped, so two
+// accesses with the same Base differ exactly by their ByteOffsets.
 bool getAddrBaseAndOffset(const Instruction *I, const DataLayout &DL,
         const Value *&Base, int64_t &ByteOffset);
-bool areAdjacentMemoryAccesses(const Instruction *I1, const Instruction *I2,
-  const DataLayout &DL, AAResults &AA);
-bool isTransitivelyDependent(Instruction *From, Instruction *To, MemorySSA &MSSA);
-bool areIndependent(Instruction *I1, Instruction *I2, MemorySSA &MSSA);
-bool areSchedulableTogether(Instruction *I1, Instruction *I2);
+
+enum class MemPackShape {
+  Contiguous, // a permutation of Width consecutive elements: one wide access
+  Spans,      // loads: one or two runs read whole and shuffled; stores: one
+              // run written with a masked store
+  Gather,     // anything else: masked gather / scatter
+};
+
+// Where the lanes of a load or store pack sit in memory. All lanes share one
+// base pointer and have distinct constant offsets.
+struct MemPackLayout {
+  MemPackShape Shape = MemPackShape::Contiguous;
+  Type *LaneTy = nullptr;
+  const Value *Base = nullptr;
+  // Byte offset of the lowest-addressed lane from Base.
+  int64_t BaseOffset = 0;
+  // Element index of each lane relative to the lowest-addressed lane, in
+  // LaneTy units, and each lane's position in address order.
+  std::vector<int64_t> Elem;
+  std::vector<int> Rank;
+  // Element ranges [first, second) covered by the wide accesses.
+  SmallVector<std::pair<int64_t, int64_t>, 2> Spans;
+  // Distance in elements between consecutive lanes if it is uniform, else 0.
+  int64_t Stride = 0;
+};
+
+// Classifies a memory pack; false if the lanes cannot form one (different
+// bases, overlapping lanes, sub-vector lanes that would need a gather, or a
+// reach beyond MaxMemPackReach elements).
+bool analyzeMemPack(const std::vector<const Instruction *> &Lanes,
+        const DataLayout &DL, MemPackLayout &Layout);
+// Power-of-two widths, widest first, that a contiguous access of Width lanes
+// is split into when Width is not a power of two (7 -> 4, 2, 1): a full
+// vector plus narrower tail vectors.
+SmallVector<unsigned, 4> splitIntoPow2Parts(unsigned Width);
+// Interleaved (array-of-structs) access groups among Packs: Stride packs of
+// the same width, base and lane type, stride 2-4, whose lanes together cover
+// Width consecutive records of Stride elements, such as the x, y and z fields
+// of four points. Each group lists pack indices in field order.
+std::vector<std::vector<uint32_t>> findInterleaveGroups(
+    const std::vector<std::vector<const Instruction *>> &Packs,
+    const DataLayout &DL);
+// Two loads or two stores close enough to seed a memory pack: same base,
+// at most MaxMemPairStride elements apart.
+bool arePackableMemoryAccesses(const Instruction *I1, const Instruction *I2,
+  const DataLayout &DL);
+// Dependence queries charge one budget unit per visited instruction and answer
+// conservatively (dependent) once the budget is exhausted.
+bool isTransitivelyDependent(Instruction *From, Instruction *To, MemorySSA &MSSA,
+    WorkBudget *Budget = nullptr);
+bool areIndependent(Instruction *I1, Instruction *I2, MemorySSA &MSSA,
+    WorkBudget *Budget = nullptr);
+// Same block, or (given CE) control-equivalent blocks where the later lane
+// could join the earlier one: stores sink to the later block, everything
+// else is hoisted to the end of the earlier one, so its operands must be
+// available there.
+bool areSchedulableTogether(Instruction *I1, Instruction *I2,
+    const ControlEquivalence *CE = nullptr);
 void addPack(CandidatePairs &C, const Instruction *I1, const Instruction *I2);
-bool isCandidateStatement(Instruction *I);
+bool isCandidateStatement(Instruction *I, const TargetLibraryInfo *TLI = nullptr);
+// Candidate packs a round keeps; the rest are dropped in collection order.
+size_t maxCandidatePacks(bool debug);
 bool legalGoSLPPair(Instruction *I1, Instruction *I2, const DataLayout &DL,
-    AAResults &AA, MemorySSA &MSSA);
-CandidatePairs collectCandidatePairs(Function &F, AAResults &AA, MemorySSA &MSSA, bool debug);
+    AAResults &AA, MemorySSA &MSSA, WorkBudget *Budget = nullptr,
+    const ControlEquivalence *CE = nullptr);
+// Pairing round: every legal pair of isomorphic statements of one block, or
+// of one control-equivalence class when CE is given.
+CandidatePairs collectCandidatePairs(Function &F, AAResults &AA, MemorySSA &MSSA,
+    const TargetLibraryInfo *TLI, const ControlEquivalence *CE,
+    WorkBudget &Budget, bool debug);
+// Widening round: the packs chosen from Prev plus every legal merge of two of
+// them, up to MaxWidthFor(first statement) lanes. The chosen packs come first
+// and are never dropped by the candidate cap. Widened is false when nothing
+// could be merged.
+CandidatePairs widenSelectedPacks(Function &F, const CandidatePairs &Prev,
+    const std::vector<bool> &Chosen, MemorySSA &MSSA, WorkBudget &Budget,
+    const std::function<unsigned(const Instruction *)> &MaxWidthFor,
+    const ControlEquivalence *CE, bool debug, bool &Widened);
+
 
+// Records the operand packs of P: VecVecUses/LaneUses entries for candidate
+// producers and NonVecVecUses entries for everything else.
+void ensurePackOperands(CandidatePairs &C, uint32_t P);
+// Completes VecVecUses[P] and LaneUses[P] by materializing the operands of
+// every candidate that consumes one of P's lanes.
+void ensurePackUses(CandidatePairs &C, uint32_t P);
 
 void printCandidatePairs(const CandidatePairs &CP);
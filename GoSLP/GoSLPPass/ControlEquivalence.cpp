@@ -0,0 +1,102 @@
+#include "ControlEquivalence.hpp"
+
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/IR/Instructions.h"
+
+bool getBlockGuard(const BasicBlock *BB, BlockGuard &G) {
+  const BasicBlock *Head = BB->getSinglePredecessor();
+  const BasicBlock *Join = BB->getSingleSuccessor();
+  if (!Head || !Join || Head == BB || Join == BB)
+    return false;
+  auto *Br = dyn_cast<BranchInst>(Head->getTerminator());
+  if (!Br || !Br->isConditional())
+    return false;
+  if (Br->getSuccessor(0) == BB && Br->getSuccessor(1) == Join)
+    G.Negated = false;
+  else if (Br->getSuccessor(1) == BB && Br->getSuccessor(0) == Join)
+    G.Negated = true;
+  else
+    return false;
+  G.Head = const_cast<BasicBlock *>(Head);
+  G.Cond = Br->getCondition();
+  return true;
+}
+
+bool isPredicatedPack(const std::vector<const Instruction *> &Pack) {
+  if (Pack.empty())
+    return false;
+  const BasicBlock *BB = Pack.front()->getParent();
+  BlockGuard G;
+  return getBlockGuard(BB, G) &&
+         llvm::any_of(Pack, [&](const Instruction *I) {
+           return I->getParent() != BB;
+         });
+}
+
+ControlEquivalence::ControlEquivalence(Function &F, DominatorTree &DT,
+                                       PostDominatorTree &PDT, LoopInfo &LI)
+    : DT(DT), PDT(PDT) {
+  ReversePostOrderTraversal<Function *> RPOT(&F);
+  for (BasicBlock *BB : RPOT) {
+    Order[BB] = static_cast<unsigned>(Order.size());
+
+    // Join the class of the nearest dominator this block post-dominates.
+    // Dominators come earlier in reverse post-order, so theirs is known.
+    int Class = -1;
+    for (DomTreeNode *N = DT.getNode(BB) ? DT.getNode(BB)->getIDom() : nullptr;
+         N && N->getBlock(); N = N->getIDom()) {
+      BasicBlock *Dom = N->getBlock();
+      if (LI.getLoopFor(Dom) == LI.getLoopFor(BB) && PDT.dominates(BB, Dom)) {
+        Class = static_cast<int>(ClassOf[Dom]);
+        break;
+      }
+    }
+    if (Class < 0) {
+      Class = static_cast<int>(Classes.size());
+      Classes.emplace_back();
+    }
+    ClassOf[BB] = static_cast<unsigned>(Class);
+    Classes[Class].push_back(BB);
+  }
+}
+
+bool ControlEquivalence::equivalent(const BasicBlock *A,
+                                    const BasicBlock *B) const {
+  if (A == B)
+    return true;
+  auto ItA = ClassOf.find(A);
+  auto ItB = ClassOf.find(B);
+  return ItA != ClassOf.end() && ItB != ClassOf.end() &&
+         ItA->second == ItB->second;
+}
+
+bool ControlEquivalence::guardedTogether(const BasicBlock *A,
+                                         const BasicBlock *B) const {
+  BlockGuard GA, GB;
+  return A != B && getBlockGuard(A, GA) && getBlockGuard(B, GB) &&
+         equivalent(GA.Head, GB.Head);
+}
+
+bool ControlEquivalence::comesBefore(const Instruction *A,
+                                     const Instruction *B) const {
+  const BasicBlock *BA = A->getParent();
+  const BasicBlock *BB = B->getParent();
+  if (BA == BB)
+    return A->comesBefore(B);
+  auto ItA = Order.find(BA);
+  auto ItB = Order.find(BB);
+  if (ItA == Order.end() || ItB == Order.end())
+    return false;
+  return ItA->second < ItB->second;
+}
+
+bool ControlEquivalence::isAvailableAt(const Value *V,
+                                       const BasicBlock *BB) const {
+  auto *I = dyn_cast<Instruction>(V);
+  if (!I)
+    return true;
+  if (DT.dominates(I, BB->getTerminator()))
+    return true;
+  return !isa<PHINode>(I) && equivalent(I->getParent(), BB);
+}
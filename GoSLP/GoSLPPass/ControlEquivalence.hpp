@@ -0,0 +1,65 @@
+#pragma once
+#include <unordered_map>
+#include <vector>
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+
+using namespace llvm;
+
+// A block that runs only when its single predecessor's conditional branch
+// takes the edge to it, and that falls through to the branch's other target
+// (the then-block of an if without an else). Negated is set when the block
+// hangs off the false edge.
+struct BlockGuard {
+  BasicBlock *Head = nullptr;
+  Value *Cond = nullptr;
+  bool Negated = false;
+};
+
+bool getBlockGuard(const BasicBlock *BB, BlockGuard &G);
+// True if Pack's lanes sit in different guarded blocks. Such a pack is
+// if-converted: it is emitted after the last guard's condition, with the
+// guard conditions as a lane mask for its loads and stores.
+bool isPredicatedPack(const std::vector<const Instruction *> &Pack);
+
+// Control-equivalence classes of a function's blocks. Two blocks are
+// equivalent when one dominates the other, the other post-dominates the
+// first, and both sit in the same innermost loop: they then run exactly as
+// often as each other (a guard that always falls through, the head and join
+// of an if-then-else diamond). Statements of equivalent blocks may share a
+// pack; placeCrossBlockPacks() moves the lanes into one block before
+// scheduling.
+class ControlEquivalence {
+public:
+  ControlEquivalence(Function &F, DominatorTree &DT, PostDominatorTree &PDT,
+                     LoopInfo &LI);
+
+  bool equivalent(const BasicBlock *A, const BasicBlock *B) const;
+  // True if A and B are distinct guarded blocks whose heads are equivalent,
+  // as in a run of per-element guards (if (m[0]) ...; if (m[1]) ...).
+  bool guardedTogether(const BasicBlock *A, const BasicBlock *B) const;
+  // Program order extended across the blocks of one class: the blocks of a
+  // class form a dominance chain, so earlier blocks come first.
+  bool comesBefore(const Instruction *A, const Instruction *B) const;
+  // True if V can be made available at the end of BB: it is not an
+  // instruction, already dominates BB's terminator, or is a non-PHI
+  // statement of BB's class that could be hoisted there.
+  bool isAvailableAt(const Value *V, const BasicBlock *BB) const;
+
+  // Classes in reverse post-order of their first block; each lists its
+  // blocks top to bottom. Unreachable blocks are not in any class.
+  const std::vector<std::vector<BasicBlock *>> &classes() const {
+    return Classes;
+  }
+
+  DominatorTree &DT;
+  PostDominatorTree &PDT;
+
+private:
+  std::vector<std::vector<BasicBlock *>> Classes;
+  std::unordered_map<const BasicBlock *, unsigned> ClassOf;
+  // Reverse post-order number of each reachable block.
+  std::unordered_map<const BasicBlock *, unsigned> Order;
+};
@@ -1,475 +1,1202 @@
 //Emit.cpp
 #include "Emit.hpp"
+#include "ControlEquivalence.hpp"
+
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include <map>
+
+namespace {
+
+enum class pack_kind { op, load, store, phi };
+
+// Everything emission needs to know about one chosen pack, decided up front
+// so that packs which cannot be emitted are dropped before any IR changes.
+struct pack_plan {
+    int idx = -1;
+    pack_kind kind = pack_kind::op;
+    std::vector<const Instruction *> lanes; // after the DP lane permutation
+    Type *lane_ty = nullptr;                // scalar (or sub-vector) lane type
+    int sub_width = 1;
+    MemPackLayout layout;                   // memory packs only
+    std::vector<int> mem_index;             // address-order rank of each lane
+    int base_lane = 0;                      // lowest-addressed lane
+    Instruction *anchor = nullptr;          // vector code goes before this
+    // Predicated packs only: each lane's guard condition and whether the
+    // lane runs when it is false, and the pack's emission order among the
+    // predicated packs sharing its anchor (producers first).
+    bool predicated = false;
+    std::vector<Value *> guards;
+    std::vector<bool> negated;
+    int depth = 0;
+};
+
+using block_order = std::unordered_map<const BasicBlock *, unsigned>;
+
+// Where the elements of an already-emitted scalar live: sub_width elements of
+// vec starting at start.
+struct vec_lane {
+    Value *vec = nullptr;
+    int start = 0;
+};
+
+using lane_map = std::unordered_map<const Value *, vec_lane>;
+
+Instruction *mut(const Instruction *inst) {
+    return const_cast<Instruction *>(inst);
+}
 
-bool good_mem_ops(const std::vector<const Instruction *> &lanes, const DataLayout &DL,
-    Type *elem_ty, std::vector<int> &mem_index) {
+// a strictly before b, treating other blocks as dominated. Every chosen pack
+// sits in one block once placeCrossBlockPacks has run, and a value used in
+// another block is defined in a block that dominates it.
+bool before(const Instruction *a, const Instruction *b) {
+    if (a->getParent() != b->getParent())
+        return true;
+    return a->comesBefore(b);
+}
 
-    int width = lanes.size();
-    mem_index.assign(width, 0);
-    if (!elem_ty->isSized()) {
-        return false;
-    }
+Type *mem_lane_type(const Instruction *inst) {
+    if (auto *ld = dyn_cast<LoadInst>(inst))
+        return ld->getType();
+    return cast<StoreInst>(inst)->getValueOperand()->getType();
+}
 
-    int elem_size = DL.getTypeStoreSize(elem_ty);
-    if (elem_size == 0) {
-        return false;
+// The lane of a memory pack at element elem of its layout.
+Instruction *lane_at(const pack_plan &plan, int64_t elem) {
+    for (int lane = 0; lane < (int)plan.lanes.size(); ++lane) {
+        if (plan.layout.Elem[lane] == elem)
+            return mut(plan.lanes[lane]);
     }
+    return nullptr;
+}
 
-    std::vector<const Value *> bases(width, nullptr);
-    std::vector<int> offs(width, 0);
-    for (int i = 0; i < width; ++i) {
-        const Instruction *inst = lanes[i];
-        const Value *base = nullptr;
-        int64_t byte_offset = 0;
-        if (!getAddrBaseAndOffset(inst, DL, base, byte_offset)) {
-            return false;
+Align min_align(const pack_plan &plan) {
+    Align align = getLoadStoreAlignment(mut(plan.lanes[0]));
+    for (const Instruction *inst : plan.lanes)
+        align = std::min(align, getLoadStoreAlignment(mut(inst)));
+    return align;
+}
+
+// Lane addresses as one vector of pointers, in address order.
+Value *gather_pointers(const pack_plan &plan, const DataLayout &DL, IRBuilder<> &builder) {
+    Value *base = const_cast<Value *>(plan.layout.Base);
+    int64_t elem_size = static_cast<int64_t>(DL.getTypeStoreSize(plan.lane_ty));
+    Type *index_ty = DL.getIndexType(base->getType());
+    std::vector<Constant *> offsets(plan.lanes.size());
+    for (int lane = 0; lane < (int)plan.lanes.size(); ++lane)
+        offsets[plan.mem_index[lane]] = ConstantInt::get(index_ty,
+                plan.layout.BaseOffset + plan.layout.Elem[lane] * elem_size);
+    return builder.CreateInBoundsGEP(builder.getInt8Ty(), base,
+            ConstantVector::get(offsets), "goslp.ptrs");
+}
+
+// Odd-width contiguous packs are accessed as a full vector plus narrower
+// tail vectors (splitIntoPow2Parts); each part starts at the lane of that
+// rank in address order.
+Value *load_parts(const pack_plan &plan, FixedVectorType *wide_ty, IRBuilder<> &builder) {
+    Type *elem_ty = wide_ty->getElementType();
+    Value *vec = nullptr;
+    int rank = 0;
+    for (unsigned part : splitIntoPow2Parts(plan.lanes.size())) {
+        auto *first = cast<LoadInst>(lane_at(plan, rank));
+        LoadInst *load = builder.CreateLoad(FixedVectorType::get(elem_ty, part * plan.sub_width),
+                first->getPointerOperand(), "goslp.vload");
+        load->setAlignment(first->getAlign());
+        rank += part;
+        if (!vec) {
+            vec = load;
+            continue;
         }
-        bases[i] = base;
-        offs[i] = byte_offset;
+        // Parts shrink, so the tail is padded to the head's length.
+        int head = cast<FixedVectorType>(vec->getType())->getNumElements();
+        int tail = part * plan.sub_width;
+        std::vector<int> pad(head, -1);
+        for (int i = 0; i < tail; ++i)
+            pad[i] = i;
+        Value *padded = builder.CreateShuffleVector(load, PoisonValue::get(load->getType()), pad, "goslp.pad");
+        std::vector<int> concat(head + tail);
+        for (int i = 0; i < head + tail; ++i)
+            concat[i] = i;
+        vec = builder.CreateShuffleVector(vec, padded, concat, "goslp.concat");
     }
+    return vec;
+}
 
+// Loads the pack's lanes into one vector in address order: a single wide
+// load (split into parts for odd widths), whole runs plus a shuffle that
+// drops the holes, or a gather.
+Value *load_pack(const pack_plan &plan, FixedVectorType *wide_ty, const DataLayout &DL,
+        IRBuilder<> &builder) {
+    const MemPackLayout &layout = plan.layout;
+    int width = plan.lanes.size();
+    Type *elem_ty = wide_ty->getElementType();
+    Value *all_lanes = Constant::getAllOnesValue(FixedVectorType::get(builder.getInt1Ty(), width));
+
+    if (layout.Shape == MemPackShape::Gather)
+        return builder.CreateMaskedGather(wide_ty, gather_pointers(plan, DL, builder),
+                min_align(plan), all_lanes, nullptr, "goslp.gather");
+
+    if (layout.Shape == MemPackShape::Contiguous && !isPowerOf2_32(width))
+        return load_parts(plan, wide_ty, builder);
+
+    std::vector<Value *> runs;
+    for (const auto &span : layout.Spans) {
+        auto *first = cast<LoadInst>(lane_at(plan, span.first));
+        auto *run_ty = FixedVectorType::get(elem_ty, (span.second - span.first) * plan.sub_width);
+        LoadInst *run = builder.CreateLoad(run_ty, first->getPointerOperand(), "goslp.vload");
+        run->setAlignment(first->getAlign());
+        runs.push_back(run);
+    }
+    if (layout.Shape == MemPackShape::Contiguous)
+        return runs[0];
+
+    // Two runs of different lengths are padded to a common type first.
+    int run_len = cast<FixedVectorType>(runs[0]->getType())->getNumElements();
+    if (runs.size() == 2) {
+        int hi_len = cast<FixedVectorType>(runs[1]->getType())->getNumElements();
+        int len = std::max(run_len, hi_len);
+        for (Value *&run : runs) {
+            int n = cast<FixedVectorType>(run->getType())->getNumElements();
+            if (n == len)
+                continue;
+            std::vector<int> pad(len, -1);
+            for (int i = 0; i < n; ++i)
+                pad[i] = i;
+            run = builder.CreateShuffleVector(run, PoisonValue::get(run->getType()), pad, "goslp.pad");
+        }
+        run_len = len;
+    }
 
-    int off_min = offs[0];
-    for (int i = 1; i < width; ++i) {
-        if (offs[i] < off_min)
-            off_min = offs[i];
+    std::vector<int> mask(width * plan.sub_width);
+    for (int lane = 0; lane < width; ++lane) {
+        int64_t elem = layout.Elem[lane];
+        int run = (runs.size() == 2 && elem >= layout.Spans[1].first) ? 1 : 0;
+        int64_t at = (elem - layout.Spans[run].first) * plan.sub_width + run * run_len;
+        for (int j = 0; j < plan.sub_width; ++j)
+            mask[plan.mem_index[lane] * plan.sub_width + j] = at + j;
     }
+    Value *second = runs.size() == 2 ? runs[1] : PoisonValue::get(runs[0]->getType());
+    return builder.CreateShuffleVector(runs[0], second, mask, "goslp.lanes");
+}
 
-    std::vector<int> pos(width, -1);
-    std::vector<bool> used(width, false);
-    for (int i = 0; i < width; ++i) {
-        int diff = offs[i] - off_min;
-        if (diff < 0) {
-            return false;
+// Stores vec (the lanes in address order): one wide store (split into parts
+// for odd widths), a masked store over the run the lanes cover, or a scatter.
+void store_pack(const pack_plan &plan, Value *vec, const DataLayout &DL, IRBuilder<> &builder) {
+    const MemPackLayout &layout = plan.layout;
+    int width = plan.lanes.size();
+    if (layout.Shape == MemPackShape::Contiguous && !isPowerOf2_32(width)) {
+        int rank = 0;
+        for (unsigned part : splitIntoPow2Parts(width)) {
+            std::vector<int> cut(part * plan.sub_width);
+            for (int i = 0; i < (int)cut.size(); ++i)
+                cut[i] = rank * plan.sub_width + i;
+            Value *piece = builder.CreateShuffleVector(vec, PoisonValue::get(vec->getType()), cut, "goslp.part");
+            auto *first = cast<StoreInst>(lane_at(plan, rank));
+            StoreInst *part_store = builder.CreateStore(piece, first->getPointerOperand());
+            part_store->setAlignment(first->getAlign());
+            rank += part;
         }
-        if (diff % elem_size != 0) {
-            return false;
-        }
-        int idx = (diff / elem_size);
-        if (idx < 0 || idx >= width) {
-            return false;
-        }
-        if (used[idx]) {
-            return false;
-        }
-        used[idx] = true;
-        pos[i] = idx;
+        return;
+    }
+    if (layout.Shape == MemPackShape::Contiguous) {
+        auto *base_store = cast<StoreInst>(mut(plan.lanes[plan.base_lane]));
+        StoreInst *vec_store = builder.CreateStore(vec, base_store->getPointerOperand());
+        vec_store->setAlignment(base_store->getAlign());
+        return;
     }
 
-    for (int i = 0; i < width; ++i) {
-        if (!used[i]) {
-            return false;
+    if (layout.Shape == MemPackShape::Gather) {
+        Value *all_lanes = Constant::getAllOnesValue(FixedVectorType::get(builder.getInt1Ty(), width));
+        builder.CreateMaskedScatter(vec, gather_pointers(plan, DL, builder), min_align(plan), all_lanes);
+        return;
+    }
+
+    int span_len = (layout.Spans[0].second - layout.Spans[0].first) * plan.sub_width;
+    std::vector<int> spread(span_len, -1);
+    std::vector<Constant *> enabled(span_len, builder.getFalse());
+    for (int lane = 0; lane < width; ++lane) {
+        for (int j = 0; j < plan.sub_width; ++j) {
+            int at = layout.Elem[lane] * plan.sub_width + j;
+            spread[at] = plan.mem_index[lane] * plan.sub_width + j;
+            enabled[at] = builder.getTrue();
         }
     }
-    for (int i = 0; i < width; ++i) {
-        mem_index[i] = pos[i];
+    Value *run = builder.CreateShuffleVector(vec, PoisonValue::get(vec->getType()), spread, "goslp.spread");
+    auto *first = cast<StoreInst>(mut(plan.lanes[plan.base_lane]));
+    builder.CreateMaskedStore(run, first->getPointerOperand(), min_align(plan),
+            ConstantVector::get(enabled));
+}
+
+// Statements whose vector form applies the scalar operation lane by lane.
+bool is_lanewise_op(const Instruction *inst, const TargetLibraryInfo &TLI) {
+    return isa<BinaryOperator>(inst) || isa<UnaryOperator>(inst) ||
+           isa<CastInst>(inst) || isa<CmpInst>(inst) || isa<SelectInst>(inst) ||
+           getPackableIntrinsic(inst) != Intrinsic::not_intrinsic ||
+           isVectorLibraryCall(inst, &TLI);
+}
+
+// Calls the TLI vector variant of a library function. Narrower packs are
+// padded with poison lanes up to the variant's width and cut back after.
+Value *create_library_call(const CallInst *first, ArrayRef<Value *> ops,
+        FixedVectorType *wide_ty, const TargetLibraryInfo &TLI,
+        IRBuilder<> &builder) {
+    int width = wide_ty->getNumElements();
+    unsigned vf = 0;
+    StringRef name = getVectorLibraryVariant(first, TLI, width, vf);
+
+    std::vector<int> pad_mask(vf, -1);
+    for (int lane = 0; lane < width; ++lane)
+        pad_mask[lane] = lane;
+    std::vector<Value *> args;
+    std::vector<Type *> arg_tys;
+    for (Value *op : ops) {
+        if ((int)vf != width)
+            op = builder.CreateShuffleVector(op, PoisonValue::get(op->getType()), pad_mask, "goslp.pad");
+        args.push_back(op);
+        arg_tys.push_back(op->getType());
     }
 
-    return true;
+    Module *M = builder.GetInsertBlock()->getModule();
+    auto *fn_ty = FunctionType::get(FixedVectorType::get(wide_ty->getElementType(), vf), arg_tys, false);
+    FunctionCallee callee = M->getOrInsertFunction(name, fn_ty);
+    CallInst *call = builder.CreateCall(callee, args, "goslp.vec");
+    call->setCallingConv(first->getCallingConv());
+    call->setDoesNotAccessMemory();
+    if ((int)vf == width)
+        return call;
+
+    std::vector<int> cut_mask(width);
+    for (int lane = 0; lane < width; ++lane)
+        cut_mask[lane] = lane;
+    return builder.CreateShuffleVector(call, PoisonValue::get(call->getType()), cut_mask, "goslp.cut");
 }
 
-bool iterativeLoadStorePack(const std::vector<const Instruction *> &lanes_copy, Type *val_ty, bool is_load, 
-        const DataLayout &DL, LLVMContext &ctx, IRBuilder<> &builder, std::vector<Instruction *> &to_erase) {
-            
-    int width = lanes_copy.size();
-    if (width == 0) {
-        return false;
+// The vector counterpart of first, applied to already-gathered operands.
+Value *create_vector_op(const Instruction *first, ArrayRef<Value *> ops,
+        FixedVectorType *wide_ty, const TargetLibraryInfo &TLI, IRBuilder<> &builder) {
+    if (auto *bin_op = dyn_cast<BinaryOperator>(first))
+        return builder.CreateBinOp(bin_op->getOpcode(), ops[0], ops[1], "goslp.vec");
+    if (auto *un_op = dyn_cast<UnaryOperator>(first))
+        return builder.CreateUnOp(un_op->getOpcode(), ops[0], "goslp.vec");
+    // wide_ty is the destination type, so the lane count carries over even
+    // when the element width (and the register count) changes.
+    if (auto *cast_op = dyn_cast<CastInst>(first))
+        return builder.CreateCast(cast_op->getOpcode(), ops[0], wide_ty, "goslp.vec");
+    if (auto *cmp = dyn_cast<CmpInst>(first))
+        return builder.CreateCmp(cmp->getPredicate(), ops[0], ops[1], "goslp.vec");
+    if (isa<SelectInst>(first))
+        return builder.CreateSelect(ops[0], ops[1], ops[2], "goslp.vec");
+    Intrinsic::ID id = getPackableIntrinsic(first);
+    if (id == Intrinsic::not_intrinsic)
+        return create_library_call(cast<CallInst>(first), ops, wide_ty, TLI, builder);
+
+    // Trailing arguments that stay scalar (llvm.abs's poison flag) are taken
+    // from the first lane; areIsomorphic made sure all lanes agree.
+    auto *call = cast<CallInst>(first);
+    std::vector<Value *> args(ops.begin(), ops.end());
+    for (unsigned arg = getNumPackOperands(call); arg < call->arg_size(); ++arg)
+        args.push_back(call->getArgOperand(arg));
+    return builder.CreateIntrinsic(id, {wide_ty}, args, {}, "goslp.vec");
+}
+
+// Alternating packs (add/sub, fadd/fsub): both vector ops over all lanes
+// and a blend that takes each lane from its own opcode, the pattern targets
+// match to addsub-style instructions. Each op keeps the flags its lanes
+// share.
+Value *create_alternating_op(const pack_plan &plan, ArrayRef<Value *> ops, IRBuilder<> &builder) {
+    int width = plan.lanes.size();
+    int num_elts = width * plan.sub_width;
+    unsigned opcodes[2] = {plan.lanes[0]->getOpcode(), getAlternateOpcode(plan.lanes[0]->getOpcode())};
+
+    Value *results[2];
+    for (int k = 0; k < 2; ++k) {
+        results[k] = builder.CreateBinOp(static_cast<Instruction::BinaryOps>(opcodes[k]),
+                ops[0], ops[1], "goslp.alt");
+        auto *inst = dyn_cast<Instruction>(results[k]);
+        bool first = true;
+        for (const Instruction *lane : plan.lanes) {
+            if (!inst || lane->getOpcode() != opcodes[k])
+                continue;
+            if (first)
+                inst->copyIRFlags(lane);
+            else
+                inst->andIRFlags(lane);
+            first = false;
+        }
     }
-    auto *vec_ty_in_lane = dyn_cast<FixedVectorType>(val_ty);
-    if (!vec_ty_in_lane) {
-        return false;
+
+    std::vector<int> mask(num_elts);
+    for (int lane = 0; lane < width; ++lane) {
+        int from = plan.lanes[lane]->getOpcode() == opcodes[0] ? 0 : num_elts;
+        for (int j = 0; j < plan.sub_width; ++j)
+            mask[lane * plan.sub_width + j] = from + lane * plan.sub_width + j;
     }
+    return builder.CreateShuffleVector(results[0], results[1], mask, "goslp.vec");
+}
 
-    Type *scalar_ty = vec_ty_in_lane->getElementType();
-    int sub_width = vec_ty_in_lane->getNumElements();
-    int total_width = width * sub_width;
-    std::vector<int> mem_index;
-    if (!good_mem_ops(lanes_copy, DL, val_ty, mem_index)) {
+// Predicated packs (lanes in different guarded blocks) are if-converted:
+// emitted before the last guard's branch, with the guard conditions as the
+// mask of their loads and stores. Other statements run on every lane, which
+// pairing only allowed for ones that are safe to speculate. Dense
+// power-of-two accesses become masked loads and stores, any other layout a
+// masked gather or scatter.
+bool make_predicated_plan(pack_plan &plan, const DataLayout &DL, const block_order &block_rank) {
+    if (plan.sub_width != 1)
         return false;
+    plan.predicated = true;
+    BasicBlock *last_head = nullptr;
+    for (const Instruction *inst : plan.lanes) {
+        BlockGuard guard;
+        if (!getBlockGuard(inst->getParent(), guard))
+            return false;
+        if (plan.kind == pack_kind::op && !isSafeToSpeculativelyExecute(inst))
+            return false;
+        plan.guards.push_back(guard.Cond);
+        plan.negated.push_back(guard.Negated);
+        if (!last_head || block_rank.at(last_head) < block_rank.at(guard.Head))
+            last_head = guard.Head;
     }
+    plan.anchor = last_head->getTerminator();
+    if (plan.kind == pack_kind::op)
+        return true;
 
-    int base_lane = -1;
-    for (int lane = 0; lane < width; ++lane) {
-        if (mem_index[lane] == 0u) {
-            base_lane = (int)lane;
-            break;
-        }
-    }
-    if (base_lane < 0) {
+    if (!analyzeMemPack(plan.lanes, DL, plan.layout))
         return false;
+    plan.mem_index = plan.layout.Rank;
+    for (int lane = 0; lane < (int)plan.lanes.size(); ++lane) {
+        if (plan.mem_index[lane] == 0)
+            plan.base_lane = lane;
     }
+    return true;
+}
 
-    auto *wide_vec_ty = FixedVectorType::get(scalar_ty, total_width);
-    if (is_load) {
-        auto *base_load = cast<LoadInst>(const_cast<Instruction *>(lanes_copy[base_lane]));
-        Value *base_ptr = base_load->getPointerOperand();
-        auto *ptr_ty = cast<PointerType>(base_ptr->getType());
-        int addr_space = ptr_ty->getAddressSpace();
-        auto *wide_ptr_ty = PointerType::get(wide_vec_ty, addr_space);
-        Value *wide_ptr = builder.CreateBitCast(base_ptr, wide_ptr_ty, "goslp.ld.ptr.wide");
-        LoadInst *wide_load = builder.CreateLoad(wide_vec_ty, wide_ptr, "goslp.vload.wide");
-        wide_load->setAlignment(base_load->getAlign());
+bool make_plan(const CandidatePairs &C, int idx, const Perms &LanePerm,
+        const DataLayout &DL, const TargetLibraryInfo &TLI, const block_order &block_rank,
+        pack_plan &plan) {
+    const auto &pack = C.Packs[idx];
+    if (pack.empty())
+        return false;
 
-        for (int lane = 0; lane < width; ++lane) {
-            Instruction *old_inst = const_cast<Instruction *>(lanes_copy[lane]);
-            int block_idx = mem_index[lane];
-            int start_scalar = block_idx * sub_width;
+    plan.idx = idx;
+    if (llvm::all_of(pack, [&](const Instruction *I) { return is_lanewise_op(I, TLI); }))
+        plan.kind = pack_kind::op;
+    else if (llvm::all_of(pack, [](const Instruction *I) { return isa<PHINode>(I); }))
+        plan.kind = pack_kind::phi;
+    else if (llvm::all_of(pack, [](const Instruction *I) {
+                 auto *ld = dyn_cast<LoadInst>(I);
+                 return ld && ld->isSimple();
+             }))
+        plan.kind = pack_kind::load;
+    else if (llvm::all_of(pack, [](const Instruction *I) {
+                 auto *st = dyn_cast<StoreInst>(I);
+                 return st && st->isSimple();
+             }))
+        plan.kind = pack_kind::store;
+    else
+        return false;
 
-            std::vector<Constant *> mask_elems;
-            mask_elems.reserve(sub_width);
-            for (int j = 0; j < sub_width; ++j) {
-                int wide_index = start_scalar + j;
-                mask_elems.push_back(ConstantInt::get(Type::getInt32Ty(ctx), wide_index));
-            }
+    plan.lanes = pack;
+    auto perm = LanePerm.find(idx);
+    if (perm != LanePerm.end() && perm->second.size() == pack.size()) {
+        const Permutation &P = perm->second;
+        for (size_t j = 0; j < pack.size(); ++j) {
+            if (P[j] < pack.size())
+                plan.lanes[j] = pack[P[j]];
+        }
+    }
 
-            Constant *mask = ConstantVector::get(mask_elems);
-            Value *undef_vec = UndefValue::get(wide_vec_ty);
-            Value *replacement = builder.CreateShuffleVector(wide_load, undef_vec, mask, "goslp.ld.wide.subvec");
+    bool is_mem = plan.kind == pack_kind::load || plan.kind == pack_kind::store;
+    plan.lane_ty = is_mem ? mem_lane_type(plan.lanes[0]) : plan.lanes[0]->getType();
+    if (auto *vec_ty = dyn_cast<FixedVectorType>(plan.lane_ty))
+        plan.sub_width = vec_ty->getNumElements();
 
-            old_inst->replaceAllUsesWith(replacement);
-            to_erase.push_back(old_inst);
-        }
+    // A vector PHI replaces the lanes at the top of their block; its lanes
+    // are taken apart right after the block's PHIs.
+    if (plan.kind == pack_kind::phi) {
+        plan.anchor = &*mut(plan.lanes[0])->getParent()->getFirstInsertionPt();
         return true;
-    } 
-    else {
-        auto *base_store = cast<StoreInst>(const_cast<Instruction *>(lanes_copy[base_lane]));
-        Value *base_ptr = base_store->getPointerOperand();
-        auto *ptr_ty = cast<PointerType>(base_ptr->getType());
-        int addr_space = ptr_ty->getAddressSpace();
-        auto *wide_ptr_ty = PointerType::get(wide_vec_ty, addr_space);
-        Value *wide_val = UndefValue::get(wide_vec_ty);
+    }
 
-        for (int lane = 0; lane < width; ++lane) {
-            auto *st = cast<StoreInst>(const_cast<Instruction *>(lanes_copy[lane]));
-            Value *lane_val = st->getValueOperand(); 
+    if (plan.kind == pack_kind::op) {
+        unsigned vf = 0;
+        if (isVectorLibraryCall(plan.lanes[0], &TLI) &&
+                getVectorLibraryVariant(plan.lanes[0], TLI, plan.lanes.size(), vf).empty())
+            return false;
+    }
+    if (isPredicatedPack(plan.lanes))
+        return make_predicated_plan(plan, DL, block_rank);
+
+    Instruction *earliest = mut(plan.lanes[0]);
+    Instruction *latest = mut(plan.lanes[0]);
+    for (const Instruction *inst : plan.lanes) {
+        if (inst->comesBefore(earliest))
+            earliest = mut(inst);
+        if (latest->comesBefore(inst))
+            latest = mut(inst);
+    }
 
-            int block_idx = mem_index[lane];
-            int start_scalar = block_idx * sub_width;
-            for (int j = 0; j < sub_width; ++j) {
-                Value *idx_val = builder.getInt32(j);
-                Value *elem = builder.CreateExtractElement(lane_val, idx_val, "goslp.st.wide.elem");
-                int wide_index = start_scalar + j;
-                wide_val = builder.CreateInsertElement(wide_val, elem, builder.getInt32(wide_index), "goslp.st.wide.ins");
-            }
-        }
+    if (plan.kind == pack_kind::op) {
+        plan.anchor = latest;
+        return true;
+    }
+
+    if (!analyzeMemPack(plan.lanes, DL, plan.layout))
+        return false;
+    plan.mem_index = plan.layout.Rank;
+    for (int lane = 0; lane < (int)plan.lanes.size(); ++lane) {
+        if (plan.mem_index[lane] == 0)
+            plan.base_lane = lane;
+    }
 
-        Value *wide_ptr = builder.CreateBitCast(base_ptr, wide_ptr_ty, "goslp.st.ptr.wide");
-        StoreInst *wide_store = builder.CreateStore(wide_val, wide_ptr);
-        wide_store->setAlignment(base_store->getAlign());
+    if (plan.kind == pack_kind::store) {
+        plan.anchor = latest;
+        return true;
+    }
 
-        for (int lane = 0; lane < width; ++lane) {
-            Instruction *st_inst = const_cast<Instruction *>(lanes_copy[lane]);
-            to_erase.push_back(st_inst);
+    // Loads are hoisted to the first lane; every address the wide accesses
+    // start from must exist there.
+    plan.anchor = earliest;
+    std::vector<const Value *> ptrs;
+    if (plan.layout.Shape == MemPackShape::Gather) {
+        ptrs.push_back(plan.layout.Base);
+    } else if (plan.layout.Shape == MemPackShape::Contiguous &&
+               !isPowerOf2_32(plan.lanes.size())) {
+        int rank = 0;
+        for (unsigned part : splitIntoPow2Parts(plan.lanes.size())) {
+            ptrs.push_back(getLoadStorePointerOperand(lane_at(plan, rank)));
+            rank += part;
         }
+    } else {
+        for (const auto &span : plan.layout.Spans)
+            ptrs.push_back(getLoadStorePointerOperand(lane_at(plan, span.first)));
+    }
+    for (const Value *ptr : ptrs) {
+        auto *ptr_inst = dyn_cast<Instruction>(ptr);
+        if (ptr_inst && !before(ptr_inst, plan.anchor))
+            return false;
+    }
+    return true;
+}
 
-        return true;
+// Values a pack reads at its anchor: the operand lanes of a statement pack,
+// the stored values of a store pack, and a predicated pack's guards.
+std::vector<const Value *> plan_inputs(const pack_plan &plan) {
+    std::vector<const Value *> inputs(plan.guards.begin(), plan.guards.end());
+    for (const Instruction *inst : plan.lanes) {
+        if (plan.kind == pack_kind::op) {
+            for (unsigned op = 0; op < getNumPackOperands(inst); ++op)
+                inputs.push_back(getPackOperand(inst, op));
+        } else if (plan.kind == pack_kind::store) {
+            inputs.push_back(cast<StoreInst>(inst)->getValueOperand());
+        }
     }
+    return inputs;
 }
 
-bool emit(Function &F, CandidatePairs &C, const std::vector<bool> &Chosen, const Perms &LanePerm, bool debug) {
-    bool changed = false;
-    std::vector<Instruction *> to_erase;
+// A predicated pack is emitted at the last guard instead of in the guarded
+// blocks. Everything it reads must be available there: defined before it, or
+// a lane of another predicated pack emitted there first. Its lanes' scalar
+// users must run after it or be lanes of such packs emitted after it.
+bool predicated_is_valid(const pack_plan &plan, const std::vector<pack_plan> &plans,
+        const std::unordered_map<const Instruction *, int> &lane_owner,
+        const DominatorTree &DT) {
+    auto shares_anchor = [&](const Instruction *inst) {
+        auto it = lane_owner.find(inst);
+        return it != lane_owner.end() && plans[it->second].predicated &&
+               plans[it->second].anchor == plan.anchor;
+    };
 
-    if (C.Packs.empty() || Chosen.size() < C.Packs.size()) {
-        return false;
+    for (const Value *val : plan_inputs(plan)) {
+        auto *inst = dyn_cast<Instruction>(val);
+        if (inst && !DT.dominates(inst, plan.anchor) && !shares_anchor(inst))
+            return false;
     }
-
-    Module *M = F.getParent();
-    if (!M) {
+    auto *base = dyn_cast_or_null<Instruction>(plan.layout.Base);
+    if (plan.kind != pack_kind::op && base && !DT.dominates(base, plan.anchor))
         return false;
+
+    for (const Instruction *inst : plan.lanes) {
+        for (const User *U : inst->users()) {
+            auto *user = dyn_cast<Instruction>(U);
+            if (!user || (!isa<PHINode>(user) && DT.dominates(plan.anchor, user)))
+                continue;
+            if (!shares_anchor(user) || plans[lane_owner.find(user)->second].kind == pack_kind::load)
+                return false;
+        }
     }
-    const DataLayout &DL = M->getDataLayout();
-    LLVMContext &ctx = F.getContext();
+    return true;
+}
 
-    // Emit load/store packs first, then arithmetic, to keep dominance sane.
-    std::vector<int> worklist;
-    for (int i = 0; i < static_cast<int>(C.Packs.size()); ++i) {
-        if (Chosen[i])
-            worklist.push_back(i);
+// A pack's results are defined at its anchor. Every scalar user that runs
+// before that point must be a lane of another emitted pack that is anchored
+// later, since those lanes are rebuilt from the vector and deleted.
+bool anchor_is_valid(const pack_plan &plan, const std::vector<pack_plan> &plans,
+        const std::unordered_map<const Instruction *, int> &lane_owner,
+        const DominatorTree &DT) {
+    if (plan.predicated)
+        return predicated_is_valid(plan, plans, lane_owner, DT);
+    if (plan.kind != pack_kind::op)
+        return true;
+
+    for (const Instruction *inst : plan.lanes) {
+        for (const User *U : inst->users()) {
+            auto *user = dyn_cast<Instruction>(U);
+            if (!user || isa<PHINode>(user) || !before(user, plan.anchor) ||
+                    user->getParent() != plan.anchor->getParent())
+                continue;
+            auto it = lane_owner.find(user);
+            if (it == lane_owner.end())
+                return false;
+            const pack_plan &consumer = plans[it->second];
+            if (consumer.kind == pack_kind::load || !before(plan.anchor, consumer.anchor))
+                return false;
+        }
     }
-    auto isLoadOrStorePack = [](const std::vector<const Instruction *> &lanes) {
-        return llvm::all_of(lanes, [](const Instruction *I) { return isa<LoadInst>(I); }) ||
-               llvm::all_of(lanes, [](const Instruction *I) { return isa<StoreInst>(I); });
+    return true;
+}
+
+// Builds the wide operand whose lane l holds vals[l]. Lanes that already live
+// in emitted vectors are read from them: up to two source vectors of any
+// width become a single shufflevector (the DP lane permutation is folded
+// into its mask, and the narrower source is padded first). Lanes no source
+// covers are inserted: a uniform scalar operand becomes a splat, and
+// constant lanes seed the vector so that only the rest needs an insert.
+Value *gather_operand(const std::vector<Value *> &vals, int sub_width,
+        FixedVectorType *wide_ty, const lane_map &lanes_in_vec,
+        IRBuilder<> &builder) {
+    Instruction *at = &*builder.GetInsertPoint();
+    int width = vals.size();
+    Type *elem_ty = wide_ty->getElementType();
+
+    // IRBuilder may have folded a pack of constants to a Constant, which is
+    // available everywhere.
+    auto source_of = [&](Value *val) -> const vec_lane * {
+        auto it = lanes_in_vec.find(val);
+        if (it == lanes_in_vec.end() ||
+                cast<VectorType>(it->second.vec->getType())->getElementType() != elem_ty)
+            return nullptr;
+        auto *vec_inst = dyn_cast<Instruction>(it->second.vec);
+        if (vec_inst && !before(vec_inst, at))
+            return nullptr;
+        return &it->second;
     };
-    std::stable_partition(worklist.begin(), worklist.end(), [&](int idx) {
-        return isLoadOrStorePack(C.Packs[idx]);
-    });
 
-    for (int idx : worklist) {
-        const auto &lanes = C.Packs[idx];
-        if (lanes.empty())
+    std::vector<Value *> sources;
+    std::vector<int> src_of(width, -1);
+    for (int lane = 0; lane < width; ++lane) {
+        const vec_lane *src = source_of(vals[lane]);
+        if (!src)
+            continue;
+        auto found = llvm::find(sources, src->vec);
+        if (found == sources.end() && sources.size() == 2)
             continue;
+        src_of[lane] = found - sources.begin();
+        if (found == sources.end())
+            sources.push_back(src->vec);
+    }
 
-        bool all_binop = true;
-        bool all_load  = true;
-        bool all_store = true;
-        for (const Instruction *inst : lanes) {
-            const Instruction *ni = const_cast<Instruction *>(inst);
-            if (!isa<BinaryOperator>(ni))
-                all_binop = false;
-            if (!isa<LoadInst>(ni))
-                all_load = false;
-            if (!isa<StoreInst>(ni))
-                all_store = false;
+    Value *vec = nullptr;
+    std::vector<bool> done(width, false);
+    if (!sources.empty()) {
+        int len = 0;
+        for (Value *src : sources)
+            len = std::max<int>(len, cast<FixedVectorType>(src->getType())->getNumElements());
+        std::vector<int> mask(width * sub_width, -1);
+        bool identity = sources.size() == 1 && len == width * sub_width;
+        for (int lane = 0; lane < width; ++lane) {
+            if (src_of[lane] < 0) {
+                identity = false;
+                continue;
+            }
+            int start = lanes_in_vec.find(vals[lane])->second.start;
+            for (int j = 0; j < sub_width; ++j) {
+                mask[lane * sub_width + j] = src_of[lane] * len + start + j;
+                identity &= mask[lane * sub_width + j] == lane * sub_width + j;
+            }
+            done[lane] = true;
         }
+        if (identity)
+            return sources[0];
 
-        if (!all_binop && !all_load && !all_store) {
-            continue;
+        // Both shuffle inputs need one type.
+        for (Value *&src : sources) {
+            int n = cast<FixedVectorType>(src->getType())->getNumElements();
+            if (n == len)
+                continue;
+            std::vector<int> pad(len, -1);
+            for (int i = 0; i < n; ++i)
+                pad[i] = i;
+            src = builder.CreateShuffleVector(src, PoisonValue::get(src->getType()), pad, "goslp.pad");
         }
-
-        std::vector<const Instruction *> lanes_copy = lanes;
-        auto perm = LanePerm.find(idx);
-        if (perm != LanePerm.end() && perm->second.size() == lanes_copy.size()) {
-            const Permutation &P = perm->second;
-            std::vector<const Instruction *> permuted(lanes_copy.size());
-            for (size_t j = 0; j < lanes_copy.size(); ++j) {
-                int src = P[j];
-                if (src < static_cast<int>(lanes_copy.size())) {
-                    permuted[j] = lanes_copy[src];
-                } 
-                else {
-                    permuted[j] = lanes_copy[j];
+        Value *second = sources.size() == 2 ? sources[1] : PoisonValue::get(sources[0]->getType());
+        vec = builder.CreateShuffleVector(sources[0], second, mask, "goslp.perm");
+        if (llvm::all_of(done, [](bool d) { return d; }))
+            return vec;
+    } else {
+        bool splat = sub_width == 1 && !lanes_in_vec.count(vals[0]) &&
+                     llvm::all_of(vals, [&](Value *val) { return val == vals[0]; });
+        if (splat && !isa<Constant>(vals[0]))
+            return builder.CreateVectorSplat(width, vals[0], "goslp.splat");
+
+        vec = PoisonValue::get(wide_ty);
+        if (sub_width == 1) {
+            std::vector<Constant *> elems(width, PoisonValue::get(elem_ty));
+            bool any_const = false;
+            for (int lane = 0; lane < width; ++lane) {
+                if (auto *c = dyn_cast<Constant>(vals[lane])) {
+                    elems[lane] = c;
+                    done[lane] = any_const = true;
                 }
             }
-            lanes_copy.swap(permuted);
-        }
-        
-        Instruction *insert_pt = const_cast<Instruction *>(lanes_copy[0]);
-        for (const Instruction *curr : lanes_copy) {
-            Instruction *inst = const_cast<Instruction *>(curr);
-            if (inst->getParent() == insert_pt->getParent() && inst->comesBefore(insert_pt)) {
-                insert_pt = inst;
-            }
+            if (any_const)
+                vec = ConstantVector::get(elems);
         }
+    }
 
-        Instruction *latest_pt = const_cast<Instruction *>(lanes_copy[0]);
-        for (const Instruction *curr : lanes_copy) {
-            Instruction *inst = const_cast<Instruction *>(curr);
-            if (inst->getParent() == latest_pt->getParent() && latest_pt->comesBefore(inst)) {
-                latest_pt = inst;
-            }
+    for (int lane = 0; lane < width; ++lane) {
+        if (done[lane])
+            continue;
+        const vec_lane *src = source_of(vals[lane]);
+        for (int j = 0; j < sub_width; ++j) {
+            Value *elem = nullptr;
+            if (src)
+                elem = builder.CreateExtractElement(src->vec,
+                        builder.getInt32(src->start + j), "goslp.op.ext");
+            else if (sub_width == 1)
+                elem = vals[lane];
+            else
+                elem = builder.CreateExtractElement(vals[lane], builder.getInt32(j), "goslp.op.elem");
+            vec = builder.CreateInsertElement(vec, elem, builder.getInt32(lane * sub_width + j), "goslp.ins");
         }
+    }
+    return vec;
+}
 
-        Instruction *insertBefore = debug ? latest_pt : insert_pt;
+// The lane mask of a predicated memory pack, in address order: the guard
+// conditions gathered like any operand, flipped where a lane runs on the
+// false edge.
+Value *build_mask(const pack_plan &plan, const lane_map &lanes_in_vec, IRBuilder<> &builder) {
+    int width = plan.lanes.size();
+    std::vector<Value *> conds(width);
+    std::vector<Constant *> flips(width);
+    bool any_flip = false;
+    for (int lane = 0; lane < width; ++lane) {
+        conds[plan.mem_index[lane]] = plan.guards[lane];
+        flips[plan.mem_index[lane]] = builder.getInt1(plan.negated[lane]);
+        any_flip |= plan.negated[lane];
+    }
+    auto *mask_ty = FixedVectorType::get(builder.getInt1Ty(), width);
+    Value *mask = gather_operand(conds, 1, mask_ty, lanes_in_vec, builder);
+    if (any_flip)
+        mask = builder.CreateXor(mask, ConstantVector::get(flips), "goslp.mask");
+    return mask;
+}
 
-        IRBuilder<> builder(insertBefore);
-        int width = lanes_copy.size();
-        if (all_binop) {
-            auto *bin_op = cast<BinaryOperator>(const_cast<Instruction *>(lanes_copy[0]));
+// Address of a predicated memory pack's lowest element, rebuilt from its
+// base since the lanes' own addresses may be computed in the guarded blocks.
+Value *pack_address(const pack_plan &plan, IRBuilder<> &builder) {
+    Value *base = const_cast<Value *>(plan.layout.Base);
+    if (plan.layout.BaseOffset == 0)
+        return base;
+    return builder.CreateInBoundsGEP(builder.getInt8Ty(), base,
+            builder.getInt64(plan.layout.BaseOffset), "goslp.addr");
+}
 
-            Type *result_ty = bin_op->getType();
-            Type *scalar_ty = nullptr;
-            int sub_width = 1;
+bool is_masked_dense(const pack_plan &plan) {
+    return plan.layout.Shape == MemPackShape::Contiguous && isPowerOf2_32(plan.lanes.size());
+}
 
-            if (auto *vec_ty = dyn_cast<FixedVectorType>(result_ty)) {
-                scalar_ty = vec_ty->getElementType();
-                sub_width = vec_ty->getNumElements();
-            } 
-            else {
-                scalar_ty = result_ty;
-                sub_width = 1;
-            }
+Value *masked_load_pack(const pack_plan &plan, FixedVectorType *wide_ty, Value *mask,
+        const DataLayout &DL, IRBuilder<> &builder) {
+    if (!is_masked_dense(plan))
+        return builder.CreateMaskedGather(wide_ty, gather_pointers(plan, DL, builder),
+                min_align(plan), mask, nullptr, "goslp.gather");
+    return builder.CreateMaskedLoad(wide_ty, pack_address(plan, builder), min_align(plan), mask,
+            PoisonValue::get(wide_ty), "goslp.mload");
+}
 
-            int total_width = width * sub_width;
-            auto *wide_vec_ty = FixedVectorType::get(scalar_ty, total_width);
-            Value *vec_op0 = UndefValue::get(wide_vec_ty);
-            Value *vec_op1 = UndefValue::get(wide_vec_ty);
+void masked_store_pack(const pack_plan &plan, Value *vec, Value *mask, const DataLayout &DL,
+        IRBuilder<> &builder) {
+    if (!is_masked_dense(plan))
+        builder.CreateMaskedScatter(vec, gather_pointers(plan, DL, builder), min_align(plan), mask);
+    else
+        builder.CreateMaskedStore(vec, pack_address(plan, builder), min_align(plan), mask);
+}
 
-            for (int lane = 0; lane < width; ++lane) {
-                auto *lane_op = cast<BinaryOperator>(const_cast<Instruction *>(lanes_copy[lane]));
-                Value *op0 = lane_op->getOperand(0);
-                Value *op1 = lane_op->getOperand(1);
-            
-                if (sub_width == 1) {
-                    int wide_index = lane;
-                    vec_op0 = builder.CreateInsertElement(
-                        vec_op0, op0, ConstantInt::get(Type::getInt32Ty(ctx), wide_index), "goslp.ins0");
-                    vec_op1 = builder.CreateInsertElement(
-                        vec_op1, op1, ConstantInt::get(Type::getInt32Ty(ctx), wide_index), "goslp.ins1");
-                } 
-                else {
-                    for (int j = 0; j < sub_width; ++j) {
-                        Value *idx_val = builder.getInt32(j);
-                        Value *elem0 = builder.CreateExtractElement(op0, idx_val, "goslp.op0.elem");
-                        Value *elem1 = builder.CreateExtractElement(op1, idx_val, "goslp.op1.elem");
-                        int wide_index = lane * sub_width + j;
-
-                        vec_op0 = builder.CreateInsertElement(vec_op0, elem0, ConstantInt::get(Type::getInt32Ty(ctx), wide_index), "goslp.ins0");
-                        vec_op1 = builder.CreateInsertElement(vec_op1, elem1, ConstantInt::get(Type::getInt32Ty(ctx), wide_index), "goslp.ins1");
-                    }
-                }
-            }
+// A guarded block left with nothing but its branch (and address arithmetic
+// nobody uses any more) after if-conversion is removed, and its head
+// branches straight to the join.
+void fold_empty_guard(BasicBlock *bb) {
+    BlockGuard guard;
+    if (!getBlockGuard(bb, guard))
+        return;
+    for (Instruction &inst : make_early_inc_range(reverse(*bb))) {
+        if (isInstructionTriviallyDead(&inst))
+            inst.eraseFromParent();
+    }
+    if (&bb->front() != bb->getTerminator())
+        return;
+    BasicBlock *join = bb->getSingleSuccessor();
+    for (PHINode &phi : join->phis()) {
+        if (phi.getIncomingValueForBlock(bb) != phi.getIncomingValueForBlock(guard.Head))
+            return;
+    }
+    Instruction *branch = guard.Head->getTerminator();
+    BranchInst::Create(join, branch);
+    branch->eraseFromParent();
+    DeleteDeadBlock(bb);
+    RecursivelyDeleteTriviallyDeadInstructions(guard.Cond);
+}
 
-            Instruction *vec_bin_op = cast<Instruction>(
-                builder.CreateBinOp(bin_op->getOpcode(), vec_op0, vec_op1, "goslp.vec"));
+// Publishes the lanes of a freshly emitted vector. Scalar users get an
+// extract (or sub-vector shuffle); those that turn out to be packed lanes
+// themselves are deleted later, and the extracts die with them.
+void publish_lanes(const pack_plan &plan, Value *vec, const std::vector<int> &slot,
+        lane_map &lanes_in_vec, std::vector<Instruction *> &extracts,
+        IRBuilder<> &builder) {
+    auto *wide_ty = cast<FixedVectorType>(vec->getType());
+    for (int lane = 0; lane < (int)plan.lanes.size(); ++lane) {
+        Instruction *old_inst = mut(plan.lanes[lane]);
+        int start = slot[lane] * plan.sub_width;
+        lanes_in_vec[old_inst] = {vec, start};
+        if (old_inst->use_empty())
+            continue;
 
-            // Insert scalar extracts at the original instruction sites to
-            // guarantee dominance over all original uses.
-            for (int lane = 0; lane < width; ++lane) {
-                Instruction *old_inst = const_cast<Instruction *>(lanes_copy[lane]);
-                IRBuilder<> extBuilder(old_inst);
-
-                Value *laneVal = nullptr;
-                if (sub_width == 1) {
-                    int wide_index = lane;
-                    laneVal = extBuilder.CreateExtractElement(
-                        vec_bin_op, ConstantInt::get(Type::getInt32Ty(ctx), wide_index), "goslp.ext");
-
-                        if (debug) {
-                            if (isa<Instruction>(laneVal)) {
-                                cast<Instruction>(laneVal)->moveAfter(vec_bin_op);
-                                SmallVector<Instruction*> users_to_move;
-                                for (User *U : old_inst->users()) {
-                                    if (Instruction *userI = dyn_cast<Instruction>(U)) {
-                                        users_to_move.push_back(userI);
-                                    }
-                                }
-
-                                for (Instruction *I : users_to_move) {
-                                    I->moveAfter(cast<Instruction>(laneVal));
-                                }
-                            }
-                        }
-                } else {
-                    SmallVector<Constant *, 8> mask_elems;
-                    mask_elems.reserve(sub_width);
-                    for (int j = 0; j < sub_width; ++j) {
-                        int wide_index = lane * sub_width + j;
-                        mask_elems.push_back(ConstantInt::get(Type::getInt32Ty(ctx), wide_index));
-                    }
-                    Constant *mask = ConstantVector::get(mask_elems);
-                    Value *undef_vec = UndefValue::get(wide_vec_ty);
-                    laneVal = extBuilder.CreateShuffleVector(vec_bin_op, undef_vec, mask, "goslp.subvec");
-                }
+        Value *lane_val = nullptr;
+        if (plan.sub_width == 1) {
+            lane_val = builder.CreateExtractElement(vec, builder.getInt32(start), "goslp.ext");
+        } else {
+            SmallVector<int, 8> mask;
+            for (int j = 0; j < plan.sub_width; ++j)
+                mask.push_back(start + j);
+            lane_val = builder.CreateShuffleVector(vec, PoisonValue::get(wide_ty), mask, "goslp.subvec");
+        }
+        if (auto *ext = dyn_cast<Instruction>(lane_val))
+            extracts.push_back(ext);
+        lanes_in_vec[lane_val] = {vec, start};
+        old_inst->replaceAllUsesWith(lane_val);
+    }
+}
 
-                old_inst->replaceAllUsesWith(laneVal);
-                to_erase.push_back(old_inst);
-            }
-            changed = true;
+// An interleaved group is emitted at a single point: its loads at the
+// earliest member's anchor, its stores at the latest. That is only safe if
+// nothing between the members' own anchors may clobber (loads) or observe
+// (stores) the memory involved, and the group's base address already exists.
+bool group_is_safe(const std::vector<pack_plan> &order, const std::vector<int> &members) {
+    Instruction *lo = order[members[0]].anchor;
+    Instruction *hi = lo;
+    std::unordered_set<const Instruction *> own;
+    for (int m : members) {
+        Instruction *anchor = order[m].anchor;
+        if (anchor->getParent() != lo->getParent())
+            return false;
+        if (anchor->comesBefore(lo))
+            lo = anchor;
+        if (hi->comesBefore(anchor))
+            hi = anchor;
+        own.insert(order[m].lanes.begin(), order[m].lanes.end());
+    }
+
+    bool is_load = order[members[0]].kind == pack_kind::load;
+    for (Instruction *inst = lo; inst != hi; inst = inst->getNextNode()) {
+        if (own.count(inst))
             continue;
+        if (is_load ? inst->mayWriteToMemory() : inst->mayReadOrWriteMemory())
+            return false;
+    }
+    if (!is_load)
+        return true;
+    auto *ptr = dyn_cast<Instruction>(getLoadStorePointerOperand(lane_at(order[members[0]], 0)));
+    return !ptr || before(ptr, lo);
+}
+
+// One wide load of every record, split into the fields by stride shuffles.
+void emit_load_group(const std::vector<pack_plan> &order, const std::vector<int> &members,
+        lane_map &lanes_in_vec, std::vector<Instruction *> &extracts, IRBuilder<> &builder) {
+    const pack_plan &field0 = order[members[0]];
+    int width = field0.lanes.size();
+    int factor = members.size();
+    auto *first = cast<LoadInst>(lane_at(field0, 0));
+    auto *group_ty = FixedVectorType::get(field0.lane_ty, width * factor);
+    LoadInst *wide = builder.CreateLoad(group_ty, first->getPointerOperand(), "goslp.group");
+    wide->setAlignment(first->getAlign());
+
+    for (int field = 0; field < factor; ++field) {
+        const pack_plan &plan = order[members[field]];
+        std::vector<int> mask(width);
+        for (int rec = 0; rec < width; ++rec)
+            mask[rec] = rec * factor + field;
+        Value *vec = builder.CreateShuffleVector(wide, PoisonValue::get(group_ty), mask, "goslp.field");
+        publish_lanes(plan, vec, plan.mem_index, lanes_in_vec, extracts, builder);
+    }
+}
+
+// The inverse: the fields are concatenated pairwise and interleaved by one
+// shuffle into a single wide store.
+void emit_store_group(const std::vector<pack_plan> &order, const std::vector<int> &members,
+        const lane_map &lanes_in_vec, IRBuilder<> &builder) {
+    const pack_plan &field0 = order[members[0]];
+    int width = field0.lanes.size();
+    int factor = members.size();
+    auto *field_ty = FixedVectorType::get(field0.lane_ty, width);
+
+    std::vector<Value *> fields;
+    for (int m : members) {
+        const pack_plan &plan = order[m];
+        std::vector<Value *> vals(width);
+        for (int lane = 0; lane < width; ++lane)
+            vals[plan.mem_index[lane]] = cast<StoreInst>(mut(plan.lanes[lane]))->getValueOperand();
+        fields.push_back(gather_operand(vals, 1, field_ty, lanes_in_vec, builder));
+    }
+
+    Value *lo = fields[0];
+    Value *hi = fields[1];
+    if (factor > 2) {
+        std::vector<int> concat(2 * width);
+        for (int i = 0; i < 2 * width; ++i)
+            concat[i] = i;
+        lo = builder.CreateShuffleVector(fields[0], fields[1], concat, "goslp.concat");
+        if (factor == 4) {
+            hi = builder.CreateShuffleVector(fields[2], fields[3], concat, "goslp.concat");
+        } else {
+            std::vector<int> pad(2 * width, -1);
+            for (int i = 0; i < width; ++i)
+                pad[i] = i;
+            hi = builder.CreateShuffleVector(fields[2], PoisonValue::get(field_ty), pad, "goslp.pad");
         }
+    }
 
-        if (all_load) {
-            insert_pt = const_cast<Instruction *>(lanes_copy[0]);
-            for (const Instruction *curr : lanes_copy) {
-                Instruction *inst = const_cast<Instruction *>(curr);
-                if (inst->getParent() == insert_pt->getParent() && inst->comesBefore(insert_pt)) {
-                    insert_pt = inst;
-                }
-            }
-            IRBuilder<> builder(insert_pt);
-            auto *first_load = cast<LoadInst>(const_cast<Instruction *>(lanes_copy[0]));
-            Type *val_ty = first_load->getType();
+    // Field f of record r sits at f * width + r across the two sources.
+    std::vector<int> mask(width * factor);
+    for (int rec = 0; rec < width; ++rec) {
+        for (int field = 0; field < factor; ++field)
+            mask[rec * factor + field] = field * width + rec;
+    }
+    Value *vec = builder.CreateShuffleVector(lo, hi, mask, "goslp.interleave");
+    auto *first = cast<StoreInst>(lane_at(field0, 0));
+    StoreInst *wide = builder.CreateStore(vec, first->getPointerOperand());
+    wide->setAlignment(first->getAlign());
+}
 
+// The incoming values of a vector PHI are known only once every pack is
+// emitted (a loop's back-edge value comes from a pack later in the body).
+// Each is gathered at the end of its predecessor, from the vectors the
+// scalar incoming values now live in.
+void connect_vector_phi(const pack_plan &plan, PHINode *vec_phi, const lane_map &lanes_in_vec) {
+    auto *first = cast<PHINode>(plan.lanes[0]);
+    auto *wide_ty = cast<FixedVectorType>(vec_phi->getType());
+    std::unordered_map<BasicBlock *, Value *> from_block;
+    for (unsigned in = 0; in < first->getNumIncomingValues(); ++in) {
+        BasicBlock *pred = first->getIncomingBlock(in);
+        Value *&vec = from_block[pred];
+        if (!vec) {
+            std::vector<Value *> vals;
+            for (const Instruction *inst : plan.lanes)
+                vals.push_back(cast<PHINode>(inst)->getIncomingValueForBlock(pred));
+            IRBuilder<> builder(pred->getTerminator());
+            vec = gather_operand(vals, plan.sub_width, wide_ty, lanes_in_vec, builder);
+        }
+        vec_phi->addIncoming(vec, pred);
+    }
+}
 
-            if (val_ty->isVectorTy()) {
-                if (iterativeLoadStorePack(lanes_copy, val_ty, true, DL, ctx, builder, to_erase)) {
-                    changed = true;
-                    continue;
-                }
-            }
+// Extracts of a loop's vectors whose users all run after the loop are taken
+// out of it, so the loop-carried vector is only split once. A closing PHI
+// on an exit (LCSSA form) becomes a vector PHI there plus one extract;
+// other users get the extract at the start of the block dominating them.
+void sink_exit_extracts(const std::vector<Instruction *> &extracts, const DominatorTree &DT,
+        const LoopInfo &LI) {
+    std::map<std::pair<BasicBlock *, Value *>, PHINode *> exit_phis;
+    for (Instruction *ext : extracts) {
+        Loop *loop = LI.getLoopFor(ext->getParent());
+        if (!loop)
+            continue;
+        Value *vec = ext->getOperand(0);
 
-            std::vector<int> mem_index;
-            if (!good_mem_ops(lanes_copy, DL, val_ty, mem_index)) {
+        for (User *U : make_early_inc_range(ext->users())) {
+            auto *phi = dyn_cast<PHINode>(U);
+            if (!phi || loop->contains(phi) ||
+                    !llvm::all_of(phi->incoming_values(), [&](const Use &in) { return in.get() == ext; }))
                 continue;
+            BasicBlock *exit = phi->getParent();
+            PHINode *&vec_phi = exit_phis[{exit, vec}];
+            if (!vec_phi) {
+                vec_phi = PHINode::Create(vec->getType(), phi->getNumIncomingValues(),
+                        vec->getName() + ".lcssa", &exit->front());
+                for (BasicBlock *pred : phi->blocks())
+                    vec_phi->addIncoming(vec, pred);
             }
+            Instruction *outside = ext->clone();
+            outside->setOperand(0, vec_phi);
+            outside->insertBefore(&*exit->getFirstInsertionPt());
+            outside->takeName(phi);
+            phi->replaceAllUsesWith(outside);
+            phi->eraseFromParent();
+        }
+        if (ext->use_empty()) {
+            ext->eraseFromParent();
+            continue;
+        }
 
-            int base_lane = -1;
-            for (int lane = 0; lane < width; ++lane) {
-                if (mem_index[lane] == 0) {
-                    base_lane = lane;
-                    break;
-                }
-            }
-            if (base_lane < 0) {
-                continue;
+        BasicBlock *target = nullptr;
+        bool outside_only = true;
+        for (User *U : ext->users()) {
+            auto *user = cast<Instruction>(U);
+            if (isa<PHINode>(user) || loop->contains(user)) {
+                outside_only = false;
+                break;
             }
+            target = target ? DT.findNearestCommonDominator(target, user->getParent())
+                            : user->getParent();
+        }
+        if (outside_only && target && !loop->contains(target))
+            ext->moveBefore(&*target->getFirstInsertionPt());
+    }
+}
 
-            auto *base_load = cast<LoadInst>(const_cast<Instruction *>(lanes_copy[base_lane]));
-            Value *base_ptr = base_load->getPointerOperand();
-            auto *ptr_ty = cast<PointerType>(base_ptr->getType());
-            int addr_space = ptr_ty->getAddressSpace();
-            auto *vec_ty = FixedVectorType::get(val_ty, width);
-            auto *vec_ptr_ty = PointerType::get(vec_ty, addr_space);
+} // namespace
 
-            Value *vec_ptr = builder.CreateBitCast(base_ptr, vec_ptr_ty, "goslp.ld.ptr");
-            LoadInst *vec_load = builder.CreateLoad(vec_ty, vec_ptr, "goslp.vload");
-            vec_load->setAlignment(first_load->getAlign());
+bool emit(Function &F, CandidatePairs &C, const std::vector<bool> &Chosen, const Perms &LanePerm,
+        const TargetLibraryInfo &TLI, bool debug) {
+    if (C.Packs.empty() || Chosen.size() < C.Packs.size()) {
+        return false;
+    }
 
-            for (int lane = 0; lane < width; ++lane) {
-                int elem_idx = mem_index[lane];
-                Instruction *ld_inst = const_cast<Instruction *>(lanes_copy[lane]);
-                Value *elem = builder.CreateExtractElement(vec_load, builder.getInt32(elem_idx), "goslp.ld.ext");
-                ld_inst->replaceAllUsesWith(elem);
-                to_erase.push_back(ld_inst);
-            }
+    Module *M = F.getParent();
+    if (!M) {
+        return false;
+    }
+    const DataLayout &DL = M->getDataLayout();
+    DominatorTree DT(F);
+    block_order block_rank;
+    for (BasicBlock *bb : ReversePostOrderTraversal<Function *>(&F))
+        block_rank.emplace(bb, block_rank.size());
 
-            changed = true;
-            continue;
-        }
+    std::vector<pack_plan> plans;
+    for (int i = 0; i < static_cast<int>(C.Packs.size()); ++i) {
+        pack_plan plan;
+        if (Chosen[i] && make_plan(C, i, LanePerm, DL, TLI, block_rank, plan))
+            plans.push_back(std::move(plan));
+    }
 
-        if (all_store) {
-            auto *first_store = cast<StoreInst>(const_cast<Instruction *>(lanes_copy[0]));
-            Type *val_ty = first_store->getValueOperand()->getType();
+    // Drop packs whose results would be needed before their anchor. Dropping
+    // one can invalidate a producer that relied on it, so iterate.
+    std::vector<bool> alive(plans.size(), true);
+    bool dropped = true;
+    while (dropped) {
+        dropped = false;
+        std::vector<pack_plan> live_plans;
+        std::unordered_map<const Instruction *, int> lane_owner;
+        for (size_t i = 0; i < plans.size(); ++i) {
+            if (!alive[i])
+                continue;
+            for (const Instruction *inst : plans[i].lanes)
+                lane_owner[inst] = live_plans.size();
+            live_plans.push_back(plans[i]);
+        }
+        size_t live_idx = 0;
+        for (size_t i = 0; i < plans.size(); ++i) {
+            if (!alive[i])
+                continue;
+            if (!anchor_is_valid(live_plans[live_idx], live_plans, lane_owner, DT)) {
+                alive[i] = false;
+                dropped = true;
+                if (debug)
+                    errs() << "GoSLP emit: skipping pack " << plans[i].idx
+                           << " (lanes used before its insertion point)\n";
+            }
+            ++live_idx;
+        }
+    }
 
-            if (val_ty->isVectorTy()) {
-                if (iterativeLoadStorePack(lanes_copy, val_ty, false, DL, ctx, builder, to_erase)) {
-                    changed = true;
-                    continue;
-                }
+    std::vector<pack_plan> order;
+    for (size_t i = 0; i < plans.size(); ++i) {
+        if (alive[i])
+            order.push_back(std::move(plans[i]));
+    }
+    // Predicated packs sharing an anchor are emitted producers first.
+    {
+        std::unordered_map<const Instruction *, int> lane_owner;
+        for (int i = 0; i < (int)order.size(); ++i) {
+            for (const Instruction *inst : order[i].lanes)
+                lane_owner[inst] = i;
+        }
+        std::function<int(int)> depth_of = [&](int i) {
+            pack_plan &plan = order[i];
+            if (!plan.predicated || plan.depth > 0)
+                return plan.depth;
+            plan.depth = 1;
+            for (const Value *val : plan_inputs(plan)) {
+                auto it = lane_owner.find(dyn_cast<Instruction>(val));
+                if (it != lane_owner.end() && order[it->second].anchor == plan.anchor)
+                    plan.depth = std::max(plan.depth, depth_of(it->second) + 1);
             }
+            return plan.depth;
+        };
+        for (int i = 0; i < (int)order.size(); ++i)
+            depth_of(i);
+    }
+
+    // Producers are always anchored before their consumers, so emitting in
+    // program order makes every producer vector available to its users.
+    // Blocks go in reverse post-order, which puts a producer's block (it
+    // dominates the consumer's) first.
+    std::stable_sort(order.begin(), order.end(), [&](const pack_plan &a, const pack_plan &b) {
+        if (a.anchor->getParent() != b.anchor->getParent())
+            return block_rank.at(a.anchor->getParent()) < block_rank.at(b.anchor->getParent());
+        if (a.anchor != b.anchor)
+            return a.anchor->comesBefore(b.anchor);
+        return a.depth < b.depth;
+    });
 
-            std::vector<int> mem_index;
-            if (!good_mem_ops(lanes_copy, DL, val_ty, mem_index)) {
+    // Complete interleaved groups among the memory packs are emitted as one
+    // wide access, at the first member's anchor for loads and the last
+    // member's for stores.
+    std::vector<int> group_of(order.size(), -1);
+    std::vector<std::vector<int>> groups;
+    {
+        std::vector<std::vector<const Instruction *>> mem_lanes;
+        std::vector<int> mem_plan;
+        for (int i = 0; i < (int)order.size(); ++i) {
+            if (order[i].kind != pack_kind::load && order[i].kind != pack_kind::store)
                 continue;
-            }
+            mem_lanes.push_back(order[i].lanes);
+            mem_plan.push_back(i);
+        }
+        for (const auto &group : findInterleaveGroups(mem_lanes, DL)) {
+            std::vector<int> members;
+            for (uint32_t g : group)
+                members.push_back(mem_plan[g]);
+            if (!group_is_safe(order, members))
+                continue;
+            for (int m : members)
+                group_of[m] = groups.size();
+            groups.push_back(std::move(members));
+        }
+    }
 
-            int base_lane = -1;
-            for (int lane = 0; lane < width; ++lane) {
-                if (mem_index[lane] == 0u) {
-                    base_lane = (int)lane;
-                    break;
-                }
-            }
-            if (base_lane < 0) {
+    lane_map lanes_in_vec;
+    std::vector<Instruction *> to_erase;
+    std::vector<Instruction *> extracts;
+    std::vector<BasicBlock *> guarded;
+    std::vector<std::pair<int, PHINode *>> vec_phis;
+    for (int oi = 0; oi < (int)order.size(); ++oi) {
+        const pack_plan &plan = order[oi];
+        int width = plan.lanes.size();
+        Type *elem_ty = plan.lane_ty->getScalarType();
+        auto *wide_ty = FixedVectorType::get(elem_ty, width * plan.sub_width);
+        IRBuilder<> builder(plan.anchor);
+
+        if (group_of[oi] >= 0) {
+            const std::vector<int> &members = groups[group_of[oi]];
+            int lead = plan.kind == pack_kind::load
+                               ? *std::min_element(members.begin(), members.end())
+                               : *std::max_element(members.begin(), members.end());
+            if (oi != lead)
                 continue;
+            if (plan.kind == pack_kind::load)
+                emit_load_group(order, members, lanes_in_vec, extracts, builder);
+            else
+                emit_store_group(order, members, lanes_in_vec, builder);
+            for (int m : members) {
+                for (const Instruction *inst : order[m].lanes)
+                    to_erase.push_back(mut(inst));
             }
+            continue;
+        }
 
-            auto *base_store = cast<StoreInst>(const_cast<Instruction *>(lanes_copy[base_lane]));
-            Value *base_ptr = base_store->getPointerOperand();
-            auto *ptr_ty = cast<PointerType>(base_ptr->getType());
-            int addr_space = ptr_ty->getAddressSpace();
-            auto *vec_ty = FixedVectorType::get(val_ty, width);
-            auto *vec_ptr_ty = PointerType::get(vec_ty, addr_space);
-
-            Value *vec_val = UndefValue::get(vec_ty);
-            for (int lane = 0; lane < width; ++lane) {
-                int elem_idx = mem_index[lane];
-                auto *st = cast<StoreInst>(const_cast<Instruction *>(lanes_copy[lane]));
-                Value *v = st->getValueOperand();
-                vec_val = builder.CreateInsertElement(vec_val, v, builder.getInt32(elem_idx), "goslp.st.ins");
+        if (plan.kind == pack_kind::phi) {
+            BasicBlock *bb = mut(plan.lanes[0])->getParent();
+            unsigned num_in = cast<PHINode>(plan.lanes[0])->getNumIncomingValues();
+            PHINode *vec_phi = PHINode::Create(wide_ty, num_in, "goslp.phi", &bb->front());
+            std::vector<int> slot(width);
+            for (int lane = 0; lane < width; ++lane)
+                slot[lane] = lane;
+            publish_lanes(plan, vec_phi, slot, lanes_in_vec, extracts, builder);
+            vec_phis.push_back({oi, vec_phi});
+        }
+        else if (plan.kind == pack_kind::op) {
+            const Instruction *first = plan.lanes[0];
+            std::vector<Value *> vec_ops;
+            for (unsigned op = 0; op < getNumPackOperands(first); ++op) {
+                std::vector<Value *> vals;
+                for (const Instruction *inst : plan.lanes)
+                    vals.push_back(getPackOperand(C, inst, op));
+                Type *op_elem_ty = vals[0]->getType()->getScalarType();
+                auto *op_wide_ty = FixedVectorType::get(op_elem_ty, width * plan.sub_width);
+                vec_ops.push_back(gather_operand(vals, plan.sub_width, op_wide_ty, lanes_in_vec, builder));
             }
 
-            Value *vec_ptr = builder.CreateBitCast(base_ptr, vec_ptr_ty, "goslp.st.ptr");
-            StoreInst *vec_store = builder.CreateStore(vec_val, vec_ptr);
-            vec_store->setAlignment(first_store->getAlign());
-
-            for (int lane = 0; lane < width; ++lane) {
-                Instruction *st_inst = const_cast<Instruction *>(lanes_copy[lane]);
-                to_erase.push_back(st_inst);
+            Value *vec = nullptr;
+            if (isAlternatingPack(plan.lanes)) {
+                vec = create_alternating_op(plan, vec_ops, builder);
+            } else {
+                vec = create_vector_op(first, vec_ops, wide_ty, TLI, builder);
+                if (auto *vec_inst = dyn_cast<Instruction>(vec)) {
+                    vec_inst->copyIRFlags(first);
+                    for (const Instruction *inst : plan.lanes)
+                        vec_inst->andIRFlags(inst);
+                }
             }
 
-            changed = true;
-            continue;
+            std::vector<int> slot(width);
+            for (int lane = 0; lane < width; ++lane)
+                slot[lane] = lane;
+            publish_lanes(plan, vec, slot, lanes_in_vec, extracts, builder);
+        }
+        else if (plan.predicated && plan.kind == pack_kind::load) {
+            Value *mask = build_mask(plan, lanes_in_vec, builder);
+            Value *vec_load = masked_load_pack(plan, wide_ty, mask, DL, builder);
+            publish_lanes(plan, vec_load, plan.mem_index, lanes_in_vec, extracts, builder);
+        }
+        else if (plan.kind == pack_kind::load) {
+            Value *vec_load = load_pack(plan, wide_ty, DL, builder);
+            publish_lanes(plan, vec_load, plan.mem_index, lanes_in_vec, extracts, builder);
+        }
+        else {
+            std::vector<Value *> vals(width);
+            for (int lane = 0; lane < width; ++lane)
+                vals[plan.mem_index[lane]] = cast<StoreInst>(mut(plan.lanes[lane]))->getValueOperand();
+            Value *vec_val = gather_operand(vals, plan.sub_width, wide_ty, lanes_in_vec, builder);
+            if (plan.predicated)
+                masked_store_pack(plan, vec_val, build_mask(plan, lanes_in_vec, builder), DL, builder);
+            else
+                store_pack(plan, vec_val, DL, builder);
         }
-    }
 
-    for (Instruction *inst : to_erase) {
-        if (!inst->use_empty()) {
-        } else {
-            inst->eraseFromParent();
+        for (const Instruction *inst : plan.lanes)
+            to_erase.push_back(mut(inst));
+        if (plan.predicated) {
+            for (const Instruction *inst : plan.lanes)
+                guarded.push_back(mut(inst)->getParent());
         }
     }
 
-    return changed;
+    for (const auto &entry : vec_phis)
+        connect_vector_phi(order[entry.first], entry.second, lanes_in_vec);
+
+    // Packed scalars have no users left once every consumer is rebuilt; the
+    // extracts nobody needed go with them.
+    for (auto it = to_erase.rbegin(); it != to_erase.rend(); ++it) {
+        if ((*it)->use_empty())
+            (*it)->eraseFromParent();
+    }
+    std::vector<Instruction *> live_extracts;
+    for (auto it = extracts.rbegin(); it != extracts.rend(); ++it) {
+        if ((*it)->use_empty())
+            (*it)->eraseFromParent();
+        else
+            live_extracts.push_back(*it);
+    }
+    LoopInfo LI(DT);
+    sink_exit_extracts(live_extracts, DT, LI);
+    llvm::sort(guarded);
+    guarded.erase(std::unique(guarded.begin(), guarded.end()), guarded.end());
+    for (BasicBlock *bb : guarded)
+        fold_empty_guard(bb);
+
+    return !order.empty();
 }
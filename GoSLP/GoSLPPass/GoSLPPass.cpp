@@ -1,14 +1,20 @@
 #include "CandidatePacks.hpp"
+#include "ControlEquivalence.hpp"
 #include "Emit.hpp"
 #include "ILP.hpp"
 #include "PermuteDP.hpp"
 #include "Reduction.hpp"
+#include "Schedule.hpp"
 #include "ShuffleCost.hpp"
+#include "UnrollToPack.hpp"
 #include "VecGraph.hpp"
 
+#include "llvm/ADT/SmallBitVector.h"
 #include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/MemorySSA.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
 #include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Pass.h"
 #include "llvm/Passes/PassBuilder.h"
@@ -22,6 +28,19 @@ using namespace llvm;
 
 namespace {
 
+// Compile-time budgets are counted in deterministic work units so the chosen
+// packs do not depend on host load. One unit is roughly one branch-and-bound
+// node or dependence-walk step (~1us on the reference host), which keeps the
+// ILP default equivalent to the former min(4s, max(0.5s, 0.05s * packs))
+// wall-clock limit. Wall time only backs this up as an emergency cutoff.
+static constexpr double UnitsPerSecond = 1.0e6;
+static constexpr double EmergencyFactor = 4.0;
+
+static WorkBudget makeBudget(double EquivalentSeconds) {
+  return WorkBudget(static_cast<uint64_t>(EquivalentSeconds * UnitsPerSecond),
+                    EquivalentSeconds * EmergencyFactor);
+}
+
 static double toDouble(InstructionCost C) {
   if (!C.isValid())
     return 0.0;
@@ -59,8 +78,149 @@ static double estimatePackConstructionCost(Type *LaneTy, unsigned Width,
   return Cost;
 }
 
+// Building a non-vector operand pack. Constant lanes are free, since they
+// start out as a constant vector; one scalar repeated in every lane is a
+// single insert plus a broadcast; every other lane costs an insertelement.
+// Key lanes are sorted, so insert costs are taken per position rather than
+// per original lane.
+static double estimateNonVecPackCost(const ValuePackKey &Key,
+                                     TargetTransformInfo &TTI) {
+  const auto &Lanes = Key.Lanes;
+  Type *LaneTy = Lanes.front()->getType();
+  const unsigned Width = static_cast<unsigned>(Lanes.size());
+  if (LaneTy->isVectorTy())
+    return estimatePackConstructionCost(LaneTy, Width, TTI);
+
+  auto CostKind = TargetTransformInfo::TCK_RecipThroughput;
+  auto *VecTy = FixedVectorType::get(LaneTy, Width);
+  const bool Splat = std::all_of(Lanes.begin(), Lanes.end(), [&](const Value *V) {
+    return V == Lanes.front();
+  });
+  if (Splat && !isa<Constant>(Lanes.front()))
+    return toDouble(TTI.getVectorInstrCost(Instruction::InsertElement, VecTy,
+                                           CostKind, 0, nullptr, nullptr)) +
+           toDouble(TTI.getShuffleCost(TargetTransformInfo::SK_Broadcast,
+                                       VecTy, VecTy, {}, CostKind, 0, nullptr));
+
+  double Cost = 0.0;
+  for (unsigned I = 0; I < Width; ++I) {
+    if (!isa<Constant>(Lanes[I]))
+      Cost += toDouble(TTI.getVectorInstrCost(Instruction::InsertElement,
+                                              VecTy, CostKind, I, nullptr,
+                                              nullptr));
+  }
+  return Cost;
+}
+
+// Type of a Width-lane pack of LaneTy values; vector lanes are concatenated.
+static Type *widenLaneType(Type *LaneTy, unsigned Width) {
+  if (auto *SubVecTy = dyn_cast<FixedVectorType>(LaneTy))
+    return FixedVectorType::get(SubVecTy->getElementType(),
+                                SubVecTy->getNumElements() * Width);
+  return FixedVectorType::get(LaneTy, Width);
+}
+
+// Register-driven lane limits for packs of one statement kind. Preferred
+// fills one vector register with the pack's widest element; Max is the widest
+// pack that is still worth forming: two registers, or whatever wider VF the
+// target reports through getMaximumVF.
+struct PackWidthLimits {
+  unsigned Preferred = 1;
+  unsigned Max = 2;
+};
+
+// Guardrail on how far the widening rounds may go (64 x i8 is one AVX-512
+// register).
+static constexpr unsigned MaxPackLanes = 64;
+
+static PackWidthLimits getPackWidthLimits(const Instruction *I,
+                                          TargetTransformInfo &TTI,
+                                          const DataLayout &DL) {
+  PackWidthLimits Limits;
+  // Casts and compares read a different type than they produce; the wider
+  // one decides how many lanes fit.
+  SmallVector<Type *, 2> Tys;
+  if (auto *SI = dyn_cast<StoreInst>(I)) {
+    Tys.push_back(SI->getValueOperand()->getType());
+  } else {
+    Tys.push_back(I->getType());
+    if (isa<CastInst>(I) || isa<CmpInst>(I))
+      Tys.push_back(I->getOperand(0)->getType());
+  }
+  uint64_t LaneBits = 0;
+  uint64_t ElemBits = 0;
+  for (Type *Ty : Tys) {
+    if (!Ty->isSized())
+      continue;
+    LaneBits =
+        std::max<uint64_t>(LaneBits, DL.getTypeSizeInBits(Ty).getFixedValue());
+    ElemBits = std::max<uint64_t>(
+        ElemBits, DL.getTypeSizeInBits(Ty->getScalarType()).getFixedValue());
+  }
+  const uint64_t RegBits =
+      TTI.getRegisterBitWidth(TargetTransformInfo::RGK_FixedWidthVector)
+          .getFixedValue();
+  if (LaneBits == 0 || RegBits == 0)
+    return Limits;
+
+  Limits.Preferred = 1u << Log2_64(std::max<uint64_t>(1, RegBits / LaneBits));
+  unsigned Max = 2 * Limits.Preferred;
+  if (unsigned TargetVF = TTI.getMaximumVF(static_cast<unsigned>(ElemBits),
+                                           I->getOpcode())) {
+    const uint64_t SubW = std::max<uint64_t>(1, LaneBits / ElemBits);
+    Max = std::max<unsigned>(Max, static_cast<unsigned>(TargetVF / SubW));
+  }
+  Limits.Max = std::max(2u, std::min(MaxPackLanes, 1u << Log2_32(Max)));
+  return Limits;
+}
+
+// Building an operand pack from producer vectors: the shuffle its shape
+// needs, plus one insert for every lane no producer covers.
+static double estimateAssemblyCost(const ValuePackKey &Key,
+                                   const OperandAssembly &A,
+                                   const CandidatePairs &C,
+                                   TargetTransformInfo &TTI) {
+  auto CostKind = TargetTransformInfo::TCK_RecipThroughput;
+  Type *LaneTy = Key.Lanes.front()->getType();
+  const unsigned Width = static_cast<unsigned>(Key.Lanes.size());
+  const unsigned SrcWidth =
+      static_cast<unsigned>(C.Packs[A.Sources.front()].size());
+  auto *OpTy = cast<FixedVectorType>(widenLaneType(LaneTy, Width));
+  auto *SrcTy = cast<FixedVectorType>(widenLaneType(LaneTy, SrcWidth));
+  const unsigned SubW = OpTy->getNumElements() / Width;
+
+  double Cost = 0.0;
+  switch (A.Shape) {
+  case OperandAssembly::SubvectorOfOne:
+    Cost = toDouble(TTI.getShuffleCost(TargetTransformInfo::SK_ExtractSubvector,
+                                       OpTy, SrcTy, {}, CostKind,
+                                       static_cast<int>(A.SubvectorIndex * SubW),
+                                       OpTy));
+    break;
+  case OperandAssembly::PermuteOne:
+    Cost = toDouble(TTI.getShuffleCost(TargetTransformInfo::SK_PermuteSingleSrc,
+                                       OpTy, SrcTy, {}, CostKind, 0, nullptr));
+    break;
+  case OperandAssembly::ConcatTwo:
+    Cost = toDouble(TTI.getShuffleCost(TargetTransformInfo::SK_InsertSubvector,
+                                       OpTy, OpTy, {}, CostKind,
+                                       static_cast<int>(SrcTy->getNumElements()),
+                                       SrcTy));
+    break;
+  case OperandAssembly::PermuteTwo:
+    Cost = toDouble(TTI.getShuffleCost(TargetTransformInfo::SK_PermuteTwoSrc,
+                                       OpTy, SrcTy, {}, CostKind, 0, nullptr));
+    break;
+  }
+  for (unsigned I = 0; I < A.NumInserts; ++I)
+    Cost += toDouble(TTI.getVectorInstrCost(Instruction::InsertElement, OpTy,
+                                            CostKind, I, nullptr, nullptr));
+  return Cost;
+}
+
 static double estimateVecSavings(const Instruction *I, unsigned Width,
                                  TargetTransformInfo &TTI,
+                                 const TargetLibraryInfo &TLI,
                                  const DataLayout &DL) {
   if (!I || Width == 0)
     return 0.0;
@@ -96,54 +256,448 @@ static double estimateVecSavings(const Instruction *I, unsigned Width,
     return VecCost - ScalarTotal;
   }
 
-  auto estimateMem = [&](unsigned Opcode, Type *Ty, Align AlignV) {
-    if (!Ty)
-      return 0.0;
+  if (auto *UO = dyn_cast<UnaryOperator>(I)) {
+    Type *Ty = UO->getType();
+    double ScalarTotal =
+        toDouble(TTI.getArithmeticInstrCost(UO->getOpcode(), Ty, CostKind)) *
+        Width;
+    double VecCost = toDouble(TTI.getArithmeticInstrCost(
+        UO->getOpcode(), widenLaneType(Ty, Width), CostKind));
+    return VecCost - ScalarTotal;
+  }
 
-    double ScalarTotal = 0.0;
-    double VecCost = 0.0;
+  // Widening or narrowing casts change the number of registers the pack
+  // occupies; the vector cast cost on the widened types includes the split
+  // or the extra unpack/pack steps this takes on the target.
+  if (auto *Cast = dyn_cast<CastInst>(I)) {
+    Type *SrcTy = Cast->getSrcTy();
+    Type *DstTy = Cast->getDestTy();
+    double ScalarTotal =
+        toDouble(TTI.getCastInstrCost(Cast->getOpcode(), DstTy, SrcTy,
+                                      TargetTransformInfo::CastContextHint::None,
+                                      CostKind)) *
+        Width;
+    double VecCost = toDouble(TTI.getCastInstrCost(
+        Cast->getOpcode(), widenLaneType(DstTy, Width),
+        widenLaneType(SrcTy, Width), TargetTransformInfo::CastContextHint::None,
+        CostKind));
+    return VecCost - ScalarTotal;
+  }
 
-    if (auto *SubVecTy = dyn_cast<FixedVectorType>(Ty)) {
-      unsigned SubW = SubVecTy->getNumElements();
-      auto *WideTy =
-          FixedVectorType::get(SubVecTy->getElementType(), SubW * Width);
-      ScalarTotal = toDouble(TTI.getMemoryOpCost(Opcode, Ty, AlignV, 0,
-                                                 CostKind)) *
-                    Width;
-      VecCost =
-          toDouble(TTI.getMemoryOpCost(Opcode, WideTy, AlignV, 0, CostKind));
-    } else {
-      auto *WideTy = FixedVectorType::get(Ty, Width);
-      ScalarTotal =
-          toDouble(TTI.getMemoryOpCost(Opcode, Ty, AlignV, 0, CostKind)) * Width;
-      VecCost =
-          toDouble(TTI.getMemoryOpCost(Opcode, WideTy, AlignV, 0, CostKind));
+  if (isa<CmpInst>(I) || isa<SelectInst>(I)) {
+    Type *ValTy = isa<CmpInst>(I) ? I->getOperand(0)->getType() : I->getType();
+    Type *CondTy = isa<CmpInst>(I) ? I->getType() : I->getOperand(0)->getType();
+    CmpInst::Predicate Pred = CmpInst::BAD_ICMP_PREDICATE;
+    if (auto *Cmp = dyn_cast<CmpInst>(I))
+      Pred = Cmp->getPredicate();
+    double ScalarTotal =
+        toDouble(TTI.getCmpSelInstrCost(I->getOpcode(), ValTy, CondTy, Pred,
+                                        CostKind)) *
+        Width;
+    double VecCost = toDouble(TTI.getCmpSelInstrCost(
+        I->getOpcode(), widenLaneType(ValTy, Width),
+        widenLaneType(CondTy, Width), Pred, CostKind));
+    return VecCost - ScalarTotal;
+  }
+
+  Intrinsic::ID IID = getPackableIntrinsic(I);
+  if (IID != Intrinsic::not_intrinsic) {
+    auto *CI = cast<CallInst>(I);
+    FastMathFlags FMF;
+    if (isa<FPMathOperator>(CI))
+      FMF = CI->getFastMathFlags();
+
+    SmallVector<Type *, 4> ScalarArgTys;
+    SmallVector<Type *, 4> VecArgTys;
+    for (unsigned Arg = 0; Arg < CI->arg_size(); ++Arg) {
+      Type *ArgTy = CI->getArgOperand(Arg)->getType();
+      ScalarArgTys.push_back(ArgTy);
+      VecArgTys.push_back(Arg < getNumPackOperands(CI)
+                              ? widenLaneType(ArgTy, Width)
+                              : ArgTy);
     }
 
+    IntrinsicCostAttributes ScalarAttrs(IID, CI->getType(), ScalarArgTys, FMF);
+    IntrinsicCostAttributes VecAttrs(IID, widenLaneType(CI->getType(), Width),
+                                     VecArgTys, FMF);
+    double ScalarTotal =
+        toDouble(TTI.getIntrinsicInstrCost(ScalarAttrs, CostKind)) * Width;
+    double VecCost = toDouble(TTI.getIntrinsicInstrCost(VecAttrs, CostKind));
     return VecCost - ScalarTotal;
-  };
-
-  if (auto *LI = dyn_cast<LoadInst>(I)) {
-    return estimateMem(Instruction::Load, LI->getType(), LI->getAlign());
   }
 
-  if (auto *SI = dyn_cast<StoreInst>(I)) {
-    return estimateMem(Instruction::Store, SI->getValueOperand()->getType(),
-                       SI->getAlign());
+  // Library calls go through their TLI vector variant, padded up to its lane
+  // count (the padding shuffles are noise next to the call). Without one the
+  // pack would stay scalar and only add the cost of assembling its results.
+  if (isVectorLibraryCall(I, &TLI)) {
+    auto *CI = cast<CallInst>(I);
+    SmallVector<Type *, 4> ScalarArgTys;
+    for (const Value *Arg : CI->args())
+      ScalarArgTys.push_back(Arg->getType());
+    double ScalarTotal =
+        toDouble(TTI.getCallInstrCost(CI->getCalledFunction(), CI->getType(),
+                                      ScalarArgTys, CostKind)) *
+        Width;
+
+    unsigned VF = 0;
+    if (getVectorLibraryVariant(CI, TLI, Width, VF).empty())
+      return estimatePackConstructionCost(CI->getType(), Width, TTI);
+
+    SmallVector<Type *, 4> VecArgTys;
+    for (Type *ArgTy : ScalarArgTys)
+      VecArgTys.push_back(FixedVectorType::get(ArgTy, VF));
+    double VecCost = toDouble(TTI.getCallInstrCost(
+        nullptr, FixedVectorType::get(CI->getType(), VF), VecArgTys, CostKind));
+    return VecCost - ScalarTotal;
   }
 
   // Unsupported operation type for paper-parity objective terms.
   return 0.0;
 }
 
+// Load/store packs are priced by how their lanes sit in memory: one wide
+// access, whole runs plus a shuffle (priced as an interleaved access when the
+// lanes have a uniform stride), a masked store, or a gather/scatter.
+static double estimateMemPackSavings(const std::vector<const Instruction *> &Pack,
+                                     TargetTransformInfo &TTI,
+                                     const DataLayout &DL) {
+  MemPackLayout Layout;
+  if (!analyzeMemPack(Pack, DL, Layout))
+    return 0.0;
+
+  auto CostKind = TargetTransformInfo::TCK_RecipThroughput;
+  const bool IsLoad = isa<LoadInst>(Pack.front());
+  const unsigned Opcode = IsLoad ? Instruction::Load : Instruction::Store;
+  const unsigned Width = static_cast<unsigned>(Pack.size());
+  const unsigned AS = IsLoad
+                          ? cast<LoadInst>(Pack.front())->getPointerAddressSpace()
+                          : cast<StoreInst>(Pack.front())->getPointerAddressSpace();
+  Align MinAlign = IsLoad ? cast<LoadInst>(Pack.front())->getAlign()
+                          : cast<StoreInst>(Pack.front())->getAlign();
+  for (const Instruction *I : Pack)
+    MinAlign = std::min(MinAlign, IsLoad ? cast<LoadInst>(I)->getAlign()
+                                         : cast<StoreInst>(I)->getAlign());
+
+  Type *LaneTy = Layout.LaneTy;
+  Type *WideTy = widenLaneType(LaneTy, Width);
+  double ScalarTotal =
+      toDouble(TTI.getMemoryOpCost(Opcode, LaneTy, MinAlign, AS, CostKind)) *
+      Width;
+
+  double VecCost = 0.0;
+  switch (Layout.Shape) {
+  case MemPackShape::Contiguous: {
+    if (isPowerOf2_32(Width)) {
+      VecCost =
+          toDouble(TTI.getMemoryOpCost(Opcode, WideTy, MinAlign, AS, CostKind));
+      break;
+    }
+    // Odd widths are a full vector plus narrower tails, joined after the
+    // loads or cut apart before the stores (the leading part is the low end
+    // of the register and needs no shuffle). A one-lane tail is a scalar
+    // access plus an insert or extract, which is what the backend makes of
+    // it.
+    unsigned Done = 0;
+    for (unsigned Part : splitIntoPow2Parts(Width)) {
+      if (Part == 1 && !LaneTy->isVectorTy()) {
+        VecCost += toDouble(
+            TTI.getMemoryOpCost(Opcode, LaneTy, MinAlign, AS, CostKind));
+        VecCost += toDouble(TTI.getVectorInstrCost(
+            IsLoad ? Instruction::InsertElement : Instruction::ExtractElement,
+            WideTy, CostKind, Done, nullptr, nullptr));
+        Done += Part;
+        continue;
+      }
+      auto *PartTy = cast<FixedVectorType>(widenLaneType(LaneTy, Part));
+      VecCost += toDouble(
+          TTI.getMemoryOpCost(Opcode, PartTy, MinAlign, AS, CostKind));
+      if (IsLoad && Done > 0)
+        VecCost += toDouble(TTI.getShuffleCost(
+            TargetTransformInfo::SK_InsertSubvector, cast<VectorType>(WideTy),
+            cast<VectorType>(WideTy), {}, CostKind,
+            static_cast<int>(Done * (PartTy->getNumElements() / Part)), PartTy));
+      else if (!IsLoad && Done > 0)
+        VecCost += toDouble(TTI.getShuffleCost(
+            TargetTransformInfo::SK_ExtractSubvector, PartTy,
+            cast<VectorType>(WideTy), {}, CostKind,
+            static_cast<int>(Done * (PartTy->getNumElements() / Part)), PartTy));
+      Done += Part;
+    }
+    break;
+  }
+
+  case MemPackShape::Spans:
+    if (IsLoad && Layout.Spans.size() == 1 && Layout.Stride >= 2 &&
+        Layout.Stride <= 4 && !LaneTy->isVectorTy()) {
+      auto *GroupTy = FixedVectorType::get(
+          LaneTy, Width * static_cast<unsigned>(Layout.Stride));
+      VecCost = toDouble(TTI.getInterleavedMemoryOpCost(
+          Opcode, GroupTy, static_cast<unsigned>(Layout.Stride), {0}, MinAlign,
+          AS, CostKind));
+      break;
+    }
+    for (const auto &Span : Layout.Spans) {
+      Type *SpanTy =
+          widenLaneType(LaneTy, static_cast<unsigned>(Span.second - Span.first));
+      VecCost += IsLoad ? toDouble(TTI.getMemoryOpCost(Opcode, SpanTy, MinAlign,
+                                                       AS, CostKind))
+                        : toDouble(TTI.getMaskedMemoryOpCost(
+                              Opcode, SpanTy, MinAlign, AS, CostKind));
+    }
+    VecCost += toDouble(TTI.getShuffleCost(
+        Layout.Spans.size() == 1 ? TargetTransformInfo::SK_PermuteSingleSrc
+                                 : TargetTransformInfo::SK_PermuteTwoSrc,
+        cast<VectorType>(WideTy),
+        cast<VectorType>(widenLaneType(
+            LaneTy, static_cast<unsigned>(Layout.Spans.front().second))),
+        {}, CostKind));
+    break;
+
+  case MemPackShape::Gather: {
+    const Value *Ptr = IsLoad ? cast<LoadInst>(Pack.front())->getPointerOperand()
+                              : cast<StoreInst>(Pack.front())->getPointerOperand();
+    VecCost = toDouble(TTI.getGatherScatterOpCost(Opcode, WideTy, Ptr,
+                                                  /*VariableMask=*/false,
+                                                  MinAlign, CostKind));
+    break;
+  }
+  }
+
+  return VecCost - ScalarTotal;
+}
+
+// Width copies of a loop body statement from consecutive iterations, as the
+// unroll-to-pack pre-stage sees them: its unit-stride accesses become one
+// wide access, its operations one vector operation.
+static double estimateUnrolledCopySavings(const Instruction *I, unsigned Width,
+                                          TargetTransformInfo &TTI,
+                                          const TargetLibraryInfo &TLI,
+                                          const DataLayout &DL) {
+  if (!accessesMemory(I))
+    return estimateVecSavings(I, Width, TTI, TLI, DL);
+
+  auto CostKind = TargetTransformInfo::TCK_RecipThroughput;
+  const bool IsLoad = isa<LoadInst>(I);
+  const unsigned Opcode = IsLoad ? Instruction::Load : Instruction::Store;
+  Type *LaneTy = getLoadStoreType(const_cast<Instruction *>(I));
+  const unsigned AS = getLoadStoreAddressSpace(const_cast<Instruction *>(I));
+  const Align A = getLoadStoreAlignment(const_cast<Instruction *>(I));
+  double ScalarTotal =
+      toDouble(TTI.getMemoryOpCost(Opcode, LaneTy, A, AS, CostKind)) * Width;
+  double VecCost = toDouble(TTI.getMemoryOpCost(
+      Opcode, widenLaneType(LaneTy, Width), A, AS, CostKind));
+  return VecCost - ScalarTotal;
+}
+
+// If-converted loads and stores: a masked wide access for dense power-of-two
+// packs and a gather/scatter with a variable mask for any other layout, plus
+// an xor when some lane runs on the false edge. The mask itself is priced
+// like any operand pack of the guard conditions.
+static double
+estimatePredicatedMemPackSavings(const std::vector<const Instruction *> &Pack,
+                                 TargetTransformInfo &TTI,
+                                 const DataLayout &DL) {
+  MemPackLayout Layout;
+  if (!analyzeMemPack(Pack, DL, Layout) || Layout.LaneTy->isVectorTy())
+    return 0.0;
+  const unsigned Width = static_cast<unsigned>(Pack.size());
+  const bool Masked =
+      Layout.Shape == MemPackShape::Contiguous && isPowerOf2_32(Width);
+
+  auto CostKind = TargetTransformInfo::TCK_RecipThroughput;
+  auto *First = const_cast<Instruction *>(Pack.front());
+  const unsigned Opcode =
+      isa<LoadInst>(First) ? Instruction::Load : Instruction::Store;
+  const unsigned AS = getLoadStoreAddressSpace(First);
+  Align MinAlign = getLoadStoreAlignment(First);
+  bool AnyNegated = false;
+  for (const Instruction *I : Pack) {
+    MinAlign = std::min(MinAlign,
+                        getLoadStoreAlignment(const_cast<Instruction *>(I)));
+    BlockGuard G;
+    getBlockGuard(I->getParent(), G);
+    AnyNegated |= G.Negated;
+  }
+
+  Type *LaneTy = Layout.LaneTy;
+  auto *WideTy = FixedVectorType::get(LaneTy, Width);
+  double ScalarTotal =
+      toDouble(TTI.getMemoryOpCost(Opcode, LaneTy, MinAlign, AS, CostKind)) *
+      Width;
+  double VecCost =
+      Masked ? toDouble(TTI.getMaskedMemoryOpCost(Opcode, WideTy, MinAlign, AS,
+                                                  CostKind))
+             : toDouble(TTI.getGatherScatterOpCost(
+                   Opcode, WideTy, getLoadStorePointerOperand(First),
+                   /*VariableMask=*/true, MinAlign, CostKind));
+  if (AnyNegated) {
+    auto *MaskTy = FixedVectorType::get(Type::getInt1Ty(First->getContext()),
+                                        Width);
+    VecCost += toDouble(
+        TTI.getArithmeticInstrCost(Instruction::Xor, MaskTy, CostKind));
+  }
+  return VecCost - ScalarTotal;
+}
+
+// Alternating add/sub (fadd/fsub) packs run both vector ops and blend the
+// results, unless the target has one instruction for the pattern (x86
+// addsub).
+static double estimateAltOpSavings(const std::vector<const Instruction *> &Pack,
+                                   TargetTransformInfo &TTI) {
+  auto CostKind = TargetTransformInfo::TCK_RecipThroughput;
+  Type *LaneTy = Pack.front()->getType();
+  auto *VecTy = cast<FixedVectorType>(
+      widenLaneType(LaneTy, static_cast<unsigned>(Pack.size())));
+  const unsigned NumElts = VecTy->getNumElements();
+  const unsigned SubW = NumElts / static_cast<unsigned>(Pack.size());
+  const unsigned Opcode0 = Pack.front()->getOpcode();
+  const unsigned Opcode1 = getAlternateOpcode(Opcode0);
+
+  SmallBitVector OpcodeMask(NumElts);
+  double ScalarTotal = 0.0;
+  for (unsigned Lane = 0; Lane < Pack.size(); ++Lane) {
+    unsigned Opcode = Pack[Lane]->getOpcode();
+    ScalarTotal +=
+        toDouble(TTI.getArithmeticInstrCost(Opcode, LaneTy, CostKind));
+    if (Opcode == Opcode1)
+      OpcodeMask.set(Lane * SubW, (Lane + 1) * SubW);
+  }
+
+  double VecCost =
+      toDouble(TTI.getArithmeticInstrCost(Opcode0, VecTy, CostKind));
+  if (!TTI.isLegalAltInstr(VecTy, Opcode0, Opcode1, OpcodeMask)) {
+    SmallVector<int, 16> Mask;
+    for (unsigned I = 0; I < NumElts; ++I)
+      Mask.push_back(OpcodeMask[I] ? static_cast<int>(NumElts + I)
+                                   : static_cast<int>(I));
+    VecCost += toDouble(TTI.getArithmeticInstrCost(Opcode1, VecTy, CostKind));
+    VecCost += toDouble(TTI.getShuffleCost(TargetTransformInfo::SK_Select,
+                                           VecTy, VecTy, Mask, CostKind, 0,
+                                           nullptr));
+  }
+  return VecCost - ScalarTotal;
+}
+
+static double estimatePackSavings(const std::vector<const Instruction *> &Pack,
+                                  TargetTransformInfo &TTI,
+                                  const TargetLibraryInfo &TLI,
+                                  const DataLayout &DL) {
+  if (Pack.empty())
+    return 0.0;
+  if (accessesMemory(Pack.front()))
+    return isPredicatedPack(Pack)
+               ? estimatePredicatedMemPackSavings(Pack, TTI, DL)
+               : estimateMemPackSavings(Pack, TTI, DL);
+  if (isAlternatingPack(Pack))
+    return estimateAltOpSavings(Pack, TTI);
+  return estimateVecSavings(Pack.front(), static_cast<unsigned>(Pack.size()),
+                            TTI, TLI, DL);
+}
+
+// A pack wider than one register is legalized into register-sized parts.
+// Cost models often price such illegal types optimistically, so the pack is
+// charged at least what its parts would cost as separate packs; the ILP then
+// weighs it against the narrower survivors it was merged from.
+static double
+estimateSplitPackSavings(const std::vector<const Instruction *> &Pack,
+                         TargetTransformInfo &TTI, const TargetLibraryInfo &TLI,
+                         const DataLayout &DL) {
+  double Savings = estimatePackSavings(Pack, TTI, TLI, DL);
+  if (Pack.empty())
+    return Savings;
+  const unsigned Part = getPackWidthLimits(Pack.front(), TTI, DL).Preferred;
+  if (Pack.size() <= Part)
+    return Savings;
+
+  // The last part may be a narrower (or odd-width) tail.
+  double SplitSavings = 0.0;
+  for (size_t Lo = 0; Lo < Pack.size(); Lo += Part) {
+    std::vector<const Instruction *> Sub(
+        Pack.begin() + Lo, Pack.begin() + std::min(Pack.size(), Lo + Part));
+    if (Sub.size() > 1)
+      SplitSavings += estimatePackSavings(Sub, TTI, TLI, DL);
+  }
+  return std::max(Savings, SplitSavings);
+}
+
+// Candidates that form a complete interleaved group share one wide access and
+// its (de)interleave shuffles, which targets lower to ld2/ld3/ld4 or
+// permutes. Emission only does this when every member is selected, so each
+// member keeps its stand-alone strided cost and the difference to the group
+// cost is a joint term over the whole group.
+static void applyInterleaveGroupSavings(const CandidatePairs &C, ILPModel &Model,
+                                        TargetTransformInfo &TTI,
+                                        const DataLayout &DL) {
+  auto CostKind = TargetTransformInfo::TCK_RecipThroughput;
+  for (const auto &Group : findInterleaveGroups(C.Packs, DL)) {
+    const auto &First = C.Packs[Group.front()];
+    const bool IsLoad = isa<LoadInst>(First.front());
+    const unsigned Opcode = IsLoad ? Instruction::Load : Instruction::Store;
+    const unsigned Factor = static_cast<unsigned>(Group.size());
+    const unsigned Width = static_cast<unsigned>(First.size());
+    Type *LaneTy = IsLoad ? First.front()->getType()
+                          : cast<StoreInst>(First.front())
+                                ->getValueOperand()
+                                ->getType();
+    const unsigned AS = IsLoad
+                            ? cast<LoadInst>(First.front())->getPointerAddressSpace()
+                            : cast<StoreInst>(First.front())->getPointerAddressSpace();
+    Align MinAlign = getLoadStoreAlignment(const_cast<Instruction *>(First.front()));
+    for (uint32_t P : Group) {
+      for (const Instruction *I : C.Packs[P])
+        MinAlign = std::min(
+            MinAlign, getLoadStoreAlignment(const_cast<Instruction *>(I)));
+    }
+
+    SmallVector<unsigned, 4> Indices;
+    for (unsigned F = 0; F < Factor; ++F)
+      Indices.push_back(F);
+    double GroupCost = toDouble(TTI.getInterleavedMemoryOpCost(
+        Opcode, FixedVectorType::get(LaneTy, Width * Factor), Factor, Indices,
+        MinAlign, AS, CostKind));
+    double ScalarTotal =
+        toDouble(TTI.getMemoryOpCost(Opcode, LaneTy, MinAlign, AS, CostKind)) *
+        Width;
+    double Standalone = 0.0;
+    for (uint32_t P : Group)
+      Standalone += Model.VecSavings[P];
+    Model.InterleaveGroups.push_back(Group);
+    Model.InterleaveDiscount.push_back(GroupCost - ScalarTotal * Factor -
+                                       Standalone);
+  }
+}
+
+// A speculated statement of a predicated pack is only computed after the
+// last guard's condition, so a scalar user that runs earlier (in the lane's
+// own guarded block, or a PHI of its join) cannot be given an extract.
+static bool isReadBeforePredicatedAnchor(
+    const std::vector<const Instruction *> &Pack, unsigned Lane,
+    const ControlEquivalence &CE) {
+  const Instruction *Anchor = nullptr;
+  for (const Instruction *I : Pack) {
+    BlockGuard G;
+    if (!getBlockGuard(I->getParent(), G))
+      return false;
+    if (!Anchor || CE.comesBefore(Anchor, G.Head->getTerminator()))
+      Anchor = G.Head->getTerminator();
+  }
+  return llvm::any_of(Pack[Lane]->users(), [&](const User *U) {
+    auto *UI = dyn_cast<Instruction>(U);
+    return UI && (isa<PHINode>(UI) || !CE.DT.dominates(Anchor, UI));
+  });
+}
+
 static ILPModel buildILPModel(const CandidatePairs &C, ShuffleCost &SC,
                               TargetTransformInfo &TTI,
-                              const DataLayout &DL) {
+                              const TargetLibraryInfo &TLI,
+                              const DataLayout &DL,
+                              const ControlEquivalence &CE) {
   ILPModel Model;
   const size_t N = C.Packs.size();
   Model.VecSavings.assign(N, 0.0);
   Model.PackCost.assign(N, 0.0);
   Model.LaneExtractCost.assign(N, {});
+  Model.UnextractableLanes.assign(N, {});
 
   for (size_t I = 0; I < N; ++I) {
     Node NNode;
@@ -151,26 +705,34 @@ static ILPModel buildILPModel(const CandidatePairs &C, ShuffleCost &SC,
     NNode.pack = C.Packs[I];
 
     Model.PackCost[I] = toDouble(SC.getPackCost(NNode));
-    Model.VecSavings[I] = estimateVecSavings(
-        C.Packs[I].empty() ? nullptr : C.Packs[I].front(),
-        static_cast<unsigned>(C.Packs[I].size()), TTI, DL);
+    Model.VecSavings[I] = estimateSplitPackSavings(C.Packs[I], TTI, TLI, DL);
 
     auto &LaneCosts = Model.LaneExtractCost[I];
     LaneCosts.resize(C.Packs[I].size(), 0.0);
+    auto &Unextractable = Model.UnextractableLanes[I];
+    Unextractable.resize(C.Packs[I].size(), false);
+    const bool Speculated =
+        !accessesMemory(C.Packs[I].front()) && isPredicatedPack(C.Packs[I]);
     for (unsigned Lane = 0; Lane < C.Packs[I].size(); ++Lane) {
       LaneCosts[Lane] = toDouble(SC.getExtractLaneCost(C.Packs[I], Lane));
+      Unextractable[Lane] =
+          Speculated && isReadBeforePredicatedAnchor(C.Packs[I], Lane, CE);
     }
   }
 
-  Model.NonVecPackCost.assign(C.NonVecPacks.size(), 0.0);
-  for (size_t NV = 0; NV < C.NonVecPacks.size(); ++NV) {
-    const auto &Key = C.NonVecPacks[NV];
+  applyInterleaveGroupSavings(C, Model, TTI, DL);
+
+  // Non-vector operand packs are only discovered as the solver activates the
+  // packs that read them, so they are priced through a callback.
+  Model.NonVecCostFn = [&TTI](const ValuePackKey &Key) {
     if (Key.Lanes.empty())
-      continue;
-    Type *LaneTy = Key.Lanes.front()->getType();
-    Model.NonVecPackCost[NV] = estimatePackConstructionCost(
-        LaneTy, static_cast<unsigned>(Key.Lanes.size()), TTI);
-  }
+      return 0.0;
+    return estimateNonVecPackCost(Key, TTI);
+  };
+  Model.AssemblyCostFn = [&C, &TTI](const ValuePackKey &Key,
+                                    const OperandAssembly &A) {
+    return estimateAssemblyCost(Key, A, C, TTI);
+  };
 
   return Model;
 }
@@ -180,6 +742,7 @@ public:
   bool specific_function = false;
   std::string target_function;
   bool debug_flag = false;
+  bool unroll_loops = true;
 
   GoSLPPass() = default;
   explicit GoSLPPass(std::string FnName)
@@ -194,29 +757,63 @@ PreservedAnalyses GoSLPPass::run(Function &F, FunctionAnalysisManager &FAM) {
   if (specific_function && !F.getName().contains(target_function))
     return PreservedAnalyses::all();
 
+  TargetTransformInfo &TTI = FAM.getResult<TargetIRAnalysis>(F);
+  TargetLibraryInfo &TLI = FAM.getResult<TargetLibraryAnalysis>(F);
+  const DataLayout &DL = F.getParent()->getDataLayout();
+  bool Changed = false;
+
+  // Unroll rolled loops first so their iterations' statements sit side by
+  // side; the analyses below then see the unrolled bodies.
+  if (unroll_loops) {
+    auto Savings = [&TTI, &TLI, &DL](const Instruction *I, unsigned Width) {
+      return estimateUnrolledCopySavings(I, Width, TTI, TLI, DL);
+    };
+    auto MaxWidth = [&TTI, &DL](const Instruction *I) {
+      return getPackWidthLimits(I, TTI, DL).Max;
+    };
+    if (unrollLoopsForPacking(
+            F, FAM.getResult<LoopAnalysis>(F),
+            FAM.getResult<ScalarEvolutionAnalysis>(F),
+            FAM.getResult<DominatorTreeAnalysis>(F),
+            FAM.getResult<AssumptionAnalysis>(F), FAM.getResult<AAManager>(F),
+            TTI, TLI, Savings, MaxWidth, debug_flag)) {
+      PreservedAnalyses PA;
+      PA.preserve<TargetIRAnalysis>();
+      PA.preserve<TargetLibraryAnalysis>();
+      FAM.invalidate(F, PA);
+      Changed = true;
+    }
+  }
+
   AAResults &AA = FAM.getResult<AAManager>(F);
   auto &MSSAAnalysis = FAM.getResult<MemorySSAAnalysis>(F);
   MemorySSA &MSSA = MSSAAnalysis.getMSSA();
-  TargetTransformInfo &TTI = FAM.getResult<TargetIRAnalysis>(F);
-  const DataLayout &DL = F.getParent()->getDataLayout();
+  // Statements of blocks that always run together may share a pack.
+  ControlEquivalence CE(F, FAM.getResult<DominatorTreeAnalysis>(F),
+                        FAM.getResult<PostDominatorTreeAnalysis>(F),
+                        FAM.getResult<LoopAnalysis>(F));
 
   errs() << "\n========== GoSLP on function " << F.getName()
          << " ==========\n";
 
-  bool Changed = false;
-  CandidatePairs C = collectCandidatePairs(F, AA, MSSA, debug_flag);
-  if (debug_flag) {
-    printCandidatePairs(C);
-  } else {
-    errs() << "Candidate packs: " << C.Packs.size()
-           << ", vec-vec edges: " << C.VecVecUses.size()
-           << ", non-vec packs: " << C.NonVecPacks.size() << "\n";
-  }
+  WorkBudget CollectBudget = makeBudget(debug_flag ? 60.0 : 8.0);
+  CandidatePairs C = collectCandidatePairs(F, AA, MSSA, &TLI, &CE,
+                                           CollectBudget, debug_flag);
 
-  if (!C.Packs.empty()) {
-    VecGraph G = buildVectorGraph(C);
+  // Paper-style rounds: solve over pairs, commit the chosen packs as new
+  // statements, pair those up again and re-solve until nothing merges.
+  auto MaxPackWidth = [&TTI, &DL](const Instruction *I) {
+    return getPackWidthLimits(I, TTI, DL).Max;
+  };
+  std::vector<bool> Chosen;
+  std::vector<std::vector<const Instruction *>> PrevSurvivors;
+  // The previous round's candidates, selection and objective.
+  CandidatePairs PrevC;
+  std::vector<bool> PrevChosen;
+  double PrevObjective = 0.0;
+  for (unsigned Round = 1; !C.Packs.empty(); ++Round) {
     ShuffleCost SC = createShuffleCostCalculator(F, TTI, C);
-    ILPModel Model = buildILPModel(C, SC, TTI, DL);
+    ILPModel Model = buildILPModel(C, SC, TTI, TLI, DL, CE);
 
     if (debug_flag) {
       errs() << "==================== Vec Savings ====================\n";
@@ -230,23 +827,79 @@ PreservedAnalyses GoSLPPass::run(Function &F, FunctionAnalysisManager &FAM) {
       errs() << "====================================================\n";
     }
 
-    double TimeLimitSeconds = debug_flag
-                                  ? 15.0
-                                  : std::max(0.5, std::min(4.0, 0.05 * C.Packs.size()));
-    std::vector<bool> Chosen = solveILP(C, Model, TimeLimitSeconds);
-    bool AnyChosen = llvm::any_of(Chosen, [](bool V) { return V; });
+    WorkBudget ILPBudget = makeBudget(
+        debug_flag ? 15.0 : std::max(0.5, std::min(4.0, 0.05 * C.Packs.size())));
+    double Objective = 0.0;
+    Chosen = solveILP(C, Model, ILPBudget, &Objective);
+    if (ILPBudget.emergencyHit())
+      errs() << "ILP hit the emergency wall-clock cutoff; selection may vary "
+                "between runs.\n";
 
-    if (AnyChosen) {
-      Perms LanePerm = choosePermutationsDP(G, Chosen, SC);
-      Changed |= emit(F, C, Chosen, LanePerm, debug_flag);
+    // The use maps are filled in while the objective is built, and only for
+    // packs that survive the presolve, so the round is printed after solving.
+    if (debug_flag) {
+      errs() << "---------- Round " << Round << " ----------\n";
+      printCandidatePairs(C);
     } else {
-      errs() << "ILP chose no packs.\n";
+      errs() << "Round " << Round << ": candidate packs: " << C.Packs.size()
+             << ", vec-vec edges: " << C.VecVecUses.size()
+             << ", non-vec packs: " << C.NonVecPacks.size() << "\n";
     }
-  } else {
+
+    // If the ILP kept none of this round's merges, the next round would be
+    // built from the same survivors and solve the same problem again.
+    std::vector<std::vector<const Instruction *>> Survivors;
+    for (uint32_t P = 0; P < C.Packs.size() && P < Chosen.size(); ++P) {
+      if (Chosen[P])
+        Survivors.push_back(C.Packs[P]);
+    }
+    if (Round > 1 && Survivors == PrevSurvivors)
+      break;
+    PrevSurvivors = std::move(Survivors);
+
+    // A widening round can still select the previous round's packs, so it
+    // should never do worse. When the solver ran out of work before matching
+    // it, the previous round's selection is the one emitted.
+    if (Round > 1 && Objective >= PrevObjective) {
+      if (debug_flag)
+        errs() << "Round " << Round << " does not improve on round "
+               << Round - 1 << " (" << Objective << " >= " << PrevObjective
+               << "); keeping its selection.\n";
+      C = std::move(PrevC);
+      Chosen = std::move(PrevChosen);
+      break;
+    }
+
+    bool Widened = false;
+    CandidatePairs Next = widenSelectedPacks(F, C, Chosen, MSSA, CollectBudget,
+                                             MaxPackWidth, &CE, debug_flag,
+                                             Widened);
+    if (!Widened)
+      break;
+    PrevC = std::move(C);
+    PrevChosen = Chosen;
+    PrevObjective = Objective;
+    C = std::move(Next);
+  }
+
+  bool AnyChosen = llvm::any_of(Chosen, [](bool V) { return V; });
+  if (C.Packs.empty()) {
     errs() << "No candidate packs for standard SLP.\n";
+  } else if (AnyChosen) {
+    VecGraph G = buildVectorGraph(C);
+    ShuffleCost SC = createShuffleCostCalculator(F, TTI, C);
+    WorkBudget PermuteBudget = makeBudget(1.0);
+    Perms LanePerm = choosePermutationsDP(G, Chosen, SC, PermuteBudget);
+    WorkBudget ScheduleBudget = makeBudget(1.0);
+    Changed |= placeCrossBlockPacks(C, Chosen, CE, AA, ScheduleBudget,
+                                    debug_flag);
+    Changed |= schedulePacks(F, C, Chosen, AA, ScheduleBudget, debug_flag);
+    Changed |= emit(F, C, Chosen, LanePerm, TLI, debug_flag);
+  } else {
+    errs() << "ILP chose no packs.\n";
   }
 
-  Changed |= runReductionAwareGoSLP(F, TTI, DL, debug_flag);
+  Changed |= runReductionAwareGoSLP(F, TTI, DL, AA, debug_flag);
 
   return Changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
 }
@@ -263,6 +916,7 @@ extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
                   bool HasFilter = false;
                   std::string FnName;
                   bool DebugFlag = false;
+                  bool UnrollLoops = true;
 
                   for (auto &Elem : Pipeline) {
                     auto Parts = Elem.Name.split(':');
@@ -276,15 +930,21 @@ extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
                     if (Parts.first == "o3flag") {
                       DebugFlag = Parts.second.empty() || Parts.second == "true";
                     }
+
+                    if (Parts.first == "unroll") {
+                      UnrollLoops = Parts.second.empty() || Parts.second == "true";
+                    }
                   }
 
                   if (HasFilter) {
                     GoSLPPass P(FnName);
                     P.debug_flag = DebugFlag;
+                    P.unroll_loops = UnrollLoops;
                     FPM.addPass(std::move(P));
                   } else {
                     GoSLPPass P;
                     P.debug_flag = DebugFlag;
+                    P.unroll_loops = UnrollLoops;
                     FPM.addPass(std::move(P));
                   }
 
@@ -1,4 +1,7 @@
 #include "ILP.hpp"
+#include "LocalSearch.hpp"
+#include "ObjectiveTerms.hpp"
+#include "TreeDP.hpp"
 
 #include <algorithm>
 #include <numeric>
@@ -8,91 +11,6 @@ using namespace llvm;
 
 namespace {
 
-static bool hasChosenUse(const std::vector<uint32_t> &Uses,
-                         const std::vector<bool> &Chosen) {
-  for (uint32_t U : Uses) {
-    if (U < Chosen.size() && Chosen[U])
-      return true;
-  }
-  return false;
-}
-
-static double evaluateObjective(const CandidatePairs &C, const ILPModel &Model,
-                                const std::vector<bool> &Chosen) {
-  const size_t N = C.Packs.size();
-  double Obj = 0.0;
-
-  // VS term
-  for (size_t P = 0; P < N; ++P) {
-    if (Chosen[P] && P < Model.VecSavings.size())
-      Obj += Model.VecSavings[P];
-  }
-
-  // PCvec term: pack candidate vectors when producer is not selected but some
-  // vectorized use requires it.
-  for (size_t P = 0; P < N; ++P) {
-    if (Chosen[P])
-      continue;
-
-    auto It = C.VecVecUses.find(static_cast<uint32_t>(P));
-    if (It == C.VecVecUses.end())
-      continue;
-
-    if (hasChosenUse(It->second, Chosen) && P < Model.PackCost.size())
-      Obj += Model.PackCost[P];
-  }
-
-  // PCnonvec term.
-  for (auto &Entry : C.NonVecVecUses) {
-    uint32_t NonVecIdx = Entry.first;
-    if (!hasChosenUse(Entry.second, Chosen))
-      continue;
-    if (NonVecIdx < Model.NonVecPackCost.size())
-      Obj += Model.NonVecPackCost[NonVecIdx];
-  }
-
-  // UC term: extract once per lane if any use remains non-vectorized.
-  for (size_t P = 0; P < N; ++P) {
-    if (!Chosen[P])
-      continue;
-
-    if (P >= C.LaneUses.size() || P >= Model.LaneExtractCost.size())
-      continue;
-
-    const auto &Lanes = C.LaneUses[P];
-    const auto &LaneCosts = Model.LaneExtractCost[P];
-
-    for (size_t Lane = 0; Lane < Lanes.size() && Lane < LaneCosts.size();
-         ++Lane) {
-      const LaneUseInfo &Info = Lanes[Lane];
-      bool NeedExtract = Info.HasOutsideUse;
-
-      if (!NeedExtract) {
-        for (const auto &UserEntry : Info.UserToVectorUses) {
-          const auto &UsePacks = UserEntry.second;
-          bool UserVectorized = false;
-          for (uint32_t UsePack : UsePacks) {
-            if (UsePack < Chosen.size() && Chosen[UsePack]) {
-              UserVectorized = true;
-              break;
-            }
-          }
-
-          if (!UserVectorized) {
-            NeedExtract = true;
-            break;
-          }
-        }
-      }
-
-      if (NeedExtract)
-        Obj += LaneCosts[Lane];
-    }
-  }
-
-  return Obj;
-}
-
 static bool conflictsWithChosen(const CandidatePairs &C,
                                 const std::vector<bool> &Chosen,
                                 uint32_t PackIdx) {
@@ -107,18 +25,46 @@ static bool conflictsWithChosen(const CandidatePairs &C,
 
 } // namespace
 
-std::vector<bool> solveILP(const CandidatePairs &C, const ILPModel &Model,
-                           double TimeLimitSeconds) {
+std::vector<bool> solveILP(CandidatePairs &C, ILPModel &Model,
+                           WorkBudget &Budget, double *Objective) {
   const int N = static_cast<int>(C.Packs.size());
   std::vector<bool> Best(N, false);
   std::vector<bool> Cur(N, false);
 
+  if (Objective)
+    *Objective = 0.0;
   if (N == 0)
     return Best;
 
+  // Forest-shaped and other low-treewidth interaction graphs are solved
+  // exactly by DP; branch-and-bound is only needed for wider graphs.
+  const unsigned MaxTreeWidth = 12;
+  ObjectiveTerms Terms =
+      buildObjectiveTerms(C, Model, presolveLivePacks(C, Model));
+  unsigned Width = 0;
+  WorkBudget DPBudget = Budget.carve(0.5);
+  bool Solved = solveByTreeDecomposition(C, Model, Terms, MaxTreeWidth,
+                                         DPBudget, Best, Width);
+  Budget.absorb(DPBudget);
+  if (Solved) {
+    if (Objective)
+      *Objective = evaluateObjective(C, Model, Terms, Best);
+    return Best;
+  }
+
   std::vector<double> VecSavings(N, 0.0);
   for (int I = 0; I < N && I < static_cast<int>(Model.VecSavings.size()); ++I)
     VecSavings[I] = Model.VecSavings[I];
+  // An interleaved group's discount only applies once every member is
+  // selected. Spreading a profitable discount over the members keeps the
+  // linear bound below any completion and lets the members go first.
+  for (size_t G = 0; G < Model.InterleaveGroups.size(); ++G) {
+    const auto &Members = Model.InterleaveGroups[G];
+    if (Model.InterleaveDiscount[G] >= 0.0)
+      continue;
+    for (uint32_t P : Members)
+      VecSavings[P] += Model.InterleaveDiscount[G] / Members.size();
+  }
 
   std::vector<int> Order(N);
   std::iota(Order.begin(), Order.end(), 0);
@@ -150,7 +96,7 @@ std::vector<bool> solveILP(const CandidatePairs &C, const ILPModel &Model,
         break;
       }
     }
-    if (Overlap)
+    if (Overlap || !activatePack(C, Model, Terms, static_cast<uint32_t>(Idx)))
       continue;
 
     Cur[Idx] = true;
@@ -158,28 +104,47 @@ std::vector<bool> solveILP(const CandidatePairs &C, const ILPModel &Model,
       UsedInsts.insert(I);
   }
 
-  double BestObjective = evaluateObjective(C, Model, Cur);
+  // The seed ignores the lane requirements; drop the packs that miss them.
+  dropUnmetRequirements(C, Terms, Cur);
+  double BestObjective = evaluateObjective(C, Model, Terms, Cur);
   Best = Cur;
 
   // Reset state for DFS.
   std::fill(Cur.begin(), Cur.end(), false);
   UsedInsts.clear();
 
-  auto Start = std::chrono::steady_clock::now();
-  auto Deadline = Start + std::chrono::duration<double>(TimeLimitSeconds);
-  bool TimeLimitHit = false;
+  // Part of the budget is reserved for local search: a short warm-up that
+  // hands a stronger incumbent to branch-and-bound for pruning, and a second
+  // pass that polishes the B&B incumbent if the exact search runs out of work.
+  const double WarmupShare = 0.1;
+  const double PolishShare = 0.1;
+  auto polish = [&](WorkBudget &LSBudget) {
+    std::vector<bool> Seed = Best;
+    if (improveByLocalSearch(C, Model, Terms, Seed, Best, BestObjective,
+                             LSBudget))
+      BestObjective = evaluateObjective(C, Model, Terms, Best);
+    Budget.absorb(LSBudget);
+  };
+  WorkBudget Warmup = Budget.carve(WarmupShare);
+  polish(Warmup);
+
+  WorkBudget SearchBudget = Budget.carve(1.0 - PolishShare / (1.0 - WarmupShare));
+  bool BudgetHit = false;
 
   std::function<void(int, double)> DFS = [&](int Pos, double LinearCost) {
-    if (TimeLimitHit)
+    if (BudgetHit)
       return;
 
-    if (TimeLimitSeconds > 0.0 && std::chrono::steady_clock::now() > Deadline) {
-      TimeLimitHit = true;
+    if (!SearchBudget.charge()) {
+      BudgetHit = true;
       return;
     }
 
     if (Pos == N) {
-      double Obj = evaluateObjective(C, Model, Cur);
+      SearchBudget.charge(std::max<size_t>(1, Terms.Terms.size()));
+      if (!meetsRequirements(C, Terms, Cur))
+        return;
+      double Obj = evaluateObjective(C, Model, Terms, Cur);
       if (Obj < BestObjective) {
         BestObjective = Obj;
         Best = Cur;
@@ -198,7 +163,9 @@ std::vector<bool> solveILP(const CandidatePairs &C, const ILPModel &Model,
     Cur[Idx] = false;
     DFS(Pos + 1, LinearCost);
 
-    // Branch 2: take.
+    // Branch 2: take (presolved packs stay unselected).
+    if (!Terms.Live[Idx])
+      return;
     if (conflictsWithChosen(C, Cur, static_cast<uint32_t>(Idx)))
       return;
 
@@ -212,6 +179,9 @@ std::vector<bool> solveILP(const CandidatePairs &C, const ILPModel &Model,
     if (Overlap)
       return;
 
+    // The pack's use maps and terms are built the first time it is taken.
+    if (!activatePack(C, Model, Terms, static_cast<uint32_t>(Idx)))
+      return;
     Cur[Idx] = true;
     std::vector<const Instruction *> Inserted;
     Inserted.reserve(C.Packs[Idx].size());
@@ -229,5 +199,13 @@ std::vector<bool> solveILP(const CandidatePairs &C, const ILPModel &Model,
   };
 
   DFS(0, 0.0);
+  Budget.absorb(SearchBudget);
+
+  if (BudgetHit) {
+    WorkBudget Polish = Budget.carve(1.0);
+    polish(Polish);
+  }
+  if (Objective)
+    *Objective = BestObjective;
   return Best;
 }
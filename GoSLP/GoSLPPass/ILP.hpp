@@ -1,9 +1,10 @@
 #pragma once
 #include <vector>
+#include <unordered_map>
 #include <unordered_set>
-#include <chrono>
 #include <functional>
 #include "CandidatePacks.hpp"
+#include "WorkBudget.hpp"
 
 struct ILPModel {
   // Vector savings term (negative means profitable).
@@ -11,10 +12,30 @@ struct ILPModel {
   // Packing cost for candidate vector packs.
   std::vector<double> PackCost;
   // Packing cost for non-vector packs (indexed by CandidatePairs::NonVecPacks).
+  // Filled through NonVecCostFn as the lazy use maps discover new packs.
   std::vector<double> NonVecPackCost;
+  std::function<double(const ValuePackKey &)> NonVecCostFn;
+  // Cost of each CandidatePairs::NonVecAssemblies entry, filled alongside
+  // NonVecPackCost; the cheapest applicable one replaces the full cost.
+  std::unordered_map<uint32_t, std::vector<double>> NonVecAssemblyCost;
+  std::function<double(const ValuePackKey &, const OperandAssembly &)>
+      AssemblyCostFn;
   // Lane extraction cost for each candidate pack.
   std::vector<std::vector<double>> LaneExtractCost;
+  // Lanes that cannot be extracted at all: the pack may only be selected
+  // together with packs that consume every scalar user of such a lane.
+  std::vector<std::vector<bool>> UnextractableLanes;
+  // Complete interleaved access groups (pack indices). Selecting every member
+  // of group G adds InterleaveDiscount[G] to the members' own savings.
+  std::vector<std::vector<uint32_t>> InterleaveGroups;
+  std::vector<double> InterleaveDiscount;
 };
 
-std::vector<bool> solveILP(const CandidatePairs &C, const ILPModel &Model,
-                           double TimeLimitSeconds);
+// Budget units: one per branch-and-bound node, one per objective term at
+// leaves and local-search moves, one per tree-DP table cell.
+// Use maps in C and non-vector costs in Model are filled in for a pack the
+// first time a solver considers selecting it (see activatePack), and never
+// for packs the presolve fixes to unselected.
+// Objective, if given, receives the selection's objective value.
+std::vector<bool> solveILP(CandidatePairs &C, ILPModel &Model,
+                           WorkBudget &Budget, double *Objective = nullptr);
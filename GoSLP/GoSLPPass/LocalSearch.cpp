@@ -0,0 +1,296 @@
+#include "LocalSearch.hpp"
+
+#include "llvm/ADT/STLExtras.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+
+using namespace llvm;
+
+namespace {
+
+// Scores a set of simultaneous flips by re-evaluating only the terms whose
+// scope touches one of the flipped packs.
+// Packs a move selects are activated first, so their terms are in place.
+class FlipEvaluator {
+public:
+  FlipEvaluator(CandidatePairs &C, ILPModel &Model, ObjectiveTerms &T,
+                std::vector<bool> Chosen)
+      : C(C), Model(Model), T(T), Chosen(std::move(Chosen)),
+        Stamp(T.Terms.size(), 0) {}
+
+  const std::vector<bool> &state() const { return Chosen; }
+  size_t lastAffected() const { return Affected.size(); }
+
+  double delta(const std::vector<uint32_t> &Flips) {
+    for (uint32_t P : Flips) {
+      if (!Chosen[P])
+        activatePack(C, Model, T, P);
+    }
+    Stamp.resize(T.Terms.size(), 0);
+    collectAffected(Flips);
+    double Before = sumAffected();
+    flip(Flips);
+    double After = sumAffected();
+    flip(Flips);
+    return After - Before;
+  }
+
+  void apply(const std::vector<uint32_t> &Flips) { flip(Flips); }
+
+  // False if the flips select a pack that is not live, or leave a lane
+  // requirement that reads a flipped pack unmet.
+  bool feasible(const std::vector<uint32_t> &Flips) {
+    flip(Flips);
+    bool OK = true;
+    for (uint32_t P : Flips) {
+      OK = !Chosen[P] || T.Live[P];
+      for (uint32_t Idx : T.PackToRequirements[P]) {
+        if (!OK)
+          break;
+        OK = meetsRequirement(C, T.Requirements[Idx], Chosen);
+      }
+      if (!OK)
+        break;
+    }
+    flip(Flips);
+    return OK;
+  }
+
+private:
+  CandidatePairs &C;
+  ILPModel &Model;
+  ObjectiveTerms &T;
+  std::vector<bool> Chosen;
+  std::vector<uint32_t> Stamp;
+  uint32_t Epoch = 0;
+  std::vector<uint32_t> Affected;
+
+  void collectAffected(const std::vector<uint32_t> &Flips) {
+    Affected.clear();
+    if (++Epoch == 0) {
+      std::fill(Stamp.begin(), Stamp.end(), 0);
+      Epoch = 1;
+    }
+    for (uint32_t P : Flips) {
+      for (uint32_t TermIdx : T.PackToTerms[P]) {
+        if (Stamp[TermIdx] == Epoch)
+          continue;
+        Stamp[TermIdx] = Epoch;
+        Affected.push_back(TermIdx);
+      }
+    }
+  }
+
+  double sumAffected() const {
+    double Sum = 0.0;
+    for (uint32_t TermIdx : Affected)
+      Sum += evaluateTerm(C, Model, T.Terms[TermIdx], Chosen);
+    return Sum;
+  }
+
+  void flip(const std::vector<uint32_t> &Flips) {
+    for (uint32_t P : Flips)
+      Chosen[P] = !Chosen[P];
+  }
+};
+
+static void buildMove(CandidatePairs &C, ILPModel &Model, ObjectiveTerms &T,
+                      const std::vector<bool> &Chosen, uint32_t PackIdx,
+                      std::vector<uint32_t> &Flips) {
+  Flips.clear();
+  Flips.push_back(PackIdx);
+  if (Chosen[PackIdx])
+    return;
+  // A lane that cannot be extracted is only met once its users are packed,
+  // which no single flip reaches: take the first live consumer pack of each
+  // uncovered user along with PackIdx.
+  if (activatePack(C, Model, T, PackIdx)) {
+    for (uint32_t Idx : T.PackToRequirements[PackIdx]) {
+      const LaneRequirement &R = T.Requirements[Idx];
+      if (R.Owner != PackIdx)
+        continue;
+      for (const auto &UserEntry : C.LaneUses[PackIdx][R.Lane].UserToVectorUses) {
+        const std::vector<uint32_t> &Consumers = UserEntry.second;
+        if (llvm::any_of(Consumers, [&](uint32_t Q) {
+              return Chosen[Q] || llvm::is_contained(Flips, Q);
+            }))
+          continue;
+        for (uint32_t Q : Consumers) {
+          if (T.Live[Q] && llvm::none_of(Flips, [&](uint32_t F) {
+                return llvm::is_contained(T.Exclusions[F], Q);
+              })) {
+            Flips.push_back(Q);
+            break;
+          }
+        }
+      }
+    }
+  }
+  // The user map is unordered; keep the move itself deterministic.
+  std::sort(Flips.begin() + 1, Flips.end());
+  // Repair: drop every selected pack that cannot coexist with a taken one.
+  const size_t NumTaken = Flips.size();
+  for (size_t I = 0; I < NumTaken; ++I) {
+    for (uint32_t Other : T.Exclusions[Flips[I]]) {
+      if (Chosen[Other])
+        Flips.push_back(Other);
+    }
+  }
+  std::sort(Flips.begin() + NumTaken, Flips.end());
+  Flips.erase(std::unique(Flips.begin() + NumTaken, Flips.end()), Flips.end());
+}
+
+// Members of an interleaved group only earn the group discount together,
+// which no single flip reaches: this move takes every unselected member of
+// Group at once, with the same repair. It is skipped if two of the new
+// members exclude each other.
+static bool buildGroupMove(const ObjectiveTerms &T,
+                           const std::vector<bool> &Chosen,
+                           const ObjectiveTerm &Group,
+                           std::vector<uint32_t> &Flips) {
+  Flips.clear();
+  if (Group.Kind != ObjectiveTerm::InterleaveGroup)
+    return false;
+  for (uint32_t P : Group.Scope) {
+    if (!Chosen[P])
+      Flips.push_back(P);
+  }
+  if (Flips.size() < 2)
+    return false;
+  const size_t NumTaken = Flips.size();
+  for (size_t I = 0; I < NumTaken; ++I) {
+    for (uint32_t Other : T.Exclusions[Flips[I]]) {
+      if (!Chosen[Other]) {
+        if (llvm::is_contained(Group.Scope, Other))
+          return false;
+        continue;
+      }
+      Flips.push_back(Other);
+    }
+  }
+  std::sort(Flips.begin() + NumTaken, Flips.end());
+  Flips.erase(std::unique(Flips.begin() + NumTaken, Flips.end()), Flips.end());
+  return true;
+}
+
+// An inactive pack without savings of its own, whose lanes neither overlap
+// nor feed nor read a selected pack, can only raise the objective when it is
+// selected alone. It is not scored, and its use maps are not built, until a
+// neighbour is selected.
+static bool isDecisionPoint(const CandidatePairs &C, const ILPModel &Model,
+                            const ObjectiveTerms &T,
+                            const std::vector<bool> &Chosen, uint32_t P) {
+  if (T.Active[P] || Chosen[P] || isExcluded(T, Chosen, P))
+    return true;
+  if (P < Model.VecSavings.size() && Model.VecSavings[P] < 0.0)
+    return true;
+  auto inSelectedPack = [&](const Value *V) {
+    auto *I = dyn_cast<Instruction>(V);
+    if (!I)
+      return false;
+    auto It = C.InstToCandidates.find(I);
+    return It != C.InstToCandidates.end() &&
+           llvm::any_of(It->second,
+                        [&](const CandidateId &Id) { return Chosen[Id.Index]; });
+  };
+  for (const Instruction *I : C.Packs[P]) {
+    if (llvm::any_of(I->operands(),
+                     [&](const Use &Op) { return inSelectedPack(Op.get()); }) ||
+        llvm::any_of(I->users(), inSelectedPack))
+      return true;
+  }
+  return false;
+}
+
+} // namespace
+
+bool improveByLocalSearch(CandidatePairs &C, ILPModel &Model,
+                          ObjectiveTerms &T, const std::vector<bool> &Start,
+                          std::vector<bool> &Best, double &BestObjective,
+                          WorkBudget &Budget) {
+  const uint32_t N = static_cast<uint32_t>(C.Packs.size());
+  if (N == 0 || Start.size() < N)
+    return false;
+
+  const double Eps = 1e-9;
+  const uint64_t Tenure = std::min<uint64_t>(N > 1 ? N - 1 : 1, 5 + N / 8);
+  const uint64_t MaxStale = 2 * static_cast<uint64_t>(N) + 32;
+
+  FlipEvaluator Eval(C, Model, T, Start);
+  double Cur = 0.0;
+  for (const ObjectiveTerm &Term : T.Terms)
+    Cur += evaluateTerm(C, Model, Term, Start);
+
+  double LocalBest = std::min(Cur, BestObjective);
+  bool Improved = false;
+  std::vector<uint64_t> TabuUntil(N, 0);
+  std::vector<uint32_t> Flips;
+  std::vector<uint32_t> BestFlips;
+
+  uint64_t Stale = 0;
+  for (uint64_t Iter = 1; Stale < MaxStale; ++Iter) {
+    double BestDelta = std::numeric_limits<double>::infinity();
+    bool Found = false;
+    auto consider = [&](uint32_t P) {
+      double D = Eval.delta(Flips);
+      Budget.charge(2 * Eval.lastAffected() + 1);
+      if (!Eval.feasible(Flips))
+        return;
+      bool Tabu = TabuUntil[P] > Iter;
+      // Aspiration: a tabu move is allowed if it beats the best seen so far.
+      if (Tabu && !(Cur + D < LocalBest - Eps))
+        return;
+      if (!Found || D < BestDelta - Eps) {
+        Found = true;
+        BestDelta = D;
+        BestFlips = Flips;
+      }
+    };
+    for (uint32_t P = 0; P < N && !Budget.exhausted(); ++P) {
+      if (!T.Live[P])
+        continue;
+      if (isDecisionPoint(C, Model, T, Eval.state(), P)) {
+        buildMove(C, Model, T, Eval.state(), P, Flips);
+        consider(P);
+      }
+      if (Eval.state()[P])
+        continue;
+      // Each group is tried once, from its first unselected member. Scoring
+      // a move may activate packs and re-split the terms, so the groups are
+      // copied out first.
+      std::vector<ObjectiveTerm> Groups;
+      for (uint32_t TermIdx : T.PackToTerms[P]) {
+        if (T.Terms[TermIdx].Kind == ObjectiveTerm::InterleaveGroup)
+          Groups.push_back(T.Terms[TermIdx]);
+      }
+      for (const ObjectiveTerm &Group : Groups) {
+        if (buildGroupMove(T, Eval.state(), Group, Flips) &&
+            Flips.front() == P)
+          consider(P);
+      }
+    }
+
+    if (!Found || Budget.exhausted())
+      break;
+
+    Eval.apply(BestFlips);
+    Cur += BestDelta;
+    for (uint32_t P : BestFlips)
+      TabuUntil[P] = Iter + Tenure;
+
+    if (Cur < LocalBest - Eps) {
+      LocalBest = Cur;
+      Stale = 0;
+      Best = Eval.state();
+      Improved = true;
+    } else {
+      ++Stale;
+    }
+  }
+
+  if (Improved)
+    BestObjective = LocalBest;
+  return Improved;
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <vector>
+#include "ObjectiveTerms.hpp"
+#include "WorkBudget.hpp"
+
+// Tabu search over single-pack flips, seeded with Start. Selecting a pack
+// repairs feasibility by deselecting every chosen pack it excludes, and also
+// takes a consumer pack for each user of a lane it cannot extract; moves that
+// still leave a lane requirement unmet are skipped. Every move is scored from the
+// objective terms that mention the flipped packs.
+// Each move charges one budget unit per term it re-evaluates. Packs are
+// activated when a move that selects them is first scored. Returns true and
+// updates Best/BestObjective when a better selection is found.
+bool improveByLocalSearch(CandidatePairs &C, ILPModel &Model,
+                          ObjectiveTerms &T, const std::vector<bool> &Start,
+                          std::vector<bool> &Best, double &BestObjective,
+                          WorkBudget &Budget);
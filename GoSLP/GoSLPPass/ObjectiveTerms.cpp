@@ -0,0 +1,424 @@
+#include "ObjectiveTerms.hpp"
+
+#include "llvm/ADT/STLExtras.h"
+
+#include <algorithm>
+#include <tuple>
+
+using namespace llvm;
+
+namespace {
+
+static bool anyChosen(const std::vector<uint32_t> &Packs,
+                      const std::vector<bool> &Chosen) {
+  for (uint32_t P : Packs) {
+    if (P < Chosen.size() && Chosen[P])
+      return true;
+  }
+  return false;
+}
+
+static void sortUnique(std::vector<uint32_t> &V) {
+  llvm::sort(V);
+  V.erase(std::unique(V.begin(), V.end()), V.end());
+}
+
+// True if some scalar user of the lane is left without a selected pack to
+// consume it, so the lane has to be extracted.
+static bool needsExtract(const LaneUseInfo &Info,
+                         const std::vector<bool> &Chosen) {
+  if (Info.HasOutsideUse)
+    return true;
+  for (const auto &UserEntry : Info.UserToVectorUses) {
+    if (!anyChosen(UserEntry.second, Chosen))
+      return true;
+  }
+  return false;
+}
+
+// True if a candidate other than P, and still live, contains I.
+static bool inLiveCandidate(const CandidatePairs &C, const Value *V,
+                            uint32_t P, const std::vector<bool> &Live) {
+  auto *I = dyn_cast<Instruction>(V);
+  if (!I)
+    return false;
+  auto It = C.InstToCandidates.find(I);
+  if (It == C.InstToCandidates.end())
+    return false;
+  for (const CandidateId &Id : It->second) {
+    if (Id.Index != P && Live[Id.Index])
+      return true;
+  }
+  return false;
+}
+
+} // namespace
+
+std::vector<bool> presolveLivePacks(const CandidatePairs &C,
+                                    const ILPModel &Model) {
+  const uint32_t N = static_cast<uint32_t>(C.Packs.size());
+  std::vector<bool> Live(N, true);
+
+  // Members of an interleaved group may only pay off together.
+  std::vector<bool> InGroup(N, false);
+  for (size_t G = 0; G < Model.InterleaveGroups.size(); ++G) {
+    if (Model.InterleaveDiscount[G] >= 0.0)
+      continue;
+    for (uint32_t P : Model.InterleaveGroups[G])
+      InGroup[P] = true;
+  }
+
+  // A pack without vector savings can only pay off by feeding, or being fed
+  // by, another selected pack. Once no live candidate touches its lanes'
+  // operands or users, selecting it never lowers the objective.
+  bool Changed = true;
+  while (Changed) {
+    Changed = false;
+    for (uint32_t P = 0; P < N; ++P) {
+      if (!Live[P] || C.Packs[P].empty())
+        continue;
+      if (P < Model.VecSavings.size() && Model.VecSavings[P] < 0.0)
+        continue;
+      if (InGroup[P])
+        continue;
+
+      bool Connected = false;
+      for (const Instruction *I : C.Packs[P]) {
+        for (const Use &Op : I->operands())
+          Connected |= inLiveCandidate(C, Op.get(), P, Live);
+        for (const User *U : I->users())
+          Connected |= inLiveCandidate(C, U, P, Live);
+        if (Connected)
+          break;
+      }
+      if (!Connected) {
+        Live[P] = false;
+        Changed = true;
+      }
+    }
+  }
+  return Live;
+}
+
+// Prices the non-vector packs the use maps have uncovered since the last
+// call, along with their cheaper assemblies.
+static void priceNonVecPacks(const CandidatePairs &C, ILPModel &Model) {
+  for (size_t NV = Model.NonVecPackCost.size(); NV < C.NonVecPacks.size();
+       ++NV) {
+    Model.NonVecPackCost.push_back(
+        Model.NonVecCostFn ? Model.NonVecCostFn(C.NonVecPacks[NV]) : 0.0);
+    auto AsmIt = C.NonVecAssemblies.find(static_cast<uint32_t>(NV));
+    if (AsmIt == C.NonVecAssemblies.end() || !Model.AssemblyCostFn)
+      continue;
+    auto &Costs = Model.NonVecAssemblyCost[static_cast<uint32_t>(NV)];
+    for (const OperandAssembly &A : AsmIt->second)
+      Costs.push_back(Model.AssemblyCostFn(C.NonVecPacks[NV], A));
+  }
+}
+
+// Rebuilds Terms and PackToTerms from the use maps materialized so far.
+static void splitObjective(const CandidatePairs &C, const ILPModel &Model,
+                           ObjectiveTerms &T) {
+  const uint32_t N = static_cast<uint32_t>(C.Packs.size());
+  T.Terms.clear();
+  T.Requirements.clear();
+
+  auto addTerm = [&](ObjectiveTerm::TermKind Kind, uint32_t Owner,
+                     uint32_t Lane, std::vector<uint32_t> Scope) {
+    sortUnique(Scope);
+    if (Scope.empty())
+      return;
+    ObjectiveTerm Term;
+    Term.Kind = Kind;
+    Term.Owner = Owner;
+    Term.Lane = Lane;
+    Term.Scope = std::move(Scope);
+    T.Terms.push_back(std::move(Term));
+  };
+
+  for (uint32_t P = 0; P < N; ++P) {
+    // A live consumer uses this pack's lanes and so keeps it live in the
+    // presolve; a presolved pack has no live consumer to charge.
+    if (!T.Live[P])
+      continue;
+
+    // An unselected producer whose consumer is selected has its lanes
+    // gathered into a vector.
+    auto It = C.VecVecUses.find(P);
+    if (It != C.VecVecUses.end() && P < Model.PackCost.size() &&
+        Model.PackCost[P] != 0.0) {
+      std::vector<uint32_t> Scope = It->second;
+      Scope.push_back(P);
+      addTerm(ObjectiveTerm::VecPackCost, P, 0, std::move(Scope));
+    }
+
+    if (P < Model.VecSavings.size() && Model.VecSavings[P] != 0.0)
+      addTerm(ObjectiveTerm::VecSaving, P, 0, {P});
+
+    // Lane uses are only complete once the pack is active; an inactive
+    // pack is unselected, so its lanes are never extracted.
+    if (!T.Active[P] || P >= C.LaneUses.size() ||
+        P >= Model.LaneExtractCost.size() ||
+        P >= Model.UnextractableLanes.size())
+      continue;
+    const auto &Lanes = C.LaneUses[P];
+    const auto &LaneCosts = Model.LaneExtractCost[P];
+    const auto &Unextractable = Model.UnextractableLanes[P];
+    for (uint32_t Lane = 0; Lane < Lanes.size() && Lane < LaneCosts.size();
+         ++Lane) {
+      const bool Required = Lane < Unextractable.size() && Unextractable[Lane];
+      if (LaneCosts[Lane] == 0.0 && !Required)
+        continue;
+      std::vector<uint32_t> Scope{P};
+      if (!Lanes[Lane].HasOutsideUse) {
+        for (const auto &UserEntry : Lanes[Lane].UserToVectorUses)
+          Scope.insert(Scope.end(), UserEntry.second.begin(),
+                       UserEntry.second.end());
+      }
+      if (!Required) {
+        addTerm(ObjectiveTerm::LaneExtract, P, Lane, std::move(Scope));
+        continue;
+      }
+      sortUnique(Scope);
+      T.Requirements.push_back({P, Lane, std::move(Scope)});
+    }
+  }
+
+  for (const auto &Entry : C.NonVecVecUses) {
+    uint32_t NonVecIdx = Entry.first;
+    if (NonVecIdx >= Model.NonVecPackCost.size() ||
+        Model.NonVecPackCost[NonVecIdx] == 0.0)
+      continue;
+    // The term also reads the producers any assembly would build from.
+    std::vector<uint32_t> Scope = Entry.second;
+    auto AsmIt = C.NonVecAssemblies.find(NonVecIdx);
+    if (AsmIt != C.NonVecAssemblies.end()) {
+      for (const OperandAssembly &A : AsmIt->second)
+        Scope.insert(Scope.end(), A.Sources.begin(), A.Sources.end());
+    }
+    addTerm(ObjectiveTerm::NonVecPackCost, NonVecIdx, 0, std::move(Scope));
+  }
+
+  for (uint32_t G = 0; G < Model.InterleaveGroups.size(); ++G) {
+    const auto &Members = Model.InterleaveGroups[G];
+    if (Model.InterleaveDiscount[G] == 0.0 ||
+        !llvm::all_of(Members, [&](uint32_t P) { return T.Live[P]; }))
+      continue;
+    addTerm(ObjectiveTerm::InterleaveGroup, G, 0, Members);
+  }
+
+  // Hash-map iteration order is not stable; keep term order deterministic.
+  std::stable_sort(T.Terms.begin(), T.Terms.end(),
+                   [](const ObjectiveTerm &A, const ObjectiveTerm &B) {
+                     return std::make_tuple(A.Scope.front(), A.Kind, A.Owner,
+                                            A.Lane) <
+                            std::make_tuple(B.Scope.front(), B.Kind, B.Owner,
+                                            B.Lane);
+                   });
+
+  T.PackToTerms.assign(N, {});
+  for (uint32_t Idx = 0; Idx < T.Terms.size(); ++Idx) {
+    for (uint32_t P : T.Terms[Idx].Scope) {
+      if (P < N)
+        T.PackToTerms[P].push_back(Idx);
+    }
+  }
+  T.PackToRequirements.assign(N, {});
+  for (uint32_t Idx = 0; Idx < T.Requirements.size(); ++Idx) {
+    for (uint32_t P : T.Requirements[Idx].Scope) {
+      if (P < N)
+        T.PackToRequirements[P].push_back(Idx);
+    }
+  }
+}
+
+// False if a lane of P that cannot be extracted has a user no live pack
+// consumes, so no selection with P meets its requirements. Needs P's use
+// maps.
+static bool canMeetRequirements(const CandidatePairs &C, const ILPModel &Model,
+                                const ObjectiveTerms &T, uint32_t P) {
+  if (P >= Model.UnextractableLanes.size() || P >= C.LaneUses.size())
+    return true;
+  const auto &Unextractable = Model.UnextractableLanes[P];
+  const auto &Lanes = C.LaneUses[P];
+  for (uint32_t Lane = 0; Lane < Lanes.size() && Lane < Unextractable.size();
+       ++Lane) {
+    if (!Unextractable[Lane])
+      continue;
+    if (Lanes[Lane].HasOutsideUse)
+      return false;
+    for (const auto &UserEntry : Lanes[Lane].UserToVectorUses) {
+      if (llvm::none_of(UserEntry.second,
+                        [&](uint32_t Q) { return T.Live[Q]; }))
+        return false;
+    }
+  }
+  return true;
+}
+
+ObjectiveTerms buildObjectiveTerms(CandidatePairs &C, ILPModel &Model,
+                                   std::vector<bool> Live) {
+  ObjectiveTerms T;
+  const uint32_t N = static_cast<uint32_t>(C.Packs.size());
+  T.Live = std::move(Live);
+  T.Live.resize(N, false);
+  T.Active.assign(N, false);
+  priceNonVecPacks(C, Model);
+  splitObjective(C, Model, T);
+
+  T.Exclusions.assign(N, {});
+  for (const auto &Entry : C.InstToCandidates) {
+    const auto &Ids = Entry.second;
+    for (size_t A = 0; A < Ids.size(); ++A) {
+      for (size_t B = A + 1; B < Ids.size(); ++B) {
+        if (Ids[A].Index == Ids[B].Index || !T.Live[Ids[A].Index] ||
+            !T.Live[Ids[B].Index])
+          continue;
+        T.Exclusions[Ids[A].Index].push_back(Ids[B].Index);
+        T.Exclusions[Ids[B].Index].push_back(Ids[A].Index);
+      }
+    }
+  }
+  for (uint32_t P = 0; P < N && P < C.CircularConflicts.size(); ++P) {
+    if (!T.Live[P])
+      continue;
+    for (uint32_t Other : C.CircularConflicts[P]) {
+      if (T.Live[Other])
+        T.Exclusions[P].push_back(Other);
+    }
+  }
+  for (auto &Ex : T.Exclusions)
+    sortUnique(Ex);
+
+  return T;
+}
+
+bool activatePack(CandidatePairs &C, ILPModel &Model, ObjectiveTerms &T,
+                  uint32_t P) {
+  if (P >= T.Live.size() || !T.Live[P])
+    return false;
+  if (T.Active[P])
+    return true;
+  T.Active[P] = true;
+  ensurePackOperands(C, P);
+  ensurePackUses(C, P);
+  if (!canMeetRequirements(C, Model, T, P))
+    T.Live[P] = false;
+  priceNonVecPacks(C, Model);
+  splitObjective(C, Model, T);
+  return T.Live[P];
+}
+
+void activateLivePacks(CandidatePairs &C, ILPModel &Model, ObjectiveTerms &T) {
+  bool Changed = false;
+  for (uint32_t P = 0; P < T.Live.size(); ++P) {
+    if (!T.Live[P] || T.Active[P])
+      continue;
+    T.Active[P] = true;
+    ensurePackOperands(C, P);
+    ensurePackUses(C, P);
+    Changed = true;
+  }
+  if (!Changed)
+    return;
+  // Dropping a pack can leave another without a live consumer for a lane.
+  for (bool Dropped = true; Dropped;) {
+    Dropped = false;
+    for (uint32_t P = 0; P < T.Live.size(); ++P) {
+      if (T.Live[P] && !canMeetRequirements(C, Model, T, P)) {
+        T.Live[P] = false;
+        Dropped = true;
+      }
+    }
+  }
+  priceNonVecPacks(C, Model);
+  splitObjective(C, Model, T);
+}
+
+double evaluateTerm(const CandidatePairs &C, const ILPModel &Model,
+                    const ObjectiveTerm &T, const std::vector<bool> &Chosen) {
+  switch (T.Kind) {
+  case ObjectiveTerm::VecSaving:
+    return Chosen[T.Owner] ? Model.VecSavings[T.Owner] : 0.0;
+
+  case ObjectiveTerm::VecPackCost: {
+    if (Chosen[T.Owner])
+      return 0.0;
+    auto It = C.VecVecUses.find(T.Owner);
+    if (It == C.VecVecUses.end() || !anyChosen(It->second, Chosen))
+      return 0.0;
+    return Model.PackCost[T.Owner];
+  }
+
+  case ObjectiveTerm::NonVecPackCost: {
+    auto It = C.NonVecVecUses.find(T.Owner);
+    if (It == C.NonVecVecUses.end() || !anyChosen(It->second, Chosen))
+      return 0.0;
+    double Cost = Model.NonVecPackCost[T.Owner];
+    auto AsmIt = C.NonVecAssemblies.find(T.Owner);
+    auto CostIt = Model.NonVecAssemblyCost.find(T.Owner);
+    if (AsmIt == C.NonVecAssemblies.end() ||
+        CostIt == Model.NonVecAssemblyCost.end())
+      return Cost;
+    for (size_t A = 0; A < AsmIt->second.size() && A < CostIt->second.size();
+         ++A) {
+      if (llvm::all_of(AsmIt->second[A].Sources,
+                       [&](uint32_t P) { return P < Chosen.size() && Chosen[P]; }))
+        Cost = std::min(Cost, CostIt->second[A]);
+    }
+    return Cost;
+  }
+
+  case ObjectiveTerm::LaneExtract:
+    if (!Chosen[T.Owner] || !needsExtract(C.LaneUses[T.Owner][T.Lane], Chosen))
+      return 0.0;
+    return Model.LaneExtractCost[T.Owner][T.Lane];
+
+  case ObjectiveTerm::InterleaveGroup:
+    return llvm::all_of(T.Scope, [&](uint32_t P) { return Chosen[P]; })
+               ? Model.InterleaveDiscount[T.Owner]
+               : 0.0;
+  }
+  return 0.0;
+}
+
+double evaluateObjective(const CandidatePairs &C, const ILPModel &Model,
+                         const ObjectiveTerms &T,
+                         const std::vector<bool> &Chosen) {
+  double Obj = 0.0;
+  for (const ObjectiveTerm &Term : T.Terms)
+    Obj += evaluateTerm(C, Model, Term, Chosen);
+  return Obj;
+}
+
+bool isExcluded(const ObjectiveTerms &T, const std::vector<bool> &Chosen,
+                uint32_t PackIdx) {
+  if (PackIdx >= T.Exclusions.size())
+    return false;
+  return anyChosen(T.Exclusions[PackIdx], Chosen);
+}
+
+bool meetsRequirement(const CandidatePairs &C, const LaneRequirement &R,
+                      const std::vector<bool> &Chosen) {
+  return !Chosen[R.Owner] || !needsExtract(C.LaneUses[R.Owner][R.Lane], Chosen);
+}
+
+bool meetsRequirements(const CandidatePairs &C, const ObjectiveTerms &T,
+                       const std::vector<bool> &Chosen) {
+  return llvm::all_of(T.Requirements, [&](const LaneRequirement &R) {
+    return meetsRequirement(C, R, Chosen);
+  });
+}
+
+void dropUnmetRequirements(const CandidatePairs &C, const ObjectiveTerms &T,
+                           std::vector<bool> &Chosen) {
+  for (bool Dropped = true; Dropped;) {
+    Dropped = false;
+    for (const LaneRequirement &R : T.Requirements) {
+      if (!meetsRequirement(C, R, Chosen)) {
+        Chosen[R.Owner] = false;
+        Dropped = true;
+      }
+    }
+  }
+}
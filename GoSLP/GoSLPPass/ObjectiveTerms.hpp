@@ -0,0 +1,89 @@
+#pragma once
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "CandidatePacks.hpp"
+#include "ILP.hpp"
+
+// The ILP objective split into additive terms. Each term only depends on the
+// selection state of the packs in its Scope, which lets solvers evaluate the
+// effect of flipping a pack by re-evaluating only the terms that mention it.
+struct ObjectiveTerm {
+  enum TermKind {
+    VecSaving,
+    VecPackCost,
+    NonVecPackCost,
+    LaneExtract,
+    InterleaveGroup
+  };
+
+  TermKind Kind;
+  // Pack index, CandidatePairs::NonVecPacks index for NonVecPackCost, or
+  // ILPModel::InterleaveGroups index for InterleaveGroup.
+  uint32_t Owner = 0;
+  uint32_t Lane = 0;
+  // Sorted, unique pack indices this term reads.
+  std::vector<uint32_t> Scope;
+};
+
+// A lane of pack Owner that cannot be extracted (ILPModel::
+// UnextractableLanes). Owner may only be selected if each scalar user of the
+// lane is in a selected pack that consumes it.
+struct LaneRequirement {
+  uint32_t Owner = 0;
+  uint32_t Lane = 0;
+  // Sorted, unique pack indices the requirement reads.
+  std::vector<uint32_t> Scope;
+};
+
+struct ObjectiveTerms {
+  std::vector<ObjectiveTerm> Terms;
+  // Pack -> indices into Terms whose scope contains the pack.
+  std::vector<std::vector<uint32_t>> PackToTerms;
+  // Pairs of packs that must not be selected together (lane overlap or
+  // circular dependency).
+  std::vector<std::vector<uint32_t>> Exclusions;
+  // Requirements of the active packs, and pack -> indices into Requirements
+  // whose scope contains the pack.
+  std::vector<LaneRequirement> Requirements;
+  std::vector<std::vector<uint32_t>> PackToRequirements;
+  // Packs kept by the presolve, less those found on activation to have a
+  // requirement no selection can meet; the rest are fixed to unselected.
+  std::vector<bool> Live;
+  // Live packs whose use maps are built and whose terms are in Terms; see
+  // activatePack().
+  std::vector<bool> Active;
+};
+
+// Packs that can never lower the objective (no vector savings and no live
+// candidate among their operands or users) are marked dead.
+std::vector<bool> presolveLivePacks(const CandidatePairs &C,
+                                    const ILPModel &Model);
+// Splits the part of the objective that is known before any use map is
+// built: vector savings, interleaved groups and the exclusions. The terms
+// that read the use maps join as packs are activated.
+ObjectiveTerms buildObjectiveTerms(CandidatePairs &C, ILPModel &Model,
+                                   std::vector<bool> Live);
+// Materializes the use maps of live pack P, prices the non-vector packs they
+// uncover through Model.NonVecCostFn, and re-splits the objective. Solvers
+// call this when P first becomes a candidate for selection. Selections of
+// active packs keep their objective value, but term indices change. Returns
+// false if P is not live, or no longer is because a lane requirement of P can
+// never be met.
+bool activatePack(CandidatePairs &C, ILPModel &Model, ObjectiveTerms &T,
+                  uint32_t P);
+void activateLivePacks(CandidatePairs &C, ILPModel &Model, ObjectiveTerms &T);
+double evaluateObjective(const CandidatePairs &C, const ILPModel &Model,
+                         const ObjectiveTerms &T,
+                         const std::vector<bool> &Chosen);
+double evaluateTerm(const CandidatePairs &C, const ILPModel &Model,
+                    const ObjectiveTerm &T, const std::vector<bool> &Chosen);
+bool isExcluded(const ObjectiveTerms &T, const std::vector<bool> &Chosen,
+                uint32_t PackIdx);
+bool meetsRequirement(const CandidatePairs &C, const LaneRequirement &R,
+                      const std::vector<bool> &Chosen);
+bool meetsRequirements(const CandidatePairs &C, const ObjectiveTerms &T,
+                       const std::vector<bool> &Chosen);
+// Deselects packs until every requirement of a selected pack is met.
+void dropUnmetRequirements(const CandidatePairs &C, const ObjectiveTerms &T,
+                           std::vector<bool> &Chosen);
@@ -69,7 +69,7 @@ PermsList generatePerms(unsigned Width) {
 }
 
 Perms choosePermutationsDP(const VecGraph &G, const std::vector<bool> &Chosen,
-                           ShuffleCost &SC) {
+                           ShuffleCost &SC, WorkBudget &Budget) {
   Perms Result;
   const unsigned N = G.items.size();
   if (N == 0 || Chosen.size() < N)
@@ -139,8 +139,12 @@ Perms choosePermutationsDP(const VecGraph &G, const std::vector<bool> &Chosen,
     for (int D : G.items[V].Defs) {
       if (D < 0 || static_cast<unsigned>(D) >= N || !Chosen[D])
         continue;
-      for (const auto &P : Forward[D])
-        appendUnique(Forward[V], P);
+      // Producers of another width (odd-width packs, operands assembled
+      // from parts of packs) have no permutation to pass on.
+      for (const auto &P : Forward[D]) {
+        if (P.size() == G.items[V].pack.size())
+          appendUnique(Forward[V], P);
+      }
     }
 
     if (Forward[V].empty())
@@ -160,8 +164,10 @@ Perms choosePermutationsDP(const VecGraph &G, const std::vector<bool> &Chosen,
     for (int U : G.items[V].Uses) {
       if (U < 0 || static_cast<unsigned>(U) >= N || !Chosen[U])
         continue;
-      for (const auto &P : Backward[U])
-        appendUnique(Backward[V], P);
+      for (const auto &P : Backward[U]) {
+        if (P.size() == G.items[V].pack.size())
+          appendUnique(Backward[V], P);
+      }
     }
 
     if (Backward[V].empty())
@@ -197,10 +203,24 @@ Perms choosePermutationsDP(const VecGraph &G, const std::vector<bool> &Chosen,
     if (!Chosen[V])
       continue;
 
-    const auto &PermsV = Candidates[V];
-    if (PermsV.empty())
+    if (Candidates[V].empty())
       continue;
 
+    uint64_t Cells = 0;
+    for (int S : G.items[V].Uses) {
+      if (S >= 0 && static_cast<unsigned>(S) < N && Chosen[S])
+        Cells += Candidates[S].size();
+    }
+    if (!Budget.charge(Cells * Candidates[V].size())) {
+      Permutation Identity(G.items[V].pack.size());
+      for (unsigned L = 0; L < Identity.size(); ++L)
+        Identity[L] = L;
+      Candidates[V].assign(1, Identity);
+      DP[V].assign(1, InstructionCost(0));
+    }
+
+    const auto &PermsV = Candidates[V];
+
     for (size_t PI = 0; PI < PermsV.size(); ++PI) {
       Node VPerm = G.items[V];
       VPerm.pack = applyPermutation(G.items[V].pack, PermsV[PI]);
@@ -1,6 +1,7 @@
 #pragma once
 #include "VecGraph.hpp"
 #include "ShuffleCost.hpp"
+#include "WorkBudget.hpp"
 #include <algorithm>
 #include <limits>
 #include <unordered_map>
@@ -16,5 +17,7 @@ using CostVec = std::vector<InstructionCost>;
 using Perms = std::unordered_map<int, Permutation>; // key = PackIdx(int), value = chosen lane ordering
 
 PermsList generatePerms(unsigned width);
+// Charges one budget unit per DP cell (permutation pair scored on an edge);
+// nodes reached after the budget is exhausted keep their identity order.
 Perms choosePermutationsDP(const VecGraph &G, const std::vector<bool> &Chosen,
-                           ShuffleCost &SC);
+                           ShuffleCost &SC, WorkBudget &Budget);
@@ -2,23 +2,49 @@
 #include "CandidatePacks.hpp"
 
 #include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/IVDescriptors.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/PatternMatch.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/TargetParser/Triple.h"
 
+#include <map>
+
 namespace {
 
+using namespace PatternMatch;
+
+// FMin/FMax stand for minnum/maxnum here: the reduction intrinsics share
+// their NaN handling, so the lanes may be combined in any order.
 struct ReductionCandidate {
   Instruction *Root = nullptr;
-  unsigned Opcode = 0;
+  RecurKind Kind = RecurKind::None;
   Type *Ty = nullptr;
   FastMathFlags FMF;
   bool IsFloating = false;
   SmallVector<Value *, 16> Terms;
   SmallVector<Instruction *, 16> Nodes;
+
+  // Terms[0, NumProducts) are products taken apart into two streams: term
+  // I is DotLHS[I] * DotRHS[I], each stream first widened to Ty by its cast
+  // opcode when that is nonzero.
+  unsigned NumProducts = 0;
+  SmallVector<Value *, 16> DotLHS;
+  SmallVector<Value *, 16> DotRHS;
+  unsigned DotLHSExt = 0;
+  unsigned DotRHSExt = 0;
+  FastMathFlags DotFMF;
+};
+
+// A run of terms that becomes one vector: Len lanes from Terms[Begin].
+// Runs below NumProducts are built from the dot streams.
+struct ReductionChunk {
+  unsigned Begin = 0;
+  unsigned Len = 0;
 };
 
 static double toDouble(InstructionCost C) {
@@ -27,18 +53,133 @@ static double toDouble(InstructionCost C) {
   return static_cast<double>(C.getValue());
 }
 
-static bool isReductionOpcode(unsigned Opcode) {
-  return Opcode == Instruction::Add || Opcode == Instruction::FAdd;
+// The reduction step V performs, if any, and its two operands. Integer
+// min/max are matched both as intrinsics and as icmp+select idioms; FP
+// min/max only as minnum/maxnum, since an fcmp+select differs from them on
+// NaNs and signed zeros.
+static RecurKind matchReductionNode(Value *V, Value *&LHS, Value *&RHS) {
+  if (auto *BO = dyn_cast<BinaryOperator>(V)) {
+    LHS = BO->getOperand(0);
+    RHS = BO->getOperand(1);
+    switch (BO->getOpcode()) {
+    case Instruction::Add:
+      return RecurKind::Add;
+    case Instruction::Mul:
+      return RecurKind::Mul;
+    case Instruction::And:
+      return RecurKind::And;
+    case Instruction::Or:
+      return RecurKind::Or;
+    case Instruction::Xor:
+      return RecurKind::Xor;
+    case Instruction::FAdd:
+      return BO->hasAllowReassoc() ? RecurKind::FAdd : RecurKind::None;
+    case Instruction::FMul:
+      return BO->hasAllowReassoc() ? RecurKind::FMul : RecurKind::None;
+    default:
+      return RecurKind::None;
+    }
+  }
+
+  if (match(V, m_SMin(m_Value(LHS), m_Value(RHS))))
+    return RecurKind::SMin;
+  if (match(V, m_SMax(m_Value(LHS), m_Value(RHS))))
+    return RecurKind::SMax;
+  if (match(V, m_UMin(m_Value(LHS), m_Value(RHS))))
+    return RecurKind::UMin;
+  if (match(V, m_UMax(m_Value(LHS), m_Value(RHS))))
+    return RecurKind::UMax;
+  if (match(V, m_Intrinsic<Intrinsic::minnum>(m_Value(LHS), m_Value(RHS))))
+    return RecurKind::FMin;
+  if (match(V, m_Intrinsic<Intrinsic::maxnum>(m_Value(LHS), m_Value(RHS))))
+    return RecurKind::FMax;
+  return RecurKind::None;
+}
+
+static Intrinsic::ID minMaxIntrinsic(RecurKind Kind) {
+  switch (Kind) {
+  case RecurKind::SMin:
+    return Intrinsic::smin;
+  case RecurKind::SMax:
+    return Intrinsic::smax;
+  case RecurKind::UMin:
+    return Intrinsic::umin;
+  case RecurKind::UMax:
+    return Intrinsic::umax;
+  case RecurKind::FMin:
+    return Intrinsic::minnum;
+  case RecurKind::FMax:
+    return Intrinsic::maxnum;
+  default:
+    return Intrinsic::not_intrinsic;
+  }
+}
+
+// The binary opcode of an arithmetic or bitwise reduction.
+static unsigned reductionOpcode(RecurKind Kind) {
+  switch (Kind) {
+  case RecurKind::Add:
+    return Instruction::Add;
+  case RecurKind::Mul:
+    return Instruction::Mul;
+  case RecurKind::And:
+    return Instruction::And;
+  case RecurKind::Or:
+    return Instruction::Or;
+  case RecurKind::Xor:
+    return Instruction::Xor;
+  case RecurKind::FAdd:
+    return Instruction::FAdd;
+  case RecurKind::FMul:
+    return Instruction::FMul;
+  default:
+    return 0;
+  }
+}
+
+static const char *reductionName(RecurKind Kind) {
+  switch (Kind) {
+  case RecurKind::Add:
+    return "add";
+  case RecurKind::Mul:
+    return "mul";
+  case RecurKind::And:
+    return "and";
+  case RecurKind::Or:
+    return "or";
+  case RecurKind::Xor:
+    return "xor";
+  case RecurKind::FAdd:
+    return "fadd";
+  case RecurKind::FMul:
+    return "fmul";
+  case RecurKind::SMin:
+    return "smin";
+  case RecurKind::SMax:
+    return "smax";
+  case RecurKind::UMin:
+    return "umin";
+  case RecurKind::UMax:
+    return "umax";
+  case RecurKind::FMin:
+    return "fmin";
+  case RecurKind::FMax:
+    return "fmax";
+  default:
+    return "unknown";
+  }
 }
 
-static bool collectReductionTerms(Value *V, BasicBlock *BB, unsigned Opcode,
+static bool collectReductionTerms(Value *V, BasicBlock *BB, RecurKind Kind,
                                   Type *Ty,
                                   SmallPtrSetImpl<Instruction *> &Visited,
                                   SmallVectorImpl<Value *> &Terms,
                                   SmallVectorImpl<Instruction *> &Nodes) {
   auto *I = dyn_cast<Instruction>(V);
+  Value *LHS = nullptr;
+  Value *RHS = nullptr;
   if (!I || I->getParent() != BB || I->getType() != Ty ||
-      I->getOpcode() != Opcode) {
+      matchReductionNode(I, LHS, RHS) != Kind) {
     Terms.push_back(V);
     return true;
   }
@@ -49,21 +190,58 @@ static bool collectReductionTerms(Value *V, BasicBlock *BB, unsigned Opcode,
   }
 
   Nodes.push_back(I);
-  if (!collectReductionTerms(I->getOperand(0), BB, Opcode, Ty, Visited, Terms,
-                             Nodes))
+  if (!collectReductionTerms(LHS, BB, Kind, Ty, Visited, Terms, Nodes))
     return false;
-  if (!collectReductionTerms(I->getOperand(1), BB, Opcode, Ty, Visited, Terms,
-                             Nodes))
+  if (!collectReductionTerms(RHS, BB, Kind, Ty, Visited, Terms, Nodes))
     return false;
   return true;
 }
 
-static unsigned chooseReductionWidth(size_t Terms) {
-  if (Terms >= 4)
-    return 4;
-  if (Terms >= 2)
-    return 2;
-  return 0;
+// One step of the reduction: scalar, joining partial results, or lane-wise
+// on two vectors of terms.
+static Value *createReductionStep(IRBuilder<> &B, const ReductionCandidate &C,
+                                  Value *LHS, Value *RHS, const Twine &Name) {
+  Value *Step = nullptr;
+  if (unsigned Opcode = reductionOpcode(C.Kind))
+    Step = B.CreateBinOp(static_cast<Instruction::BinaryOps>(Opcode), LHS, RHS,
+                         Name);
+  else
+    Step = B.CreateBinaryIntrinsic(minMaxIntrinsic(C.Kind), LHS, RHS, nullptr,
+                                   Name);
+  if (C.IsFloating)
+    if (auto *I = dyn_cast<Instruction>(Step))
+      I->setFastMathFlags(C.FMF);
+  return Step;
+}
+
+// Joins the values pairwise, level by level, so the steps of one level are
+// independent (separate accumulators) and the chain is only log2 deep.
+static Value *combineBalanced(IRBuilder<> &B, const ReductionCandidate &C,
+                              SmallVector<Value *, 8> Vals, const Twine &Name) {
+  while (Vals.size() > 1) {
+    SmallVector<Value *, 8> Next;
+    for (unsigned I = 0; I + 1 < Vals.size(); I += 2)
+      Next.push_back(createReductionStep(B, C, Vals[I], Vals[I + 1], Name));
+    if (Vals.size() % 2)
+      Next.push_back(Vals.back());
+    Vals = std::move(Next);
+  }
+  return Vals.front();
+}
+
+// Lanes of Ty in one vector register (i1 flags count as bytes).
+static unsigned registerLanes(Type *Ty, TargetTransformInfo &TTI,
+                              const DataLayout &DL) {
+  uint64_t RegBits =
+      TTI.getRegisterBitWidth(TargetTransformInfo::RGK_FixedWidthVector)
+          .getFixedValue();
+  uint64_t ElemBits =
+      std::max<uint64_t>(8, DL.getTypeSizeInBits(Ty).getFixedValue());
+  return static_cast<unsigned>(RegBits / ElemBits);
+}
+
+static bool isWidenedDot(const ReductionCandidate &C) {
+  return C.NumProducts && (C.DotLHSExt || C.DotRHSExt);
 }
 
 static bool isAArch64Target(const Module &M) {
@@ -71,180 +249,518 @@ static bool isAArch64Target(const Module &M) {
   return T.isAArch64();
 }
 
-static Value *buildReductionValue(IRBuilder<> &B, const ReductionCandidate &C,
-                                  unsigned Width, const DataLayout &DL,
-                                  bool &UsedVectorLoad) {
-  auto *VecTy = FixedVectorType::get(C.Ty, Width);
-  UsedVectorLoad = false;
-  Value *Vec = nullptr;
-
-  // Prefer direct vector loads for contiguous reduction leaves.
-  SmallVector<std::pair<int64_t, LoadInst *>, 8> LoadTerms;
-  bool AllLoads = true;
+// Byte offsets of the leaves from their common base, if every leaf is a
+// load of Ty off the same base.
+static bool leafOffsets(ArrayRef<Value *> Leaves, Type *Ty,
+                        const DataLayout &DL,
+                        SmallVectorImpl<int64_t> &Offsets) {
   const Value *BaseObj = nullptr;
-  int64_t ElemSize = 0;
-  for (unsigned I = 0; I < Width; ++I) {
-    auto *LI = dyn_cast<LoadInst>(C.Terms[I]);
-    if (!LI) {
-      AllLoads = false;
-      break;
-    }
+  for (Value *V : Leaves) {
+    auto *LI = dyn_cast<LoadInst>(V);
+    if (!LI || LI->getType() != Ty)
+      return false;
+    const Value *Base = nullptr;
+    int64_t Off = 0;
+    if (!getAddrBaseAndOffset(LI, DL, Base, Off))
+      return false;
+    if (BaseObj && BaseObj != Base)
+      return false;
+    BaseObj = Base;
+    Offsets.push_back(Off);
+  }
+  return !Leaves.empty();
+}
+
+// True if the leaves, in lane order, load consecutive elements. Types with
+// padding bits (i1 flags) are packed tighter in a vector than in memory, so
+// they never form one vector load.
+static bool isContiguousRun(ArrayRef<Value *> Leaves, const DataLayout &DL) {
+  Type *Ty = Leaves.front()->getType();
+  if (!DL.typeSizeEqualsStoreSize(Ty))
+    return false;
+  SmallVector<int64_t, 16> Offsets;
+  if (!leafOffsets(Leaves, Ty, DL, Offsets))
+    return false;
+  int64_t ElemSize = static_cast<int64_t>(DL.getTypeStoreSize(Ty));
+  for (unsigned I = 1; I < Offsets.size(); ++I) {
+    if (Offsets[I] - Offsets[I - 1] != ElemSize)
+      return false;
+  }
+  return true;
+}
+
+// True if one vector load at Root reads what the leaves did: they are
+// consecutive loads in Root's block, and nothing from the first of them up
+// to Root may write the loaded range.
+static bool isLoadableAtRoot(ArrayRef<Value *> Leaves, Instruction *Root,
+                             const DataLayout &DL, AAResults &AA) {
+  if (!isContiguousRun(Leaves, DL))
+    return false;
+  Instruction *First = Root;
+  for (Value *V : Leaves) {
+    auto *LI = cast<LoadInst>(V);
+    if (!LI->isSimple() || LI->getParent() != Root->getParent())
+      return false;
+    if (LI->comesBefore(First))
+      First = LI;
+  }
+  auto *Lane0 = cast<LoadInst>(Leaves.front());
+  uint64_t Size = DL.getTypeStoreSize(Lane0->getType()) * Leaves.size();
+  MemoryLocation Loc(Lane0->getPointerOperand(), LocationSize::precise(Size));
+  for (Instruction *I = First; I != Root; I = I->getNextNode()) {
+    if (I->mayWriteToMemory() && isModSet(AA.getModRefInfo(I, Loc)))
+      return false;
+  }
+  return true;
+}
 
+// Recognizes sum(a[i] * b[i]). The products among the terms move to the
+// front and are taken apart into two leaf streams, so their vectors are
+// multiplied instead of packing the scalar products. Operands are swapped
+// per lane to line the streams up. Integer products of sign- or
+// zero-extended values keep the narrow operands, so a whole stream is
+// widened at once and the backend can select a dot-product instruction
+// (sdot/udot).
+static void matchDotProduct(ReductionCandidate &C, const DataLayout &DL) {
+  if (C.Kind != RecurKind::Add && C.Kind != RecurKind::FAdd)
+    return;
+  unsigned MulOpcode =
+      C.Kind == RecurKind::Add ? Instruction::Mul : Instruction::FMul;
+  auto IsProduct = [&](Value *V) {
+    auto *I = dyn_cast<Instruction>(V);
+    return I && I->getOpcode() == MulOpcode &&
+           I->getParent() == C.Root->getParent() && I->hasOneUse();
+  };
+  auto ProductsEnd =
+      std::stable_partition(C.Terms.begin(), C.Terms.end(), IsProduct);
+  unsigned NumProducts = static_cast<unsigned>(ProductsEnd - C.Terms.begin());
+  if (NumProducts < 2)
+    return;
+
+  // What a stream's lane looks like: its widening cast, the narrow type and
+  // the base address it is loaded from.
+  struct StreamKey {
+    unsigned Ext = 0;
+    Type *Ty = nullptr;
     const Value *Base = nullptr;
+    bool operator==(const StreamKey &O) const {
+      return Ext == O.Ext && Ty == O.Ty && Base == O.Base;
+    }
+  };
+  auto KeyOf = [&](Value *V) {
+    StreamKey K;
+    if (C.Kind == RecurKind::Add && (isa<SExtInst>(V) || isa<ZExtInst>(V))) {
+      K.Ext = cast<CastInst>(V)->getOpcode();
+      V = cast<CastInst>(V)->getOperand(0);
+    }
+    K.Ty = V->getType();
     int64_t Off = 0;
-    if (!getAddrBaseAndOffset(LI, DL, Base, Off)) {
-      AllLoads = false;
-      break;
+    if (auto *LI = dyn_cast<LoadInst>(V))
+      getAddrBaseAndOffset(LI, DL, K.Base, Off);
+    return K;
+  };
+
+  SmallVector<Value *, 16> LHS, RHS;
+  if (C.IsFloating)
+    C.DotFMF = cast<Instruction>(C.Terms[0])->getFastMathFlags();
+  StreamKey LKey, RKey;
+  for (unsigned I = 0; I < NumProducts; ++I) {
+    auto *Mul = cast<Instruction>(C.Terms[I]);
+    Value *L = Mul->getOperand(0);
+    Value *R = Mul->getOperand(1);
+    if (I == 0) {
+      LKey = KeyOf(L);
+      RKey = KeyOf(R);
+    } else if (!(KeyOf(L) == LKey && KeyOf(R) == RKey) &&
+               KeyOf(R) == LKey && KeyOf(L) == RKey) {
+      std::swap(L, R);
     }
+    LHS.push_back(L);
+    RHS.push_back(R);
+    if (C.IsFloating)
+      C.DotFMF &= Mul->getFastMathFlags();
+  }
 
-    int64_t CurElemSize = static_cast<int64_t>(DL.getTypeStoreSize(C.Ty));
-    if (I == 0) {
-      BaseObj = Base;
-      ElemSize = CurElemSize;
-    } else if (BaseObj != Base || ElemSize != CurElemSize) {
-      AllLoads = false;
-      break;
+  // A stream is only narrowed if every lane is the same widening cast.
+  auto Narrow = [&](SmallVectorImpl<Value *> &Stream, unsigned &Ext) {
+    auto *First = dyn_cast<CastInst>(Stream[0]);
+    if (C.Kind != RecurKind::Add || !First ||
+        (First->getOpcode() != Instruction::SExt &&
+         First->getOpcode() != Instruction::ZExt))
+      return;
+    for (Value *V : Stream) {
+      auto *Cast = dyn_cast<CastInst>(V);
+      if (!Cast || Cast->getOpcode() != First->getOpcode() ||
+          Cast->getSrcTy() != First->getSrcTy())
+        return;
     }
+    Ext = First->getOpcode();
+    for (Value *&V : Stream)
+      V = cast<CastInst>(V)->getOperand(0);
+  };
+  Narrow(LHS, C.DotLHSExt);
+  Narrow(RHS, C.DotRHSExt);
+
+  C.NumProducts = NumProducts;
+  C.DotLHS = LHS;
+  C.DotRHS = RHS;
+}
 
-    LoadTerms.push_back({Off, LI});
+// The vector the leaves are all extracted from, if any (a pack the main
+// pass already emitted), and the lanes they take from it.
+static Value *leafSourceVector(ArrayRef<Value *> Leaves,
+                               SmallVectorImpl<int> &Mask) {
+  Value *Src = nullptr;
+  for (Value *V : Leaves) {
+    auto *Ext = dyn_cast<ExtractElementInst>(V);
+    if (!Ext || (Src && Ext->getVectorOperand() != Src))
+      return nullptr;
+    auto *Idx = dyn_cast<ConstantInt>(Ext->getIndexOperand());
+    if (!Idx)
+      return nullptr;
+    Src = Ext->getVectorOperand();
+    Mask.push_back(static_cast<int>(Idx->getZExtValue()));
   }
+  return Src;
+}
 
-  if (AllLoads && !LoadTerms.empty()) {
-    llvm::stable_sort(LoadTerms, [](auto &A, auto &B) { return A.first < B.first; });
-    bool Contiguous = true;
-    for (unsigned I = 1; I < LoadTerms.size(); ++I) {
-      if (LoadTerms[I].first - LoadTerms[I - 1].first != ElemSize) {
-        Contiguous = false;
-        break;
-      }
-    }
+static bool isIdentityLanes(const Value *Src, ArrayRef<int> Mask) {
+  if (cast<FixedVectorType>(Src->getType())->getNumElements() != Mask.size())
+    return false;
+  for (unsigned I = 0; I < Mask.size(); ++I) {
+    if (Mask[I] != static_cast<int>(I))
+      return false;
+  }
+  return true;
+}
 
-    if (Contiguous) {
-      LoadInst *BaseLoad = LoadTerms.front().second;
-      Value *BasePtr = BaseLoad->getPointerOperand();
-      // Opaque pointer mode: CreateLoad takes element type explicitly.
-      Vec = B.CreateLoad(VecTy, BasePtr, "goslp.red.vload");
-      UsedVectorLoad = true;
+// Puts each run of terms in address order where that lets its chunks come
+// from vector loads, or in the order of the vector the terms are extracted
+// from; the reduction does not care which lane a term is in. Products are
+// ordered by their left stream.
+static void orderLanesByAddress(ReductionCandidate &C, const DataLayout &DL) {
+  auto SortRun = [&](unsigned Begin, unsigned End, ArrayRef<Value *> Key) {
+    if (End - Begin < 2)
+      return;
+    SmallVector<int64_t, 16> Offsets;
+    SmallVector<int, 16> Lanes;
+    if (leafSourceVector(Key, Lanes))
+      Offsets.assign(Lanes.begin(), Lanes.end());
+    else if (!leafOffsets(Key, Key.front()->getType(), DL, Offsets))
+      return;
+
+    SmallVector<unsigned, 16> Order(End - Begin);
+    for (unsigned I = 0; I < Order.size(); ++I)
+      Order[I] = I;
+    llvm::stable_sort(
+        Order, [&](unsigned A, unsigned B) { return Offsets[A] < Offsets[B]; });
+    auto Permute = [&](SmallVectorImpl<Value *> &Vals, unsigned First) {
+      SmallVector<Value *, 16> Old(Vals.begin() + First,
+                                   Vals.begin() + First + Order.size());
+      for (unsigned I = 0; I < Order.size(); ++I)
+        Vals[First + I] = Old[Order[I]];
+    };
+    Permute(C.Terms, Begin);
+    if (Begin < C.NumProducts) {
+      Permute(C.DotLHS, 0);
+      Permute(C.DotRHS, 0);
     }
+  };
+  SortRun(0, C.NumProducts, C.DotLHS);
+  SortRun(C.NumProducts, C.Terms.size(),
+          ArrayRef<Value *>(C.Terms).drop_front(C.NumProducts));
+}
+
+// Splits the terms into vectors of a register's lanes (DotLanes for the
+// products). What is left of a run becomes one narrower vector; a single
+// leftover term stays scalar.
+static void planChunks(const ReductionCandidate &C, unsigned Lanes,
+                       unsigned DotLanes,
+                       SmallVectorImpl<ReductionChunk> &Chunks,
+                       SmallVectorImpl<unsigned> &ScalarTerms) {
+  auto Split = [&](unsigned Begin, unsigned End, unsigned Width) {
+    unsigned I = Begin;
+    for (; I + 1 < End; I += Width)
+      Chunks.push_back({I, std::min(Width, End - I)});
+    if (I < End)
+      ScalarTerms.push_back(I);
+  };
+  Split(0, C.NumProducts, DotLanes);
+  Split(C.NumProducts, C.Terms.size(), Lanes);
+}
+
+// One vector of leaves: the vector they were extracted from (shuffled if
+// need be), a single load if they are consecutive in memory and still hold
+// the same values at Root, else built lane by lane.
+static Value *buildLeafVector(IRBuilder<> &B, ArrayRef<Value *> Leaves,
+                              Instruction *Root, const DataLayout &DL,
+                              AAResults &AA) {
+  SmallVector<int, 16> Mask;
+  if (Value *Src = leafSourceVector(Leaves, Mask)) {
+    if (isIdentityLanes(Src, Mask))
+      return Src;
+    return B.CreateShuffleVector(Src, Mask, "goslp.red.lanes");
   }
 
-  if (!Vec) {
-    Vec = UndefValue::get(VecTy);
-    for (unsigned I = 0; I < Width; ++I) {
-      Vec = B.CreateInsertElement(Vec, C.Terms[I], B.getInt32(I),
-                                  "goslp.red.ins");
-    }
+  auto *VecTy = FixedVectorType::get(Leaves.front()->getType(), Leaves.size());
+  if (isLoadableAtRoot(Leaves, Root, DL, AA)) {
+    auto *First = cast<LoadInst>(Leaves.front());
+    return B.CreateAlignedLoad(VecTy, First->getPointerOperand(),
+                               First->getAlign(), "goslp.red.vload");
   }
 
-  if (C.Opcode == Instruction::Add) {
-    return B.CreateAddReduce(Vec);
+  Value *Vec = UndefValue::get(VecTy);
+  for (unsigned I = 0; I < Leaves.size(); ++I) {
+    Vec = B.CreateInsertElement(Vec, Leaves[I], B.getInt32(I),
+                                "goslp.red.ins");
   }
+  return Vec;
+}
 
-  Value *Acc = ConstantFP::get(C.Ty, 0.0);
-  return B.CreateFAddReduce(Acc, Vec);
+static double leafPackCost(ArrayRef<Value *> Leaves, Instruction *Root,
+                           TargetTransformInfo &TTI, const DataLayout &DL,
+                           AAResults &AA) {
+  auto CostKind = TargetTransformInfo::TCK_RecipThroughput;
+  auto *VecTy = FixedVectorType::get(Leaves.front()->getType(), Leaves.size());
+  SmallVector<int, 16> Mask;
+  if (Value *Src = leafSourceVector(Leaves, Mask)) {
+    if (isIdentityLanes(Src, Mask))
+      return 0.0;
+    auto *SrcTy = cast<FixedVectorType>(Src->getType());
+    return toDouble(TTI.getShuffleCost(TargetTransformInfo::SK_PermuteSingleSrc,
+                                       VecTy, SrcTy, Mask, CostKind, 0,
+                                       nullptr));
+  }
+  if (isLoadableAtRoot(Leaves, Root, DL, AA))
+    return 0.0;
+  double Cost = 0.0;
+  for (unsigned I = 0; I < Leaves.size(); ++I) {
+    Cost += toDouble(TTI.getVectorInstrCost(Instruction::InsertElement, VecTy,
+                                            CostKind, I, nullptr, nullptr));
+  }
+  return Cost;
 }
 
-static double estimateReductionCost(const ReductionCandidate &C, unsigned Width,
-                                    TargetTransformInfo &TTI,
-                                    const DataLayout &DL) {
+// What the scalar code spends taking leaves out of a vector when nothing
+// else reads those lanes; the vector form reads the vector itself.
+static double leafExtractCost(ArrayRef<Value *> Leaves,
+                              TargetTransformInfo &TTI) {
   auto CostKind = TargetTransformInfo::TCK_RecipThroughput;
-  auto *VecTy = FixedVectorType::get(C.Ty, Width);
+  SmallVector<int, 16> Mask;
+  Value *Src = leafSourceVector(Leaves, Mask);
+  if (!Src)
+    return 0.0;
+  double Cost = 0.0;
+  for (unsigned I = 0; I < Leaves.size(); ++I) {
+    if (Leaves[I]->hasOneUse())
+      Cost += toDouble(TTI.getVectorInstrCost(Instruction::ExtractElement,
+                                              Src->getType(), CostKind,
+                                              Mask[I], nullptr, nullptr));
+  }
+  return Cost;
+}
 
-  double ScalarAddCost =
-      toDouble(TTI.getArithmeticInstrCost(C.Opcode, C.Ty, CostKind));
-  double ScalarTotal = ScalarAddCost * static_cast<double>(C.Nodes.size());
+static Value *buildChunk(IRBuilder<> &B, const ReductionCandidate &C,
+                         const ReductionChunk &Chunk, const DataLayout &DL,
+                         AAResults &AA) {
+  if (Chunk.Begin >= C.NumProducts)
+    return buildLeafVector(
+        B, ArrayRef<Value *>(C.Terms).slice(Chunk.Begin, Chunk.Len), C.Root,
+        DL, AA);
+
+  auto *VecTy = FixedVectorType::get(C.Ty, Chunk.Len);
+  Value *LHS = buildLeafVector(
+      B, ArrayRef<Value *>(C.DotLHS).slice(Chunk.Begin, Chunk.Len), C.Root,
+      DL, AA);
+  Value *RHS = buildLeafVector(
+      B, ArrayRef<Value *>(C.DotRHS).slice(Chunk.Begin, Chunk.Len), C.Root,
+      DL, AA);
+  if (C.DotLHSExt)
+    LHS = B.CreateCast(static_cast<Instruction::CastOps>(C.DotLHSExt), LHS,
+                       VecTy, "goslp.red.ext");
+  if (C.DotRHSExt)
+    RHS = B.CreateCast(static_cast<Instruction::CastOps>(C.DotRHSExt), RHS,
+                       VecTy, "goslp.red.ext");
+  if (!C.IsFloating)
+    return B.CreateMul(LHS, RHS, "goslp.red.mul");
+  Value *Mul = B.CreateFMul(LHS, RHS, "goslp.red.mul");
+  if (auto *I = dyn_cast<Instruction>(Mul))
+    I->setFastMathFlags(C.DotFMF);
+  return Mul;
+}
 
-  bool CanUseContiguousLoad = true;
-  const Value *BaseObj = nullptr;
-  int64_t ElemSize = 0;
-  SmallVector<int64_t, 8> Offsets;
-  Offsets.reserve(Width);
-  for (unsigned I = 0; I < Width; ++I) {
-    auto *LI = dyn_cast<LoadInst>(C.Terms[I]);
-    if (!LI) {
-      CanUseContiguousLoad = false;
-      break;
-    }
-    const Value *Base = nullptr;
-    int64_t Off = 0;
-    if (!getAddrBaseAndOffset(LI, DL, Base, Off)) {
-      CanUseContiguousLoad = false;
-      break;
-    }
-    int64_t CurElemSize = static_cast<int64_t>(DL.getTypeStoreSize(C.Ty));
-    if (I == 0) {
-      BaseObj = Base;
-      ElemSize = CurElemSize;
-    } else if (BaseObj != Base || ElemSize != CurElemSize) {
-      CanUseContiguousLoad = false;
-      break;
-    }
-    Offsets.push_back(Off);
+static Value *createHorizontalReduce(IRBuilder<> &B,
+                                     const ReductionCandidate &C, Value *Vec) {
+  CallInst *Red = nullptr;
+  switch (C.Kind) {
+  case RecurKind::Add:
+    return B.CreateAddReduce(Vec);
+  case RecurKind::Mul:
+    return B.CreateMulReduce(Vec);
+  case RecurKind::And:
+    return B.CreateAndReduce(Vec);
+  case RecurKind::Or:
+    return B.CreateOrReduce(Vec);
+  case RecurKind::Xor:
+    return B.CreateXorReduce(Vec);
+  case RecurKind::SMin:
+    return B.CreateIntMinReduce(Vec, /*IsSigned=*/true);
+  case RecurKind::SMax:
+    return B.CreateIntMaxReduce(Vec, /*IsSigned=*/true);
+  case RecurKind::UMin:
+    return B.CreateIntMinReduce(Vec, /*IsSigned=*/false);
+  case RecurKind::UMax:
+    return B.CreateIntMaxReduce(Vec, /*IsSigned=*/false);
+  case RecurKind::FMin:
+    Red = B.CreateFPMinReduce(Vec);
+    break;
+  case RecurKind::FMax:
+    Red = B.CreateFPMaxReduce(Vec);
+    break;
+  case RecurKind::FMul:
+    Red = B.CreateFMulReduce(ConstantFP::get(C.Ty, 1.0), Vec);
+    break;
+  default:
+    Red = B.CreateFAddReduce(ConstantFP::getNegativeZero(C.Ty), Vec);
+    break;
   }
-  if (CanUseContiguousLoad) {
-    llvm::stable_sort(Offsets);
-    for (unsigned I = 1; I < Offsets.size(); ++I) {
-      if (Offsets[I] - Offsets[I - 1] != ElemSize) {
-        CanUseContiguousLoad = false;
-        break;
-      }
-    }
+  // Without reassoc the FP reductions would have to run lane by lane.
+  Red->setFastMathFlags(C.FMF);
+  return Red;
+}
+
+// One step of the reduction on Ty, scalar or vector.
+static double stepCost(const ReductionCandidate &C, Type *Ty,
+                       TargetTransformInfo &TTI) {
+  auto CostKind = TargetTransformInfo::TCK_RecipThroughput;
+  if (unsigned Opcode = reductionOpcode(C.Kind))
+    return toDouble(TTI.getArithmeticInstrCost(Opcode, Ty, CostKind));
+  return toDouble(TTI.getIntrinsicInstrCost(
+      IntrinsicCostAttributes(minMaxIntrinsic(C.Kind), Ty, {Ty, Ty}), CostKind));
+}
+
+static double horizontalReduceCost(const ReductionCandidate &C,
+                                   FixedVectorType *VecTy,
+                                   TargetTransformInfo &TTI) {
+  auto CostKind = TargetTransformInfo::TCK_RecipThroughput;
+  if (unsigned Opcode = reductionOpcode(C.Kind)) {
+    std::optional<FastMathFlags> FMF;
+    if (C.IsFloating)
+      FMF = C.FMF;
+    return toDouble(
+        TTI.getArithmeticReductionCost(Opcode, VecTy, FMF, CostKind));
   }
+  Intrinsic::ID IID = minMaxIntrinsic(C.Kind);
+  return toDouble(TTI.getMinMaxReductionCost(IID, VecTy, C.FMF, CostKind));
+}
+
+// Mirrors emitReduction: chunks of one width are joined lane-wise and
+// reduced once, a widened dot chunk is reduced on its own, and the
+// partial results and scalar terms are joined by scalar steps.
+static double estimateReductionCost(const ReductionCandidate &C,
+                                    ArrayRef<ReductionChunk> Chunks,
+                                    size_t NumScalarTerms,
+                                    TargetTransformInfo &TTI,
+                                    const DataLayout &DL, AAResults &AA) {
+  auto CostKind = TargetTransformInfo::TCK_RecipThroughput;
+  double ScalarStepCost = stepCost(C, C.Ty, TTI);
+  double ScalarTotal = ScalarStepCost * static_cast<double>(C.Nodes.size());
+
+  double VectorTotal = 0.0;
+  size_t Partials = 0;
+  std::map<unsigned, unsigned> ChunksByWidth;
+  for (const ReductionChunk &Chunk : Chunks) {
+    auto *VecTy = FixedVectorType::get(C.Ty, Chunk.Len);
+    if (Chunk.Begin < C.NumProducts) {
+      // The products become one vector multiply, after widening any narrow
+      // stream.
+      unsigned MulOpcode = C.IsFloating ? Instruction::FMul : Instruction::Mul;
+      ScalarTotal +=
+          static_cast<double>(Chunk.Len) *
+          toDouble(TTI.getArithmeticInstrCost(MulOpcode, C.Ty, CostKind));
+      VectorTotal +=
+          toDouble(TTI.getArithmeticInstrCost(MulOpcode, VecTy, CostKind));
+      auto AddStreamCost = [&](ArrayRef<Value *> Stream, unsigned Ext) {
+        Stream = Stream.slice(Chunk.Begin, Chunk.Len);
+        VectorTotal += leafPackCost(Stream, C.Root, TTI, DL, AA);
+        if (!Ext)
+          return;
+        Type *SrcTy = Stream.front()->getType();
+        ScalarTotal += static_cast<double>(Chunk.Len) *
+                       toDouble(TTI.getCastInstrCost(
+                           Ext, C.Ty, SrcTy, TTI::CastContextHint::None,
+                           CostKind));
+        VectorTotal += toDouble(TTI.getCastInstrCost(
+            Ext, VecTy, FixedVectorType::get(SrcTy, Chunk.Len),
+            TTI::CastContextHint::None, CostKind));
+      };
+      AddStreamCost(C.DotLHS, C.DotLHSExt);
+      AddStreamCost(C.DotRHS, C.DotRHSExt);
+    } else {
+      ArrayRef<Value *> Leaves =
+          ArrayRef<Value *>(C.Terms).slice(Chunk.Begin, Chunk.Len);
+      VectorTotal += leafPackCost(Leaves, C.Root, TTI, DL, AA);
+      ScalarTotal += leafExtractCost(Leaves, TTI);
+    }
 
-  double PackCost = 0.0;
-  if (!CanUseContiguousLoad) {
-    for (unsigned I = 0; I < Width; ++I) {
-      PackCost += toDouble(TTI.getVectorInstrCost(Instruction::InsertElement, VecTy,
-                                                  CostKind, I, nullptr,
-                                                  nullptr));
+    if (Chunk.Begin < C.NumProducts && isWidenedDot(C)) {
+      VectorTotal += horizontalReduceCost(C, VecTy, TTI);
+      ++Partials;
+    } else {
+      ++ChunksByWidth[Chunk.Len];
     }
   }
 
-  std::optional<FastMathFlags> FMF;
-  if (C.Opcode == Instruction::FAdd)
-    FMF = C.FMF;
-
-  double ReduceCost =
-      toDouble(TTI.getArithmeticReductionCost(C.Opcode, VecTy, FMF, CostKind));
+  for (const auto &Entry : ChunksByWidth) {
+    auto *VecTy = FixedVectorType::get(C.Ty, Entry.first);
+    VectorTotal += static_cast<double>(Entry.second - 1) * stepCost(C, VecTy, TTI);
+    VectorTotal += horizontalReduceCost(C, VecTy, TTI);
+    ++Partials;
+  }
 
-  // Tail terms remain scalar additions.
-  size_t TailTerms = C.Terms.size() > Width ? C.Terms.size() - Width : 0;
-  double TailCost = ScalarAddCost * static_cast<double>(TailTerms);
+  size_t Joins = Partials + NumScalarTerms - 1;
+  VectorTotal += ScalarStepCost * static_cast<double>(Joins);
 
-  return (PackCost + ReduceCost + TailCost) - ScalarTotal;
+  return VectorTotal - ScalarTotal;
 }
 
-static bool emitReduction(const ReductionCandidate &C, unsigned Width) {
-  if (!C.Root || Width < 2 || C.Terms.size() < Width)
+// Chunks of one width are joined lane-wise in a balanced tree and reduced
+// horizontally once. A widened dot chunk is reduced on its own instead,
+// keeping the reduce.add(mul(ext, ext)) form the backend turns into a
+// dot-product instruction. The partial results and any scalar leftover
+// term are then joined in a balanced tree too.
+static bool emitReduction(const ReductionCandidate &C,
+                          ArrayRef<ReductionChunk> Chunks,
+                          ArrayRef<unsigned> ScalarTerms, AAResults &AA) {
+  if (!C.Root || Chunks.empty())
     return false;
 
   IRBuilder<> B(C.Root);
   const DataLayout &DL = C.Root->getFunction()->getParent()->getDataLayout();
-  bool UsedVectorLoad = false;
-  Value *Red = buildReductionValue(B, C, Width, DL, UsedVectorLoad);
-  Value *Result = Red;
-
-  for (size_t I = Width; I < C.Terms.size(); ++I) {
-    if (C.Opcode == Instruction::Add) {
-      Result = B.CreateAdd(Result, C.Terms[I], "goslp.red.tail");
-    } else {
-      auto *F = cast<Instruction>(B.CreateFAdd(Result, C.Terms[I],
-                                               "goslp.red.tail"));
-      F->setFastMathFlags(C.FMF);
-      Result = F;
-    }
+  SmallVector<Value *, 8> Partials;
+  std::map<unsigned, SmallVector<Value *, 8>> VectorsByWidth;
+  for (const ReductionChunk &Chunk : Chunks) {
+    Value *Vec = buildChunk(B, C, Chunk, DL, AA);
+    if (Chunk.Begin < C.NumProducts && isWidenedDot(C))
+      Partials.push_back(createHorizontalReduce(B, C, Vec));
+    else
+      VectorsByWidth[Chunk.Len].push_back(Vec);
   }
+  for (auto &Entry : VectorsByWidth) {
+    Value *Acc = combineBalanced(B, C, Entry.second, "goslp.red.acc");
+    Partials.push_back(createHorizontalReduce(B, C, Acc));
+  }
+  for (unsigned I : ScalarTerms)
+    Partials.push_back(C.Terms[I]);
 
-  C.Root->replaceAllUsesWith(Result);
-
+  C.Root->replaceAllUsesWith(combineBalanced(B, C, Partials, "goslp.red.join"));
   return true;
 }
 
 } // namespace
 
 bool runReductionAwareGoSLP(Function &F, TargetTransformInfo &TTI,
-                            const DataLayout &DL, bool Debug) {
-  (void)DL;
+                            const DataLayout &DL, AAResults &AA, bool Debug) {
   Module *M = F.getParent();
   if (!M || !isAArch64Target(*M))
     return false;
@@ -254,11 +770,11 @@ bool runReductionAwareGoSLP(Function &F, TargetTransformInfo &TTI,
 
   for (BasicBlock &BB : F) {
     for (Instruction &IRef : BB) {
-      auto *I = dyn_cast<BinaryOperator>(&IRef);
-      if (!I)
-        continue;
-
-      if (!isReductionOpcode(I->getOpcode()))
+      Instruction *I = &IRef;
+      Value *LHS = nullptr;
+      Value *RHS = nullptr;
+      RecurKind Kind = matchReductionNode(I, LHS, RHS);
+      if (Kind == RecurKind::None)
         continue;
 
       if (Claimed.contains(I))
@@ -267,53 +783,75 @@ bool runReductionAwareGoSLP(Function &F, TargetTransformInfo &TTI,
       if (!I->getType()->isIntegerTy() && !I->getType()->isFloatingPointTy())
         continue;
 
-      if (I->getOpcode() == Instruction::FAdd && !I->hasAllowReassoc())
-        continue;
-
-      bool HasAddUser = false;
+      // Only the last step of a chain is a root; the steps feeding it are
+      // collected from there.
+      bool HasStepUser = false;
       for (User *U : I->users()) {
         auto *UI = dyn_cast<Instruction>(U);
         if (!UI || UI->getParent() != &BB)
           continue;
-        if (UI->getOpcode() == I->getOpcode()) {
-          HasAddUser = true;
+        Value *UL = nullptr;
+        Value *UR = nullptr;
+        if (matchReductionNode(UI, UL, UR) == Kind && (UL == I || UR == I)) {
+          HasStepUser = true;
           break;
         }
       }
-      if (HasAddUser)
+      if (HasStepUser)
         continue;
 
       ReductionCandidate Cand;
       Cand.Root = I;
-      Cand.Opcode = I->getOpcode();
+      Cand.Kind = Kind;
       Cand.Ty = I->getType();
-      Cand.IsFloating = I->getOpcode() == Instruction::FAdd;
+      Cand.IsFloating = I->getType()->isFloatingPointTy();
       if (Cand.IsFloating)
         Cand.FMF = I->getFastMathFlags();
 
       SmallPtrSet<Instruction *, 32> Visited;
-      if (!collectReductionTerms(Cand.Root, &BB, Cand.Opcode, Cand.Ty, Visited,
+      if (!collectReductionTerms(Cand.Root, &BB, Cand.Kind, Cand.Ty, Visited,
                                  Cand.Terms, Cand.Nodes))
         continue;
 
-      // Guardrails for reduction graph complexity.
-      if (Cand.Terms.size() < 2 || Cand.Terms.size() > 16)
+      // Every step shares the root's flags once the chain is rewritten.
+      if (Cand.IsFloating)
+        for (Instruction *N : Cand.Nodes)
+          Cand.FMF &= N->getFastMathFlags();
+
+      if (Cand.Terms.size() < 2 || Cand.Nodes.size() < 2)
         continue;
-      if (Cand.Nodes.size() < 2)
+
+      matchDotProduct(Cand, DL);
+      orderLanesByAddress(Cand, DL);
+
+      unsigned Lanes = registerLanes(Cand.Ty, TTI, DL);
+      unsigned DotLanes = Lanes;
+      if (isWidenedDot(Cand)) {
+        // A widened dot product fills a register with its (wider) narrow
+        // stream instead.
+        Type *LTy = Cand.DotLHS.front()->getType();
+        Type *RTy = Cand.DotRHS.front()->getType();
+        DotLanes = std::min(registerLanes(LTy, TTI, DL),
+                            registerLanes(RTy, TTI, DL));
+      }
+      if (Lanes < 2 || DotLanes < 2)
         continue;
 
-      unsigned Width = chooseReductionWidth(Cand.Terms.size());
-      if (Width < 2)
+      SmallVector<ReductionChunk, 8> Chunks;
+      SmallVector<unsigned, 2> ScalarTerms;
+      planChunks(Cand, Lanes, DotLanes, Chunks, ScalarTerms);
+      if (Chunks.empty())
         continue;
 
       // Cost guardrail for reduction vectorization.
-      double DeltaCost = estimateReductionCost(Cand, Width, TTI, DL);
+      double DeltaCost = estimateReductionCost(Cand, Chunks, ScalarTerms.size(),
+                                               TTI, DL, AA);
       // Allow a small positive margin because reduction lowering quality on
       // AArch64 can be better than IR-level scalarized cost estimates.
       if (DeltaCost > 2.0)
         continue;
 
-      if (!emitReduction(Cand, Width))
+      if (!emitReduction(Cand, Chunks, ScalarTerms, AA))
         continue;
 
       for (Instruction *N : Cand.Nodes)
@@ -321,8 +859,11 @@ bool runReductionAwareGoSLP(Function &F, TargetTransformInfo &TTI,
 
       Changed = true;
       if (Debug) {
-        errs() << "[GoSLP-Reduction] Vectorized add reduction in function "
-               << F.getName() << " with width " << Width << "\n";
+        errs() << "[GoSLP-Reduction] Vectorized " << reductionName(Kind)
+               << " reduction of " << Cand.Terms.size() << " terms in function "
+               << F.getName() << " as " << Chunks.size()
+               << " vector(s) of up to " << std::max(Lanes, DotLanes)
+               << " lanes\n";
       }
     }
   }
@@ -1,9 +1,10 @@
 #pragma once
 
+#include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/IR/Function.h"
 
 using namespace llvm;
 
 bool runReductionAwareGoSLP(Function &F, TargetTransformInfo &TTI,
-                            const DataLayout &DL, bool Debug);
+                            const DataLayout &DL, AAResults &AA, bool Debug);
@@ -0,0 +1,481 @@
+#include "Schedule.hpp"
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/MemoryLocation.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+using namespace llvm;
+
+namespace {
+
+struct BlockDAG {
+  // Instructions of each node, in the order they are placed.
+  std::vector<std::vector<Instruction *>> Members;
+  // Candidate pack index of each node, or -1 for a single instruction.
+  std::vector<int> PackOf;
+  // Original position of the node's first member; the schedule prefers it.
+  std::vector<unsigned> Key;
+  std::vector<std::vector<uint32_t>> Succs;
+};
+
+static bool isOrderedOp(const Instruction *I) {
+  return I->mayReadOrWriteMemory() || I->mayHaveSideEffects();
+}
+
+static bool isSimpleAccess(const Instruction *I) {
+  if (auto *L = dyn_cast<LoadInst>(I))
+    return L->isSimple();
+  if (auto *S = dyn_cast<StoreInst>(I))
+    return S->isSimple();
+  return false;
+}
+
+static bool mayConflict(Instruction *A, Instruction *B, AAResults &AA,
+                        WorkBudget &Budget) {
+  if (!A->mayHaveSideEffects() && !B->mayHaveSideEffects() &&
+      !A->mayWriteToMemory() && !B->mayWriteToMemory())
+    return false;
+  if (!isSimpleAccess(A) || !isSimpleAccess(B))
+    return true;
+  if (!Budget.charge())
+    return true;
+  return !AA.isNoAlias(MemoryLocation::get(A), MemoryLocation::get(B));
+}
+
+static BlockDAG buildBlockDAG(const std::vector<Instruction *> &Body,
+                              const CandidatePairs &C,
+                              const std::vector<uint32_t> &Packs,
+                              AAResults &AA, WorkBudget &Budget) {
+  BlockDAG G;
+  std::unordered_map<const Instruction *, unsigned> Pos;
+  for (unsigned I = 0; I < Body.size(); ++I)
+    Pos[Body[I]] = I;
+
+  std::unordered_map<const Instruction *, uint32_t> NodeOf;
+  for (uint32_t P : Packs) {
+    uint32_t Id = static_cast<uint32_t>(G.Members.size());
+    G.Members.emplace_back();
+    G.PackOf.push_back(static_cast<int>(P));
+    unsigned Key = static_cast<unsigned>(Body.size());
+    for (const Instruction *I : C.Packs[P]) {
+      G.Members.back().push_back(const_cast<Instruction *>(I));
+      NodeOf[I] = Id;
+      Key = std::min(Key, Pos[I]);
+    }
+    G.Key.push_back(Key);
+  }
+  for (Instruction *I : Body) {
+    if (NodeOf.count(I))
+      continue;
+    NodeOf[I] = static_cast<uint32_t>(G.Members.size());
+    G.Members.push_back({I});
+    G.PackOf.push_back(-1);
+    G.Key.push_back(Pos[I]);
+  }
+  G.Succs.assign(G.Members.size(), {});
+
+  auto addEdge = [&](const Instruction *From, const Instruction *To) {
+    uint32_t A = NodeOf[From];
+    uint32_t B = NodeOf[To];
+    if (A != B)
+      G.Succs[A].push_back(B);
+  };
+
+  for (Instruction *I : Body) {
+    for (Value *Op : I->operands()) {
+      auto *Def = dyn_cast<Instruction>(Op);
+      if (Def && NodeOf.count(Def))
+        addEdge(Def, I);
+    }
+  }
+
+  std::vector<Instruction *> MemOps;
+  for (Instruction *I : Body) {
+    if (isOrderedOp(I))
+      MemOps.push_back(I);
+  }
+
+  // Non-packed memory operations keep their relative order; packed ones are
+  // only held back by operations they may actually conflict with.
+  Instruction *PrevUnpacked = nullptr;
+  for (size_t J = 0; J < MemOps.size(); ++J) {
+    Instruction *B = MemOps[J];
+    bool BPacked = G.PackOf[NodeOf[B]] >= 0;
+    if (!BPacked) {
+      if (PrevUnpacked)
+        addEdge(PrevUnpacked, B);
+      PrevUnpacked = B;
+    }
+    for (size_t I = 0; I < J; ++I) {
+      Instruction *A = MemOps[I];
+      bool APacked = G.PackOf[NodeOf[A]] >= 0;
+      if (!APacked && !BPacked)
+        continue;
+      if (NodeOf[A] == NodeOf[B])
+        continue;
+      if (mayConflict(A, B, AA, Budget))
+        addEdge(A, B);
+    }
+  }
+
+  for (auto &S : G.Succs) {
+    llvm::sort(S);
+    S.erase(std::unique(S.begin(), S.end()), S.end());
+  }
+  return G;
+}
+
+// List schedule in original program order where dependences allow. Returns
+// false if a cycle through pack nodes remains; Order then holds the nodes
+// that could be placed.
+static bool listSchedule(const BlockDAG &G, std::vector<uint32_t> &Order) {
+  const size_t N = G.Members.size();
+  std::vector<uint32_t> InDegree(N, 0);
+  for (const auto &S : G.Succs) {
+    for (uint32_t B : S)
+      ++InDegree[B];
+  }
+
+  using Item = std::pair<unsigned, uint32_t>;
+  std::priority_queue<Item, std::vector<Item>, std::greater<Item>> Ready;
+  for (uint32_t V = 0; V < N; ++V) {
+    if (InDegree[V] == 0)
+      Ready.push({G.Key[V], V});
+  }
+
+  Order.clear();
+  while (!Ready.empty()) {
+    uint32_t V = Ready.top().second;
+    Ready.pop();
+    Order.push_back(V);
+    for (uint32_t S : G.Succs[V]) {
+      if (--InDegree[S] == 0)
+        Ready.push({G.Key[S], S});
+    }
+  }
+  return Order.size() == N;
+}
+
+// Calls Fn on every instruction strictly between Early and Late, where
+// Early's block dominates Late's and Late's post-dominates Early's: the rest
+// of Early's block, the blocks on paths between the two, and Late's block up
+// to Late. Stops and returns false as soon as Fn does, or if a path leads
+// from Early's block back to itself without passing Late's.
+static bool forEachBetween(Instruction *Early, Instruction *Late,
+                           function_ref<bool(Instruction *)> Fn) {
+  BasicBlock *Upper = Early->getParent();
+  BasicBlock *Lower = Late->getParent();
+  if (Upper == Lower) {
+    for (Instruction *I = Early->getNextNode(); I && I != Late;
+         I = I->getNextNode()) {
+      if (!Fn(I))
+        return false;
+    }
+    return true;
+  }
+
+  for (Instruction *I = Early->getNextNode(); I; I = I->getNextNode()) {
+    if (!Fn(I))
+      return false;
+  }
+  SmallPtrSet<BasicBlock *, 16> Seen;
+  std::vector<BasicBlock *> Work(succ_begin(Upper), succ_end(Upper));
+  while (!Work.empty()) {
+    BasicBlock *BB = Work.back();
+    Work.pop_back();
+    if (BB == Lower)
+      continue;
+    if (BB == Upper)
+      return false;
+    if (!Seen.insert(BB).second)
+      continue;
+    for (Instruction &I : *BB) {
+      if (!Fn(&I))
+        return false;
+    }
+    Work.insert(Work.end(), succ_begin(BB), succ_end(BB));
+  }
+  for (Instruction &I : *Lower) {
+    if (&I == Late)
+      break;
+    if (!Fn(&I))
+      return false;
+  }
+  return true;
+}
+
+// Appends to Out, definitions first, the instructions that must move along
+// for V to be available at the end of Upper. Only pure, speculatable
+// statements of Upper's class that no chosen pack owns can move.
+static bool collectHoistable(
+    Value *V, BasicBlock *Upper, const ControlEquivalence &CE,
+    const std::unordered_set<const Instruction *> &Packed,
+    std::vector<Instruction *> &Out, SmallPtrSetImpl<Instruction *> &InOut) {
+  auto *I = dyn_cast<Instruction>(V);
+  if (!I || InOut.count(I) || CE.DT.dominates(I, Upper->getTerminator()))
+    return true;
+  if (isa<PHINode>(I) || Packed.count(I) || isOrderedOp(I) ||
+      !isSafeToSpeculativelyExecute(I) ||
+      !CE.equivalent(I->getParent(), Upper) || Out.size() >= 16)
+    return false;
+  for (Value *Op : I->operands()) {
+    if (!collectHoistable(Op, Upper, CE, Packed, Out, InOut))
+      return false;
+  }
+  InOut.insert(I);
+  Out.push_back(I);
+  return true;
+}
+
+} // namespace
+
+bool schedulePacks(Function &F, const CandidatePairs &C,
+                   std::vector<bool> &Chosen, AAResults &AA,
+                   WorkBudget &Budget, bool debug) {
+  bool Changed = false;
+
+  std::unordered_map<const BasicBlock *, std::vector<uint32_t>> PacksByBlock;
+  for (uint32_t P = 0; P < C.Packs.size() && P < Chosen.size(); ++P) {
+    // PHI packs are adjacent already, at the top of their block.
+    if (!Chosen[P] || C.Packs[P].empty() || isa<PHINode>(C.Packs[P].front()))
+      continue;
+    const BasicBlock *BB = C.Packs[P].front()->getParent();
+    if (llvm::all_of(C.Packs[P], [&](const Instruction *I) {
+          return I->getParent() == BB;
+        }))
+      PacksByBlock[BB].push_back(P);
+  }
+
+  for (BasicBlock &BB : F) {
+    auto It = PacksByBlock.find(&BB);
+    if (It == PacksByBlock.end())
+      continue;
+    if (BB.isEHPad() || !BB.getTerminator())
+      continue;
+
+    std::vector<Instruction *> Body;
+    for (Instruction &I : BB) {
+      if (isa<PHINode>(I) || I.isTerminator())
+        continue;
+      Body.push_back(&I);
+    }
+
+    std::vector<uint32_t> &Packs = It->second;
+    std::vector<uint32_t> Order;
+    BlockDAG G;
+    while (true) {
+      G = buildBlockDAG(Body, C, Packs, AA, Budget);
+      if (listSchedule(G, Order))
+        break;
+
+      // Some pack cannot be made contiguous here. Drop the first one that
+      // got stuck and try again with its lanes as ordinary instructions.
+      std::vector<bool> Placed(G.Members.size(), false);
+      for (uint32_t V : Order)
+        Placed[V] = true;
+      int Victim = -1;
+      unsigned VictimKey = ~0u;
+      for (uint32_t V = 0; V < G.Members.size(); ++V) {
+        if (!Placed[V] && G.PackOf[V] >= 0 && G.Key[V] < VictimKey) {
+          Victim = G.PackOf[V];
+          VictimKey = G.Key[V];
+        }
+      }
+      if (Victim < 0)
+        return Changed;
+      if (debug)
+        errs() << "GoSLP schedule: dropping pack " << Victim
+               << " (dependence cycle in block " << BB.getName() << ")\n";
+      Chosen[Victim] = false;
+      Packs.erase(std::remove(Packs.begin(), Packs.end(),
+                              static_cast<uint32_t>(Victim)),
+                  Packs.end());
+    }
+
+    std::vector<Instruction *> NewBody;
+    NewBody.reserve(Body.size());
+    for (uint32_t V : Order)
+      NewBody.insert(NewBody.end(), G.Members[V].begin(), G.Members[V].end());
+    if (NewBody == Body)
+      continue;
+
+    Instruction *Term = BB.getTerminator();
+    for (Instruction *I : NewBody)
+      I->moveBefore(Term);
+    Changed = true;
+  }
+
+  return Changed;
+}
+
+bool placeCrossBlockPacks(const CandidatePairs &C, std::vector<bool> &Chosen,
+                          const ControlEquivalence &CE, AAResults &AA,
+                          WorkBudget &Budget, bool debug) {
+  bool Changed = false;
+
+  std::unordered_set<const Instruction *> Packed;
+  std::vector<uint32_t> Spanning;
+  std::vector<uint32_t> Predicated;
+  for (uint32_t P = 0; P < C.Packs.size() && P < Chosen.size(); ++P) {
+    if (!Chosen[P] || C.Packs[P].empty())
+      continue;
+    Packed.insert(C.Packs[P].begin(), C.Packs[P].end());
+    if (isPredicatedPack(C.Packs[P]))
+      Predicated.push_back(P);
+    else if (llvm::any_of(C.Packs[P], [&](const Instruction *I) {
+               return I->getParent() != C.Packs[P].front()->getParent();
+             }))
+      Spanning.push_back(P);
+  }
+
+  // A producer's last lane comes before the lane of any consumer that uses
+  // it, so ordering by last lane places producers first.
+  auto lastLane = [&](uint32_t P) {
+    const Instruction *Last = C.Packs[P].front();
+    for (const Instruction *I : C.Packs[P]) {
+      if (CE.comesBefore(Last, I))
+        Last = I;
+    }
+    return Last;
+  };
+  std::vector<const Instruction *> LastOf(C.Packs.size(), nullptr);
+  for (uint32_t P : Spanning)
+    LastOf[P] = lastLane(P);
+  std::stable_sort(Spanning.begin(), Spanning.end(),
+                   [&](uint32_t A, uint32_t B) {
+                     return CE.comesBefore(LastOf[A], LastOf[B]);
+                   });
+
+  for (uint32_t P : Spanning) {
+    std::vector<Instruction *> Lanes;
+    for (const Instruction *I : C.Packs[P])
+      Lanes.push_back(const_cast<Instruction *>(I));
+    std::stable_sort(Lanes.begin(), Lanes.end(),
+                     [&](const Instruction *A, const Instruction *B) {
+                       return CE.comesBefore(A, B);
+                     });
+    std::unordered_set<const Instruction *> Own(Lanes.begin(), Lanes.end());
+    auto isOwn = [&](const Instruction *I) { return Own.count(I) != 0; };
+
+    bool Placeable = true;
+    std::vector<std::pair<Instruction *, Instruction *>> Moves;
+    if (isa<StoreInst>(Lanes.front())) {
+      BasicBlock *Lower = Lanes.back()->getParent();
+      Instruction *At = *llvm::find_if(
+          Lanes, [&](const Instruction *I) { return I->getParent() == Lower; });
+      for (Instruction *S : Lanes) {
+        if (S->getParent() == Lower)
+          continue;
+        Placeable = forEachBetween(S, At, [&](Instruction *I) {
+          return isOwn(I) || !isOrderedOp(I) || !mayConflict(S, I, AA, Budget);
+        });
+        if (!Placeable)
+          break;
+        Moves.push_back({S, At});
+      }
+    } else {
+      BasicBlock *Upper = Lanes.front()->getParent();
+      Instruction *Term = Upper->getTerminator();
+      std::vector<Instruction *> Chain;
+      SmallPtrSet<Instruction *, 16> InChain;
+      for (Instruction *L : Lanes) {
+        if (L->getParent() == Upper)
+          continue;
+        for (Value *Op : L->operands()) {
+          if (!collectHoistable(Op, Upper, CE, Packed, Chain, InChain)) {
+            Placeable = false;
+            break;
+          }
+        }
+        if (!Placeable)
+          break;
+        // Loads must not move above a write they may observe; anything that
+        // may trap must not move above other side effects.
+        bool Speculatable = isSafeToSpeculativelyExecute(L);
+        Placeable = forEachBetween(Term, L, [&](Instruction *I) {
+          if (isOwn(I) || InChain.count(I) || !isOrderedOp(I))
+            return true;
+          if (isa<LoadInst>(L))
+            return !mayConflict(L, I, AA, Budget);
+          return Speculatable;
+        });
+        if (!Placeable)
+          break;
+      }
+      if (Placeable) {
+        for (Instruction *I : Chain)
+          Moves.push_back({I, Term});
+        for (Instruction *L : Lanes) {
+          if (L->getParent() != Upper)
+            Moves.push_back({L, Term});
+        }
+      }
+    }
+
+    if (!Placeable) {
+      if (debug)
+        errs() << "GoSLP schedule: dropping pack " << P
+               << " (lanes cannot be moved into one block)\n";
+      Chosen[P] = false;
+      continue;
+    }
+    for (auto &Move : Moves)
+      Move.first->moveBefore(Move.second);
+    Changed |= !Moves.empty();
+  }
+
+  // Predicated packs stay where they are until emission puts their masked
+  // form after the last guard. Their memory lanes must not conflict with
+  // anything from their first lane up to there, the last guarded block
+  // included, since that is what the masked access is reordered across.
+  for (uint32_t P : Predicated) {
+    if (!accessesMemory(C.Packs[P].front()))
+      continue;
+    Instruction *First = const_cast<Instruction *>(C.Packs[P].front());
+    Instruction *Latest = First;
+    for (const Instruction *I : C.Packs[P]) {
+      if (CE.comesBefore(I, First))
+        First = const_cast<Instruction *>(I);
+      if (CE.comesBefore(Latest, I))
+        Latest = const_cast<Instruction *>(I);
+    }
+    BasicBlock *LastBlock = Latest->getParent();
+    BlockGuard Last;
+    getBlockGuard(LastBlock, Last);
+
+    std::unordered_set<const Instruction *> Own(C.Packs[P].begin(),
+                                                C.Packs[P].end());
+    auto noConflict = [&](Instruction *I) {
+      if (Own.count(I) || !isOrderedOp(I))
+        return true;
+      return llvm::none_of(C.Packs[P], [&](const Instruction *L) {
+        return mayConflict(const_cast<Instruction *>(L), I, AA, Budget);
+      });
+    };
+    bool Safe = forEachBetween(First, Last.Head->getTerminator(), noConflict);
+    for (Instruction &I : *LastBlock) {
+      if (!Safe)
+        break;
+      Safe = noConflict(&I);
+    }
+    if (!Safe) {
+      if (debug)
+        errs() << "GoSLP schedule: dropping predicated pack " << P
+               << " (memory conflict between its guards)\n";
+      Chosen[P] = false;
+    }
+  }
+
+  return Changed;
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <vector>
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/IR/Function.h"
+#include "CandidatePacks.hpp"
+#include "ControlEquivalence.hpp"
+#include "WorkBudget.hpp"
+
+// Moves the lanes of each chosen pack that spans control-equivalent blocks
+// into one block so schedulePacks() can make them adjacent. Stores sink to
+// the earliest lane of the last block; everything else is hoisted to the end
+// of the first block, together with the pure, speculatable instructions
+// computing its operands. A pack stays only if nothing its lanes move across
+// may alias them (or have side effects, for lanes that may trap) and every
+// operand becomes available; otherwise it is deselected in Chosen. Packs are
+// placed producers first. Predicated packs (isPredicatedPack) are not moved;
+// they are only deselected if a memory lane may conflict with something the
+// masked access would be reordered across. Returns true if any instruction
+// moved.
+bool placeCrossBlockPacks(const CandidatePairs &C, std::vector<bool> &Chosen,
+                          const ControlEquivalence &CE, AAResults &AA,
+                          WorkBudget &Budget, bool debug);
+
+// Reorders every basic block so that the lanes of each chosen pack are
+// adjacent. Each block becomes a DAG whose nodes are the chosen packs (one
+// node for all lanes) and the remaining instructions, with def-use edges,
+// edges between memory operations that may alias, and a chain that keeps the
+// non-packed memory operations in their original order. A list schedule that
+// prefers original program order then rewrites the block.
+//
+// Packs that would close a cycle (legal pairwise but not as a set in this
+// block) are deselected in Chosen. Alias queries charge one budget unit each
+// and are answered conservatively once Budget is exhausted. Returns true if
+// any instruction moved.
+bool schedulePacks(Function &F, const CandidatePairs &C,
+                   std::vector<bool> &Chosen, AAResults &AA,
+                   WorkBudget &Budget, bool debug);
@@ -21,8 +21,8 @@ std::vector<int> ShuffleCost::computeLaneMap(
         const Instruction *DstI = DstPack[dstLane];
         
         // check if operand at operandIdx comes from SrcPack
-        if (operandIdx < DstI->getNumOperands()) {
-            if (auto *OpI = dyn_cast<Instruction>(DstI->getOperand(operandIdx))) {
+        if (operandIdx < getNumPackOperands(DstI)) {
+            if (auto *OpI = dyn_cast<Instruction>(getPackOperand(*Candidates, DstI, operandIdx))) {
                 // find which lane in SrcPack
                 for (size_t srcLane = 0; srcLane < SrcPack.size(); ++srcLane) {
                     if (SrcPack[srcLane] == OpI) {
@@ -121,8 +121,8 @@ InstructionCost ShuffleCost::getShuffleCost(const Node &Src, const Node &Dst) co
     for (size_t dstLane = 0; dstLane < Dst.pack.size(); ++dstLane) {
         const Instruction *DstI = Dst.pack[dstLane];
         
-        for (unsigned opIdx = 0; opIdx < DstI->getNumOperands(); ++opIdx) {
-            if (auto *OpI = dyn_cast<Instruction>(DstI->getOperand(opIdx))) {
+        for (unsigned opIdx = 0; opIdx < getNumPackOperands(DstI); ++opIdx) {
+            if (auto *OpI = dyn_cast<Instruction>(getPackOperand(*Candidates, DstI, opIdx))) {
                 // check if OpI is in Src pack
                 bool inSrcPack = std::find(Src.pack.begin(), Src.pack.end(), OpI) 
                                     != Src.pack.end();
@@ -0,0 +1,291 @@
+#include "TreeDP.hpp"
+
+#include "llvm/ADT/STLExtras.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <set>
+
+using namespace llvm;
+
+namespace {
+
+using Graph = std::vector<std::set<uint32_t>>;
+
+struct Factor {
+  std::vector<uint32_t> Scope; // sorted pack indices; bit I <-> Scope[I]
+  std::vector<double> Table;   // 2^|Scope| entries
+};
+
+struct Elimination {
+  uint32_t Var = 0;
+  std::vector<uint32_t> Rest; // remaining scope of the bag
+  std::vector<uint8_t> ArgMin; // best value of Var per assignment of Rest
+};
+
+static void addClique(Graph &G, const std::vector<uint32_t> &Vs) {
+  for (size_t A = 0; A < Vs.size(); ++A) {
+    for (size_t B = A + 1; B < Vs.size(); ++B) {
+      G[Vs[A]].insert(Vs[B]);
+      G[Vs[B]].insert(Vs[A]);
+    }
+  }
+}
+
+static size_t countFill(const Graph &G, uint32_t V) {
+  size_t Fill = 0;
+  for (auto A = G[V].begin(); A != G[V].end(); ++A) {
+    auto B = A;
+    for (++B; B != G[V].end(); ++B) {
+      if (!G[*A].count(*B))
+        ++Fill;
+    }
+  }
+  return Fill;
+}
+
+// Greedy min-fill ordering (ties broken by degree, then index). Returns false
+// as soon as the induced width would exceed MaxWidth.
+static bool computeEliminationOrder(Graph G, unsigned MaxWidth,
+                                    std::vector<uint32_t> &Order,
+                                    unsigned &Width) {
+  const uint32_t N = static_cast<uint32_t>(G.size());
+  std::vector<bool> Done(N, false);
+  Order.clear();
+  Width = 0;
+
+  for (uint32_t Step = 0; Step < N; ++Step) {
+    uint32_t BestV = N;
+    size_t BestFill = std::numeric_limits<size_t>::max();
+    size_t BestDeg = std::numeric_limits<size_t>::max();
+    for (uint32_t V = 0; V < N; ++V) {
+      if (Done[V])
+        continue;
+      size_t Deg = G[V].size();
+      if (Deg > MaxWidth)
+        continue;
+      size_t Fill = countFill(G, V);
+      if (Fill < BestFill || (Fill == BestFill && Deg < BestDeg)) {
+        BestV = V;
+        BestFill = Fill;
+        BestDeg = Deg;
+      }
+    }
+
+    // Every remaining pack has more than MaxWidth neighbours.
+    if (BestV == N)
+      return false;
+
+    Width = std::max<unsigned>(Width, static_cast<unsigned>(BestDeg));
+    std::vector<uint32_t> Nbrs(G[BestV].begin(), G[BestV].end());
+    addClique(G, Nbrs);
+    for (uint32_t U : Nbrs)
+      G[U].erase(BestV);
+    G[BestV].clear();
+    Done[BestV] = true;
+    Order.push_back(BestV);
+  }
+  return true;
+}
+
+static unsigned projectIndex(unsigned Assignment,
+                             const std::vector<unsigned> &BitMap) {
+  unsigned Idx = 0;
+  for (unsigned Bit = 0; Bit < BitMap.size(); ++Bit) {
+    if (Assignment & (1u << BitMap[Bit]))
+      Idx |= 1u << Bit;
+  }
+  return Idx;
+}
+
+static std::vector<unsigned> bitPositions(const std::vector<uint32_t> &Sub,
+                                          const std::vector<uint32_t> &Super) {
+  std::vector<unsigned> Map(Sub.size());
+  for (size_t I = 0; I < Sub.size(); ++I) {
+    auto It = std::lower_bound(Super.begin(), Super.end(), Sub[I]);
+    Map[I] = static_cast<unsigned>(It - Super.begin());
+  }
+  return Map;
+}
+
+// Packs that share an objective term, a requirement or an exclusion are
+// adjacent.
+static Graph buildInteractionGraph(const ObjectiveTerms &T, uint32_t N) {
+  Graph G(N);
+  for (const ObjectiveTerm &Term : T.Terms)
+    addClique(G, Term.Scope);
+  for (const LaneRequirement &R : T.Requirements)
+    addClique(G, R.Scope);
+  for (uint32_t P = 0; P < N && P < T.Exclusions.size(); ++P) {
+    for (uint32_t Other : T.Exclusions[P]) {
+      G[P].insert(Other);
+      G[Other].insert(P);
+    }
+  }
+  return G;
+}
+
+} // namespace
+
+bool solveByTreeDecomposition(CandidatePairs &C, ILPModel &Model,
+                              ObjectiveTerms &T, unsigned MaxWidth,
+                              WorkBudget &Budget, std::vector<bool> &Best,
+                              unsigned &Width) {
+  const uint32_t N = static_cast<uint32_t>(C.Packs.size());
+  if (N == 0)
+    return false;
+
+  // Activating packs only adds edges, which never makes the graph narrower,
+  // so one that is already too wide is given up before any use map is built
+  // for it.
+  std::vector<uint32_t> Order;
+  if (!computeEliminationOrder(buildInteractionGraph(T, N), MaxWidth, Order,
+                               Width))
+    return false;
+  activateLivePacks(C, Model, T);
+  Graph G = buildInteractionGraph(T, N);
+  if (!computeEliminationOrder(G, MaxWidth, Order, Width))
+    return false;
+
+  std::vector<uint32_t> Pos(N, 0);
+  for (uint32_t I = 0; I < N; ++I)
+    Pos[Order[I]] = I;
+
+  std::vector<std::vector<Factor>> Buckets(N);
+  auto place = [&](Factor F) {
+    if (F.Scope.empty())
+      return;
+    uint32_t First = F.Scope.front();
+    for (uint32_t V : F.Scope) {
+      if (Pos[V] < Pos[First])
+        First = V;
+    }
+    Buckets[Pos[First]].push_back(std::move(F));
+  };
+
+  // Tabulate every objective term over its scope.
+  std::vector<bool> Scratch(N, false);
+  for (const ObjectiveTerm &Term : T.Terms) {
+    Factor F;
+    F.Scope = Term.Scope;
+    F.Table.resize(size_t(1) << F.Scope.size());
+    if (!Budget.charge(F.Table.size()))
+      return false;
+    for (unsigned A = 0; A < F.Table.size(); ++A) {
+      for (unsigned Bit = 0; Bit < F.Scope.size(); ++Bit)
+        Scratch[F.Scope[Bit]] = (A >> Bit) & 1u;
+      F.Table[A] = evaluateTerm(C, Model, Term, Scratch);
+    }
+    for (uint32_t V : F.Scope)
+      Scratch[V] = false;
+    place(std::move(F));
+  }
+
+  // Requirements, exclusions and packs that are not live are hard: the
+  // assignments that break them can never be chosen.
+  const double Inf = std::numeric_limits<double>::infinity();
+  for (const LaneRequirement &R : T.Requirements) {
+    Factor F;
+    F.Scope = R.Scope;
+    F.Table.resize(size_t(1) << F.Scope.size());
+    if (!Budget.charge(F.Table.size()))
+      return false;
+    for (unsigned A = 0; A < F.Table.size(); ++A) {
+      for (unsigned Bit = 0; Bit < F.Scope.size(); ++Bit)
+        Scratch[F.Scope[Bit]] = (A >> Bit) & 1u;
+      F.Table[A] = meetsRequirement(C, R, Scratch) ? 0.0 : Inf;
+    }
+    for (uint32_t V : F.Scope)
+      Scratch[V] = false;
+    place(std::move(F));
+  }
+  for (uint32_t P = 0; P < N; ++P) {
+    if (T.Live[P] || G[P].empty())
+      continue;
+    Factor F;
+    F.Scope = {P};
+    F.Table = {0.0, Inf};
+    place(std::move(F));
+  }
+  for (uint32_t P = 0; P < N && P < T.Exclusions.size(); ++P) {
+    for (uint32_t Other : T.Exclusions[P]) {
+      if (Other <= P)
+        continue;
+      Factor F;
+      F.Scope = {P, Other};
+      F.Table = {0.0, 0.0, 0.0, Inf};
+      place(std::move(F));
+    }
+  }
+
+  // Eliminate packs in order; each bucket is one bag of the decomposition.
+  std::vector<Elimination> Records;
+  Records.reserve(N);
+  for (uint32_t Step = 0; Step < N; ++Step) {
+    uint32_t Var = Order[Step];
+    auto &Bucket = Buckets[Step];
+    if (Bucket.empty())
+      continue;
+
+    std::vector<uint32_t> Bag;
+    for (const Factor &F : Bucket)
+      Bag.insert(Bag.end(), F.Scope.begin(), F.Scope.end());
+    llvm::sort(Bag);
+    Bag.erase(std::unique(Bag.begin(), Bag.end()), Bag.end());
+
+    std::vector<std::vector<unsigned>> Maps;
+    Maps.reserve(Bucket.size());
+    for (const Factor &F : Bucket)
+      Maps.push_back(bitPositions(F.Scope, Bag));
+
+    unsigned VarBit = bitPositions({Var}, Bag).front();
+    Elimination Rec;
+    Rec.Var = Var;
+    for (uint32_t V : Bag) {
+      if (V != Var)
+        Rec.Rest.push_back(V);
+    }
+
+    Factor Msg;
+    Msg.Scope = Rec.Rest;
+    Msg.Table.assign(size_t(1) << Rec.Rest.size(), 0.0);
+    if (!Budget.charge(2 * Msg.Table.size() * Bucket.size()))
+      return false;
+    Rec.ArgMin.assign(Msg.Table.size(), 0);
+
+    for (unsigned R = 0; R < Msg.Table.size(); ++R) {
+      // Spread the assignment of Rest into Bag positions, leaving VarBit free.
+      unsigned Low = R & ((1u << VarBit) - 1);
+      unsigned High = (R >> VarBit) << (VarBit + 1);
+      unsigned A0 = Low | High;
+      unsigned A1 = A0 | (1u << VarBit);
+
+      double V0 = 0.0;
+      double V1 = 0.0;
+      for (size_t FI = 0; FI < Bucket.size(); ++FI) {
+        V0 += Bucket[FI].Table[projectIndex(A0, Maps[FI])];
+        V1 += Bucket[FI].Table[projectIndex(A1, Maps[FI])];
+      }
+      Msg.Table[R] = std::min(V0, V1);
+      Rec.ArgMin[R] = V1 < V0 ? 1 : 0;
+    }
+
+    Bucket.clear();
+    place(std::move(Msg));
+    Records.push_back(std::move(Rec));
+  }
+
+  std::vector<bool> Assign(N, false);
+  for (auto It = Records.rbegin(); It != Records.rend(); ++It) {
+    unsigned R = 0;
+    for (unsigned Bit = 0; Bit < It->Rest.size(); ++Bit) {
+      if (Assign[It->Rest[Bit]])
+        R |= 1u << Bit;
+    }
+    Assign[It->Var] = It->ArgMin[R] != 0;
+  }
+
+  Best = std::move(Assign);
+  return true;
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include <vector>
+#include "ObjectiveTerms.hpp"
+#include "WorkBudget.hpp"
+
+// Exact pack selection for interaction graphs of small treewidth. Packs that
+// share an objective term or an exclusion are adjacent; a greedy min-fill
+// elimination order defines the tree decomposition (one bag per eliminated
+// pack plus its remaining neighbours), and variable elimination over those
+// bags is linear in the number of packs for a fixed width.
+//
+// Every live pack is activated, unless the graph known before activation is
+// already too wide.
+//
+// Returns false without touching Best when the decomposition is wider than
+// MaxWidth or the table cells exceed Budget, so the caller can fall back to
+// branch-and-bound.
+bool solveByTreeDecomposition(CandidatePairs &C, ILPModel &Model,
+                              ObjectiveTerms &T, unsigned MaxWidth,
+                              WorkBudget &Budget, std::vector<bool> &Best,
+                              unsigned &Width);
@@ -0,0 +1,340 @@
+#include "UnrollToPack.hpp"
+#include "CandidatePacks.hpp"
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/MemoryLocation.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/LoopSimplify.h"
+#include "llvm/Transforms/Utils/LoopUtils.h"
+#include "llvm/Transforms/Utils/UnrollLoop.h"
+
+#include <functional>
+#include <map>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace {
+
+// Largest unroll factor considered; wider packs come from the widening
+// rounds, not from the body copies alone.
+constexpr unsigned MaxUnrollFactor = 16;
+
+// Non-PHI statements on a header PHI's cycle: the induction variable update,
+// an accumulator chain. Each copy needs the previous one's result.
+std::unordered_set<const Instruction *> collectRecurrences(const Loop &L) {
+  std::unordered_set<const Instruction *> OnCycle;
+  BasicBlock *Latch = L.getLoopLatch();
+  for (PHINode &Phi : L.getHeader()->phis()) {
+    std::unordered_map<const Instruction *, bool> Reaches;
+    std::function<bool(const Instruction *)> reachesPhi =
+        [&](const Instruction *I) {
+          if (I == &Phi)
+            return true;
+          if (isa<PHINode>(I) || !L.contains(I))
+            return false;
+          auto It = Reaches.find(I);
+          if (It != Reaches.end())
+            return It->second;
+          Reaches[I] = false;
+          bool R = llvm::any_of(I->operands(), [&](const Value *Op) {
+            auto *OpI = dyn_cast<Instruction>(Op);
+            return OpI && reachesPhi(OpI);
+          });
+          Reaches[I] = R;
+          if (R)
+            OnCycle.insert(I);
+          return R;
+        };
+    if (auto *Next =
+            dyn_cast<Instruction>(Phi.getIncomingValueForBlock(Latch)))
+      reachesPhi(Next);
+  }
+  return OnCycle;
+}
+
+// Unit-stride access: its address advances by one element per iteration.
+bool isUnitStride(const Instruction *I, const Loop &L, ScalarEvolution &SE,
+                  const DataLayout &DL) {
+  auto *Ptr = const_cast<Value *>(getLoadStorePointerOperand(I));
+  Type *ElemTy = getLoadStoreType(const_cast<Instruction *>(I));
+  auto *AR = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(Ptr));
+  if (!AR || AR->getLoop() != &L || !AR->isAffine())
+    return false;
+  auto *Step = dyn_cast<SCEVConstant>(AR->getStepRecurrence(SE));
+  return Step && Step->getAPInt().getSExtValue() ==
+                     static_cast<int64_t>(DL.getTypeStoreSize(ElemTy));
+}
+
+// The statements whose copies would pack, in body order. Only blocks that
+// run on every iteration count.
+std::vector<Instruction *> collectPackableStatements(
+    const Loop &L, ScalarEvolution &SE, DominatorTree &DT,
+    const TargetLibraryInfo &TLI, const DataLayout &DL) {
+  auto OnCycle = collectRecurrences(L);
+  std::unordered_set<const Instruction *> Set;
+  std::vector<Instruction *> Order;
+  BasicBlock *Latch = L.getLoopLatch();
+  for (BasicBlock *BB : L.blocks()) {
+    if (!DT.dominates(BB, Latch))
+      continue;
+    for (Instruction &I : *BB) {
+      if (isa<PHINode>(I) || !isCandidateStatement(&I, &TLI) ||
+          OnCycle.count(&I))
+        continue;
+      if (accessesMemory(&I)) {
+        if (!I.isAtomic() && !I.isVolatile() && isUnitStride(&I, L, SE, DL))
+          Order.push_back(&I);
+        continue;
+      }
+      // Index arithmetic and loop-invariant values do not pack.
+      if (L.hasLoopInvariantOperands(&I) ||
+          llvm::all_of(I.users(), [](const User *U) {
+            return isa<GetElementPtrInst>(U);
+          }))
+        continue;
+      Order.push_back(&I);
+    }
+  }
+  Set.insert(Order.begin(), Order.end());
+
+  // A statement pays off only if its in-loop operands and users pack along
+  // with it; anything else would need an insert or extract per copy.
+  auto isFed = [&](const Value *V) {
+    auto *I = dyn_cast<Instruction>(V);
+    return !I || !L.contains(I) || Set.count(I);
+  };
+  bool Dropped = true;
+  while (Dropped) {
+    Dropped = false;
+    for (Instruction *I : Order) {
+      if (!Set.count(I))
+        continue;
+      bool Keep;
+      if (auto *SI = dyn_cast<StoreInst>(I))
+        Keep = isFed(SI->getValueOperand());
+      else
+        Keep = (isa<LoadInst>(I) ||
+                llvm::all_of(I->operands(), isFed)) &&
+               llvm::all_of(I->users(), isFed);
+      if (!Keep) {
+        Set.erase(I);
+        Dropped = true;
+      }
+    }
+  }
+  llvm::erase_if(Order, [&](Instruction *I) { return !Set.count(I); });
+  return Order;
+}
+
+// Copies of a store and another access of the same loop within this many
+// iterations of each other would touch the same memory, so the unroll
+// factor may not exceed it. Zero if an unknown dependence rules out packing.
+unsigned dependenceDistanceLimit(const Loop &L, ScalarEvolution &SE,
+                                 AAResults &AA, const DataLayout &DL) {
+  std::vector<Instruction *> Accesses;
+  for (BasicBlock *BB : L.blocks()) {
+    for (Instruction &I : *BB) {
+      if (isa<LoadInst, StoreInst>(I))
+        Accesses.push_back(&I);
+      else if (I.mayReadOrWriteMemory())
+        return 0;
+    }
+  }
+
+  unsigned Limit = MaxUnrollFactor;
+  for (Instruction *S : Accesses) {
+    if (!isa<StoreInst>(S))
+      continue;
+    Value *PtrS = getLoadStorePointerOperand(S);
+    const int64_t Size =
+        static_cast<int64_t>(DL.getTypeStoreSize(getLoadStoreType(S)));
+    for (Instruction *M : Accesses) {
+      if (M == S)
+        continue;
+      Value *PtrM = getLoadStorePointerOperand(M);
+      const SCEV *Dist = SE.getMinusSCEV(SE.getSCEV(PtrM), SE.getSCEV(PtrS));
+      if (auto *C = dyn_cast<SCEVConstant>(Dist)) {
+        const int64_t D = std::abs(C->getAPInt().getSExtValue());
+        if (D != 0)
+          Limit = std::min<int64_t>(Limit, std::max<int64_t>(1, D / Size));
+        continue;
+      }
+      if (!AA.isNoAlias(MemoryLocation::getBeforeOrAfter(PtrS),
+                        MemoryLocation::getBeforeOrAfter(PtrM)))
+        return 0;
+    }
+  }
+  return Limit;
+}
+
+struct UnrollChoice {
+  unsigned Factor = 1;
+  double PerIteration = 0.0;
+};
+
+UnrollChoice chooseUnrollFactor(const Loop &L, ScalarEvolution &SE,
+                                DominatorTree &DT, AAResults &AA,
+                                const TargetLibraryInfo &TLI,
+                                const DataLayout &DL, UnrollSavingsFn Savings,
+                                UnrollWidthFn MaxWidth) {
+  UnrollChoice Best;
+  auto Statements = collectPackableStatements(L, SE, DT, TLI, DL);
+  if (Statements.empty())
+    return Best;
+
+  unsigned Limit = dependenceDistanceLimit(L, SE, AA, DL);
+  for (const Instruction *I : Statements)
+    Limit = std::min(Limit, MaxWidth(I));
+  const unsigned TripCount = SE.getSmallConstantTripCount(&L);
+
+  for (unsigned Factor = 2; Factor <= Limit; Factor *= 2) {
+    if (TripCount && TripCount % Factor != 0)
+      continue;
+    // Isomorphic copies pair all-to-all in the first round; past the
+    // candidate cap the pairs the ILP needs would be dropped.
+    const size_t Pairs = Statements.size() * Factor * (Factor - 1) / 2;
+    if (Pairs > maxCandidatePacks(/*debug=*/false))
+      break;
+    double Total = 0.0;
+    for (const Instruction *I : Statements)
+      Total += Savings(I, Factor);
+    const double PerIteration = Total / Factor;
+    if (PerIteration < Best.PerIteration) {
+      Best.Factor = Factor;
+      Best.PerIteration = PerIteration;
+    }
+  }
+  return Best;
+}
+
+// Rewrites the single-index inbounds addresses of a loop body as constant
+// offsets from the lowest one with the same base and variable index root
+// (base[iv], base[iv + 1], ... become base[iv], (base[iv])[1], ...). Both
+// addresses are in bounds of the base's object, so the new offset is too.
+bool shareAddressRoots(const Loop &L, DominatorTree &DT,
+                       const DataLayout &DL) {
+  struct Entry {
+    GetElementPtrInst *GEP;
+    int64_t Off;
+  };
+  std::map<std::tuple<Type *, Value *, Value *>, std::vector<Entry>> Groups;
+  for (BasicBlock *BB : L.blocks()) {
+    for (Instruction &I : *BB) {
+      auto *GEP = dyn_cast<GetElementPtrInst>(&I);
+      if (!GEP || !GEP->isInBounds() || GEP->getNumIndices() != 1)
+        continue;
+      Value *Idx = GEP->getOperand(1);
+      if (Idx->getType() != DL.getIndexType(GEP->getType()))
+        continue;
+      int64_t Off = 0;
+      while (auto *Add = dyn_cast<BinaryOperator>(Idx)) {
+        auto *C = dyn_cast<ConstantInt>(Add->getOperand(1));
+        if (Add->getOpcode() != Instruction::Add || !C)
+          break;
+        Off += C->getSExtValue();
+        Idx = Add->getOperand(0);
+      }
+      if (isa<Constant>(Idx))
+        continue;
+      Groups[{GEP->getSourceElementType(), GEP->getPointerOperand(), Idx}]
+          .push_back({GEP, Off});
+    }
+  }
+
+  bool Changed = false;
+  SmallVector<WeakTrackingVH, 8> Dead;
+  for (auto &Group : Groups) {
+    auto &Entries = Group.second;
+    if (Entries.size() < 2)
+      continue;
+    auto Root = std::min_element(
+        Entries.begin(), Entries.end(),
+        [](const Entry &A, const Entry &B) { return A.Off < B.Off; });
+    GetElementPtrInst *Anchor = Root->GEP;
+    const int64_t RootOff = Root->Off;
+    for (const Entry &E : Entries) {
+      if (E.GEP == Anchor || !DT.dominates(Anchor, E.GEP))
+        continue;
+      Type *IdxTy = E.GEP->getOperand(1)->getType();
+      auto *New = GetElementPtrInst::CreateInBounds(
+          E.GEP->getSourceElementType(), Anchor,
+          ConstantInt::get(IdxTy, E.Off - RootOff), E.GEP->getName(), E.GEP);
+      if (isa<Instruction>(E.GEP->getOperand(1)))
+        Dead.push_back(E.GEP->getOperand(1));
+      E.GEP->replaceAllUsesWith(New);
+      E.GEP->eraseFromParent();
+      Changed = true;
+    }
+  }
+  RecursivelyDeleteTriviallyDeadInstructionsPermissive(Dead);
+  return Changed;
+}
+
+} // namespace
+
+bool unrollLoopsForPacking(Function &F, LoopInfo &LI, ScalarEvolution &SE,
+                           DominatorTree &DT, AssumptionCache &AC,
+                           AAResults &AA, const TargetTransformInfo &TTI,
+                           const TargetLibraryInfo &TLI,
+                           UnrollSavingsFn Savings, UnrollWidthFn MaxWidth,
+                           bool debug) {
+  const DataLayout &DL = F.getParent()->getDataLayout();
+  OptimizationRemarkEmitter ORE(&F);
+  bool Changed = false;
+  // Headers of the loops whose body now holds several iterations.
+  SmallPtrSet<const BasicBlock *, 4> UnrolledHeaders;
+
+  for (Loop *L : LI.getLoopsInPreorder()) {
+    if (!L->isInnermost() || !L->getLoopLatch() || !L->isSafeToClone() ||
+        findStringMetadataForLoop(L, "llvm.loop.unroll.disable"))
+      continue;
+    UnrollChoice Choice =
+        chooseUnrollFactor(*L, SE, DT, AA, TLI, DL, Savings, MaxWidth);
+    if (Choice.Factor < 2)
+      continue;
+    // The unroller wants a preheader, dedicated exits and LCSSA form, which
+    // passes after the loop pipeline do not keep.
+    Changed |= simplifyLoop(L, &DT, &LI, &SE, &AC, nullptr,
+                            /*PreserveLCSSA=*/false);
+    Changed |= formLCSSA(*L, DT, &LI, &SE);
+    if (!L->isLoopSimplifyForm())
+      continue;
+
+    const unsigned TripCount = SE.getSmallConstantTripCount(L);
+    BasicBlock *Header = L->getHeader();
+    UnrollLoopOptions ULO{};
+    ULO.Count = Choice.Factor;
+    ULO.Force = false;
+    ULO.Runtime = TripCount == 0;
+    ULO.AllowExpensiveTripCount = true;
+    ULO.UnrollRemainder = false;
+    ULO.ForgetAllSCEV = false;
+    LoopUnrollResult Result = UnrollLoop(L, ULO, &LI, &SE, &DT, &AC, &TTI,
+                                         &ORE, /*PreserveLCSSA=*/true);
+    if (Result == LoopUnrollResult::Unmodified)
+      continue;
+    Changed = true;
+    // The copies now pack within the body; keep later unrollers off it.
+    if (Result == LoopUnrollResult::PartiallyUnrolled) {
+      addStringMetadataToLoop(L, "llvm.loop.unroll.disable");
+      UnrolledHeaders.insert(Header);
+    }
+    if (debug)
+      errs() << "GoSLP unroll: loop " << Header->getName() << " by "
+             << Choice.Factor << " (savings per iteration "
+             << Choice.PerIteration << ")\n";
+  }
+
+  // Fully unrolled copies index with constants and need no rewrite, and
+  // other loops are left as they are.
+  for (Loop *L : LI.getLoopsInPreorder()) {
+    if (UnrolledHeaders.count(L->getHeader()))
+      Changed |= shareAddressRoots(*L, DT, DL);
+  }
+  return Changed;
+}
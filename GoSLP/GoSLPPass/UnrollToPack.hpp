@@ -0,0 +1,41 @@
+#pragma once
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+
+using namespace llvm;
+
+// Cost hooks of the packing pipeline, queried for Width copies of a body
+// statement taken from consecutive iterations: the pack's savings (negative
+// is profitable) and the widest pack the statement may form.
+using UnrollSavingsFn =
+    function_ref<double(const Instruction *I, unsigned Width)>;
+using UnrollWidthFn = function_ref<unsigned(const Instruction *I)>;
+
+// Unroll-to-pack pre-stage. GoSLP only packs statements that sit side by
+// side, so the copies of a loop body's statements that consecutive
+// iterations would run are invisible to it. For every innermost loop this
+// estimates, per power-of-two unroll factor, what packing the copies would
+// save: statements on a loop-carried cycle and memory accesses that are not
+// unit-stride in the induction variable do not pack, a statement only counts
+// if its in-loop operands and users pack too, and the factor is capped by
+// the widest pack, by the distance of any memory dependence between
+// iterations, and by the candidate pairs a round may keep. The loop is
+// unrolled by the factor that saves most per original iteration (a constant
+// trip count must be a multiple of it; otherwise a runtime remainder loop is
+// added), and then the partially unrolled loop bodies' addresses are
+// rewritten as constant offsets from one shared address per base and
+// induction variable, so the copies' accesses are recognized as one memory
+// pack. Returns true if the function changed.
+bool unrollLoopsForPacking(Function &F, LoopInfo &LI, ScalarEvolution &SE,
+                           DominatorTree &DT, AssumptionCache &AC,
+                           AAResults &AA, const TargetTransformInfo &TTI,
+                           const TargetLibraryInfo &TLI,
+                           UnrollSavingsFn Savings, UnrollWidthFn MaxWidth,
+                           bool debug);
@@ -17,6 +17,10 @@ VecGraph buildVectorGraph(CandidatePairs& C) {
     for (int id = 0; id < (int)graph.items.size(); id++) {
         for (const Instruction *I : graph.items[id].pack) {
             for (const User *U : I->users()) {
+                // A PHI reads its operands on the incoming edges; an edge
+                // into a loop header's PHI would close a cycle.
+                if (isa<PHINode>(U))
+                    continue;
                 if (auto *UI = dyn_cast<Instruction>(U)) {
                     auto It = C.InstToCandidates.find(UI);
                     if (It != C.InstToCandidates.end()) {
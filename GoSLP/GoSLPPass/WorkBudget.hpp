@@ -0,0 +1,75 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <limits>
+
+// Deterministic compile-time budget. Stages charge abstract work units
+// (search nodes, dependence queries, DP cells), so the decisions they make do
+// not depend on machine load. Wall time is only polled as an emergency cutoff
+// for pathological inputs.
+class WorkBudget {
+public:
+  explicit WorkBudget(uint64_t Limit = std::numeric_limits<uint64_t>::max(),
+                      double EmergencySeconds = 0.0)
+      : Limit(Limit), HasEmergency(EmergencySeconds > 0.0) {
+    if (HasEmergency)
+      Emergency = std::chrono::steady_clock::now() +
+                  std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                      std::chrono::duration<double>(EmergencySeconds));
+  }
+
+  // Returns false once the budget is exhausted; callers should wind down.
+  bool charge(uint64_t Units = 1) {
+    if (Exhausted)
+      return false;
+    Used = Units > Limit - Used ? Limit : Used + Units;
+    if (Used >= Limit) {
+      Exhausted = true;
+      return false;
+    }
+    if (HasEmergency && Used - LastPoll >= PollInterval) {
+      LastPoll = Used;
+      if (std::chrono::steady_clock::now() > Emergency) {
+        Exhausted = true;
+        EmergencyHit = true;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool exhausted() const { return Exhausted; }
+  bool emergencyHit() const { return EmergencyHit; }
+  uint64_t used() const { return Used; }
+  uint64_t remaining() const { return Limit - Used; }
+
+  // A child budget limited to Fraction of what is left here. It shares the
+  // emergency deadline; fold its usage back in with absorb().
+  WorkBudget carve(double Fraction) const {
+    WorkBudget Sub(*this);
+    Sub.Limit = static_cast<uint64_t>(static_cast<double>(remaining()) * Fraction);
+    Sub.Used = 0;
+    Sub.LastPoll = 0;
+    Sub.Exhausted = Exhausted || Sub.Limit == 0;
+    return Sub;
+  }
+
+  void absorb(const WorkBudget &Sub) {
+    charge(Sub.Used);
+    if (Sub.EmergencyHit) {
+      Exhausted = true;
+      EmergencyHit = true;
+    }
+  }
+
+private:
+  static constexpr uint64_t PollInterval = 4096;
+
+  uint64_t Limit;
+  uint64_t Used = 0;
+  uint64_t LastPoll = 0;
+  bool Exhausted = false;
+  bool EmergencyHit = false;
+  bool HasEmergency;
+  std::chrono::steady_clock::time_point Emergency;
+};
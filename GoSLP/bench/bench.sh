@@ -35,6 +35,13 @@ common_flags=( -std=c++17 -O3 -march=native -ffp-contract=off "${sysroot_args[@]
 baseline_exe="${results_dir}/bench_baseline"
 goslp_exe="${results_dir}/bench_goslp"
 
+# SCALAR_BASELINE=1 builds the baseline without LLVM's SLP vectorizer, so the
+# runtime table compares GoSLP against straight scalar code.
+baseline_flags=( "${common_flags[@]}" )
+if [[ "${SCALAR_BASELINE:-0}" == "1" ]]; then
+  baseline_flags+=( -fno-slp-vectorize )
+fi
+
 measure_real_seconds() {
   local log_file="$1"
   awk '/^real /{print $2}' "${log_file}"
@@ -43,9 +50,9 @@ measure_real_seconds() {
 # Baseline build + asm
 baseline_time_log="${results_dir}/compile_baseline.time"
 /usr/bin/time -p -o "${baseline_time_log}" \
-  clang++ "${common_flags[@]}" "${bench_src}" -o "${baseline_exe}"
+  clang++ "${baseline_flags[@]}" "${bench_src}" -o "${baseline_exe}"
 
-clang++ "${common_flags[@]}" -S "${bench_src}" -o "${results_dir}/baseline.s"
+clang++ "${baseline_flags[@]}" -S "${bench_src}" -o "${results_dir}/baseline.s"
 
 # GoSLP build pipeline + asm
 ll_in="${results_dir}/suite.ll"
@@ -82,7 +89,7 @@ printf "variant,build_seconds,opt_seconds,asm_instruction_lines\n" > "${results_
 printf "llvm_slp,%s,0,%s\n" "${baseline_build_s}" "${asm_baseline_inst}" >> "${results_dir}/compile.csv"
 printf "goslp,%s,%s,%s\n" "${goslp_build_s}" "${opt_s}" "${asm_goslp_inst}" >> "${results_dir}/compile.csv"
 
-kernels=(array_sum dot_product rolling_sum vwap variance covariance)
+kernels=(array_sum dot_product rolling_sum vwap variance covariance addsub)
 if [[ "${kernel_arg}" != "all" ]]; then
   kernels=("${kernel_arg}")
 fi
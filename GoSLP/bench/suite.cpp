@@ -105,6 +105,15 @@ static void covariance_block8(const float *x, const float *y, double &sumx,
   sumxy += sxy;
 }
 
+__attribute__((noinline))
+static void addsub_block8(const float *__restrict x, const float *__restrict y,
+                          float *__restrict out) {
+  out[0] = x[0] + y[0]; out[1] = x[1] - y[1];
+  out[2] = x[2] + y[2]; out[3] = x[3] - y[3];
+  out[4] = x[4] + y[4]; out[5] = x[5] - y[5];
+  out[6] = x[6] + y[6]; out[7] = x[7] - y[7];
+}
+
 static double kernel_array_sum(const std::vector<float> &x, int iters) {
   const int n = static_cast<int>(x.size());
   double checksum = 0.0;
@@ -277,6 +286,30 @@ static double ref_covariance_accum(const std::vector<float> &x,
   return checksum;
 }
 
+static double kernel_addsub(const std::vector<float> &x,
+                            const std::vector<float> &y, int iters) {
+  const int n = static_cast<int>(x.size());
+  std::vector<float> out(n);
+  double checksum = 0.0;
+  for (int it = 0; it < iters; ++it) {
+    for (int i = 0; i < n; i += kBlock)
+      addsub_block8(&x[i], &y[i], &out[i]);
+    checksum += static_cast<double>(out[it % n]);
+  }
+  return checksum;
+}
+
+static double ref_addsub(const std::vector<float> &x,
+                         const std::vector<float> &y, int iters) {
+  const int n = static_cast<int>(x.size());
+  double checksum = 0.0;
+  for (int it = 0; it < iters; ++it) {
+    const int i = it % n;
+    checksum += static_cast<double>(i % 2 ? x[i] - y[i] : x[i] + y[i]);
+  }
+  return checksum;
+}
+
 int main(int argc, char **argv) {
   const char *kernel = argc > 1 ? argv[1] : "array_sum";
   int iters = argc > 2 ? std::atoi(argv[2]) : 2000;
@@ -311,9 +344,12 @@ int main(int argc, char **argv) {
   } else if (std::strcmp(kernel, "covariance") == 0) {
     got = kernel_covariance_accum(x, y, iters);
     ref = ref_covariance_accum(x, y, iters);
+  } else if (std::strcmp(kernel, "addsub") == 0) {
+    got = kernel_addsub(x, y, iters);
+    ref = ref_addsub(x, y, iters);
   } else {
     std::fprintf(stderr,
-                 "Unknown kernel '%s'. Use array_sum|dot_product|rolling_sum|vwap|variance|covariance\n",
+                 "Unknown kernel '%s'. Use array_sum|dot_product|rolling_sum|vwap|variance|covariance|addsub\n",
                  kernel);
     return 1;
   }
@@ -0,0 +1,41 @@
+__attribute__((noinline))
+void foo_loop_accum4(const float *restrict a, const float *restrict b,
+                     float *restrict out, int n) {
+  float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+  for (int i = 0; i < n; ++i) {
+    s0 += a[4 * i + 0] * b[4 * i + 0];
+    s1 += a[4 * i + 1] * b[4 * i + 1];
+    s2 += a[4 * i + 2] * b[4 * i + 2];
+    s3 += a[4 * i + 3] * b[4 * i + 3];
+  }
+  out[0] = s0 + 1.0f;
+  out[1] = s1 - 1.0f;
+  out[2] = s2 * 2.0f;
+  out[3] = s3 * 0.5f;
+}
+
+static void ref_loop_accum4(const float *a, const float *b, float *out, int n) {
+  float s[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+  for (int i = 0; i < n; ++i)
+    for (int k = 0; k < 4; ++k)
+      s[k] += a[4 * i + k] * b[4 * i + k];
+  out[0] = s[0] + 1.0f;
+  out[1] = s[1] - 1.0f;
+  out[2] = s[2] * 2.0f;
+  out[3] = s[3] * 0.5f;
+}
+
+int main(void) {
+  float a[20], b[20];
+  float out1[4] = {0}, out2[4] = {0};
+  for (int i = 0; i < 20; ++i) {
+    a[i] = 0.5f * i - 3.0f;
+    b[i] = 2.25f - 0.75f * i;
+  }
+
+  foo_loop_accum4(a, b, out1, 5);
+  ref_loop_accum4(a, b, out2, 5);
+
+  return (out1[0] != out2[0]) || (out1[1] != out2[1]) ||
+         (out1[2] != out2[2]) || (out1[3] != out2[3]);
+}
@@ -0,0 +1,29 @@
+__attribute__((noinline))
+void foo_loop_scale(const float *restrict a, const float *restrict b,
+                    float *restrict c, int n) {
+  for (int i = 0; i < n; ++i)
+    c[i] = a[i] * b[i] + b[i];
+}
+
+static void ref_loop_scale(const float *a, const float *b, float *c, int n) {
+  for (int i = 0; i < n; ++i)
+    c[i] = a[i] * b[i] + b[i];
+}
+
+int main(void) {
+  float a[19], b[19];
+  float out1[19] = {0}, out2[19] = {0};
+  for (int i = 0; i < 19; ++i) {
+    a[i] = 0.5f * i - 3.0f;
+    b[i] = 2.25f - 0.75f * i;
+  }
+
+  // 19 leaves a remainder for any unroll factor.
+  foo_loop_scale(a, b, out1, 19);
+  ref_loop_scale(a, b, out2, 19);
+
+  for (int i = 0; i < 19; ++i)
+    if (out1[i] != out2[i])
+      return 1;
+  return 0;
+}
@@ -0,0 +1,41 @@
+struct point {
+  float x, y, z;
+};
+
+__attribute__((noinline))
+void foo_aos3(const struct point *a, const struct point *b, struct point *c) {
+  float x0 = a[0].x + b[0].x, y0 = a[0].y * b[0].y, z0 = a[0].z - b[0].z;
+  float x1 = a[1].x + b[1].x, y1 = a[1].y * b[1].y, z1 = a[1].z - b[1].z;
+  float x2 = a[2].x + b[2].x, y2 = a[2].y * b[2].y, z2 = a[2].z - b[2].z;
+  float x3 = a[3].x + b[3].x, y3 = a[3].y * b[3].y, z3 = a[3].z - b[3].z;
+  c[0].x = x0; c[0].y = y0; c[0].z = z0;
+  c[1].x = x1; c[1].y = y1; c[1].z = z1;
+  c[2].x = x2; c[2].y = y2; c[2].z = z2;
+  c[3].x = x3; c[3].y = y3; c[3].z = z3;
+}
+
+static void ref_aos3(const struct point *a, const struct point *b, struct point *c) {
+  for (int i = 0; i < 4; ++i) {
+    c[i].x = a[i].x + b[i].x;
+    c[i].y = a[i].y * b[i].y;
+    c[i].z = a[i].z - b[i].z;
+  }
+}
+
+int main(void) {
+  struct point a[4] = {{1.5f, -2.0f, 3.25f}, {0.5f, 4.0f, -1.0f},
+                       {7.0f, 0.25f, 2.0f}, {-3.5f, 1.0f, 6.5f}};
+  struct point b[4] = {{2.0f, 3.0f, -0.5f}, {-1.5f, 0.5f, 2.0f},
+                       {1.0f, -4.0f, 0.75f}, {2.5f, 2.0f, -3.0f}};
+  struct point out1[4];
+  struct point out2[4];
+
+  foo_aos3(a, b, out1);
+  ref_aos3(a, b, out2);
+
+  for (int i = 0; i < 4; ++i) {
+    if (out1[i].x != out2[i].x || out1[i].y != out2[i].y || out1[i].z != out2[i].z)
+      return 1;
+  }
+  return 0;
+}
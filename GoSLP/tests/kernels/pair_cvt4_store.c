@@ -0,0 +1,25 @@
+__attribute__((noinline))
+void foo_cvt4(const int *a, const int *b, float *c) {
+  c[0] = (float)(a[0] - b[0]) * 0.5f;
+  c[1] = (float)(a[1] - b[1]) * 0.5f;
+  c[2] = (float)(a[2] - b[2]) * 0.5f;
+  c[3] = (float)(a[3] - b[3]) * 0.5f;
+}
+
+static void ref_cvt4(const int *a, const int *b, float *c) {
+  for (int i = 0; i < 4; ++i)
+    c[i] = (float)(a[i] - b[i]) * 0.5f;
+}
+
+int main(void) {
+  int a[4] = {3, -7, 12, 0};
+  int b[4] = {5, -9, 4, 1};
+  float out1[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+  float out2[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+
+  foo_cvt4(a, b, out1);
+  ref_cvt4(a, b, out2);
+
+  return (out1[0] != out2[0]) || (out1[1] != out2[1]) ||
+         (out1[2] != out2[2]) || (out1[3] != out2[3]);
+}
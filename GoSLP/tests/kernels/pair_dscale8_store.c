@@ -0,0 +1,39 @@
+__attribute__((noinline))
+void foo_dscale8(const double *a, double *c) {
+  double x0 = a[0] * 1.5;
+  double x1 = a[1] * 1.5;
+  double x2 = a[2] * 1.5;
+  double x3 = a[3] * 1.5;
+  double x4 = a[4] * 1.5;
+  double x5 = a[5] * 1.5;
+  double x6 = a[6] * 1.5;
+  double x7 = a[7] * 1.5;
+  c[0] = x0;
+  c[1] = x1;
+  c[2] = x2;
+  c[3] = x3;
+  c[4] = x4;
+  c[5] = x5;
+  c[6] = x6;
+  c[7] = x7;
+}
+
+static void ref_dscale8(const double *a, double *c) {
+  for (int i = 0; i < 8; ++i)
+    c[i] = a[i] * 1.5;
+}
+
+int main(void) {
+  double a[8] = {1.5, -2.0, 3.25, 0.5, 7.0, -0.125, 2.75, -9.5};
+  double out1[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  double out2[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+
+  foo_dscale8(a, out1);
+  ref_dscale8(a, out2);
+
+  for (int i = 0; i < 8; ++i) {
+    if (out1[i] != out2[i])
+      return 1;
+  }
+  return 0;
+}
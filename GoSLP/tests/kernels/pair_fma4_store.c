@@ -0,0 +1,27 @@
+#include <math.h>
+
+__attribute__((noinline))
+void foo_fma4(const float *a, const float *b, float *c) {
+  c[0] = __builtin_fmaf(a[0], b[0], a[0]);
+  c[1] = __builtin_fmaf(a[1], b[1], a[1]);
+  c[2] = __builtin_fmaf(a[2], b[2], a[2]);
+  c[3] = __builtin_fmaf(a[3], b[3], a[3]);
+}
+
+static void ref_fma4(const float *a, const float *b, float *c) {
+  for (int i = 0; i < 4; ++i)
+    c[i] = fmaf(a[i], b[i], a[i]);
+}
+
+int main(void) {
+  float a[4] = {1.5f, -2.25f, 3.0f, 0.125f};
+  float b[4] = {4.0f, 0.5f, -1.75f, 8.0f};
+  float out1[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+  float out2[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+
+  foo_fma4(a, b, out1);
+  ref_fma4(a, b, out2);
+
+  return (out1[0] != out2[0]) || (out1[1] != out2[1]) ||
+         (out1[2] != out2[2]) || (out1[3] != out2[3]);
+}
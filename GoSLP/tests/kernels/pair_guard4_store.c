@@ -0,0 +1,30 @@
+__attribute__((noinline))
+void foo_guard4(const float *restrict a, const float *restrict b,
+                float *restrict c, int *restrict hits, int n) {
+  c[0] = a[0] * b[0] + b[0];
+  c[1] = a[1] * b[1] + b[1];
+  if (n > 0)
+    hits[0] += n;
+  c[2] = a[2] * b[2] + b[2];
+  c[3] = a[3] * b[3] + b[3];
+}
+
+static void ref_guard4(const float *a, const float *b, float *c) {
+  for (int i = 0; i < 4; ++i)
+    c[i] = a[i] * b[i] + b[i];
+}
+
+int main(void) {
+  float a[4] = {1.5f, -2.0f, 3.25f, 0.5f};
+  float b[4] = {0.75f, 4.0f, -1.25f, 2.5f};
+  float out1[4] = {0, 0, 0, 0};
+  float out2[4] = {0, 0, 0, 0};
+  int hits = 0;
+
+  foo_guard4(a, b, out1, &hits, 0);
+  foo_guard4(a, b, out1, &hits, 3);
+  ref_guard4(a, b, out2);
+
+  return (hits != 3) || (out1[0] != out2[0]) || (out1[1] != out2[1]) ||
+         (out1[2] != out2[2]) || (out1[3] != out2[3]);
+}
@@ -0,0 +1,30 @@
+__attribute__((noinline))
+void foo_mixsrc4(const int *a, const int *b, int *c) {
+  int m0 = a[0] * b[0];
+  int m1 = a[1] * b[1];
+  int m3 = a[3] * b[3];
+  c[0] = m0 + b[3];
+  c[1] = m1 + b[2];
+  c[2] = a[1] + b[1];
+  c[3] = m3 + b[0];
+}
+
+static void ref_mixsrc4(const int *a, const int *b, int *c) {
+  c[0] = a[0] * b[0] + b[3];
+  c[1] = a[1] * b[1] + b[2];
+  c[2] = a[1] + b[1];
+  c[3] = a[3] * b[3] + b[0];
+}
+
+int main(void) {
+  int a[4] = {3, -7, 11, 5};
+  int b[4] = {-2, 9, 4, 6};
+  int out1[4] = {0, 0, 0, 0};
+  int out2[4] = {0, 0, 0, 0};
+
+  foo_mixsrc4(a, b, out1);
+  ref_mixsrc4(a, b, out2);
+
+  return (out1[0] != out2[0]) || (out1[1] != out2[1]) ||
+         (out1[2] != out2[2]) || (out1[3] != out2[3]);
+}
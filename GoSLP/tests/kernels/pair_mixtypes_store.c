@@ -0,0 +1,37 @@
+__attribute__((noinline))
+void foo_mixtypes(const float *restrict fa, const float *restrict fb,
+                  const int *restrict ia, const int *restrict ib,
+                  float *restrict fc, int *restrict ic) {
+  for (int i = 0; i < 12; ++i) {
+    fc[i] = fa[i] * fb[i] + fa[i];
+    ic[i] = ia[i] * ib[i] - ib[i];
+  }
+}
+
+static void ref_mixtypes(const float *fa, const float *fb, const int *ia,
+                         const int *ib, float *fc, int *ic) {
+  for (int i = 0; i < 12; ++i) {
+    fc[i] = fa[i] * fb[i] + fa[i];
+    ic[i] = ia[i] * ib[i] - ib[i];
+  }
+}
+
+int main(void) {
+  float fa[12], fb[12], fc1[12], fc2[12];
+  int ia[12], ib[12], ic1[12], ic2[12];
+  for (int i = 0; i < 12; ++i) {
+    fa[i] = 0.5f * i - 2.0f;
+    fb[i] = 1.25f - 0.75f * i;
+    ia[i] = 3 * i - 7;
+    ib[i] = 11 - 2 * i;
+  }
+
+  foo_mixtypes(fa, fb, ia, ib, fc1, ic1);
+  ref_mixtypes(fa, fb, ia, ib, fc2, ic2);
+
+  for (int i = 0; i < 12; ++i) {
+    if (fc1[i] != fc2[i] || ic1[i] != ic2[i])
+      return 1;
+  }
+  return 0;
+}
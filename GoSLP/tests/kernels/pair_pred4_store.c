@@ -0,0 +1,34 @@
+__attribute__((noinline))
+void foo_pred4(const float *restrict a, const float *restrict b,
+               float *restrict c, const int *restrict m) {
+  if (m[0])
+    c[0] = a[0] * b[0] + 1.0f;
+  if (m[1])
+    c[1] = a[1] * b[1] + 1.0f;
+  if (m[2])
+    c[2] = a[2] * b[2] + 1.0f;
+  if (m[3])
+    c[3] = a[3] * b[3] + 1.0f;
+}
+
+static void ref_pred4(const float *a, const float *b, float *c, const int *m) {
+  for (int i = 0; i < 4; ++i)
+    if (m[i])
+      c[i] = a[i] * b[i] + 1.0f;
+}
+
+int main(void) {
+  float a[4] = {1.5f, -2.0f, 3.25f, 0.5f};
+  float b[4] = {0.75f, 4.0f, -1.25f, 2.5f};
+  int masks[3][4] = {{1, 0, 1, 0}, {0, 0, 0, 0}, {1, 1, 0, 1}};
+  float out1[4] = {-1.0f, -2.0f, -3.0f, -4.0f};
+  float out2[4] = {-1.0f, -2.0f, -3.0f, -4.0f};
+
+  for (int k = 0; k < 3; ++k) {
+    foo_pred4(a, b, out1, masks[k]);
+    ref_pred4(a, b, out2, masks[k]);
+  }
+
+  return (out1[0] != out2[0]) || (out1[1] != out2[1]) ||
+         (out1[2] != out2[2]) || (out1[3] != out2[3]);
+}
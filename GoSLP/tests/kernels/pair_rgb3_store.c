@@ -0,0 +1,27 @@
+struct rgb {
+  float r, g, b;
+};
+
+__attribute__((noinline))
+void foo_rgb3(const struct rgb *src, const struct rgb *gain, struct rgb *dst) {
+  float r = (src->r * gain->r + 0.25f) * src->r - gain->r;
+  float g = (src->g * gain->g + 0.25f) * src->g - gain->g;
+  float b = (src->b * gain->b + 0.25f) * src->b - gain->b;
+  dst->r = r;
+  dst->g = g;
+  dst->b = b;
+}
+
+static float ref_channel(float s, float k) { return (s * k + 0.25f) * s - k; }
+
+int main(void) {
+  struct rgb src = {0.5f, -1.25f, 2.0f};
+  struct rgb gain = {1.5f, 0.75f, -2.5f};
+  struct rgb out = {0, 0, 0};
+
+  foo_rgb3(&src, &gain, &out);
+
+  return (out.r != ref_channel(src.r, gain.r)) ||
+         (out.g != ref_channel(src.g, gain.g)) ||
+         (out.b != ref_channel(src.b, gain.b));
+}
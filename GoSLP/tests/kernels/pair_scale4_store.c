@@ -0,0 +1,28 @@
+__attribute__((noinline))
+void foo_scale4(const float *a, float k, float *c) {
+  float x0 = a[0] * k + 0.25f;
+  float x1 = a[1] * k + 0.25f;
+  float x2 = a[2] * k + 0.25f;
+  float x3 = a[3] * k + 0.25f;
+  c[0] = x0;
+  c[1] = x1;
+  c[2] = x2;
+  c[3] = x3;
+}
+
+static void ref_scale4(const float *a, float k, float *c) {
+  for (int i = 0; i < 4; ++i)
+    c[i] = a[i] * k + 0.25f;
+}
+
+int main(void) {
+  float a[4] = {1.5f, -2.0f, 3.25f, 0.5f};
+  float out1[4] = {0, 0, 0, 0};
+  float out2[4] = {0, 0, 0, 0};
+
+  foo_scale4(a, 1.5f, out1);
+  ref_scale4(a, 1.5f, out2);
+
+  return (out1[0] != out2[0]) || (out1[1] != out2[1]) ||
+         (out1[2] != out2[2]) || (out1[3] != out2[3]);
+}
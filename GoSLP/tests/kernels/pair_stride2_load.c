@@ -0,0 +1,25 @@
+__attribute__((noinline))
+void foo_stride2(const int *a, const int *b, int *c) {
+  c[0] = a[0] + b[0];
+  c[1] = a[2] + b[1];
+  c[2] = a[4] + b[2];
+  c[3] = a[6] + b[3];
+}
+
+static void ref_stride2(const int *a, const int *b, int *c) {
+  for (int i = 0; i < 4; ++i)
+    c[i] = a[2 * i] + b[i];
+}
+
+int main(void) {
+  int a[8] = {3, -1, -7, 2, 12, 9, 0, -4};
+  int b[4] = {5, -9, 4, 1};
+  int out1[4] = {0, 0, 0, 0};
+  int out2[4] = {0, 0, 0, 0};
+
+  foo_stride2(a, b, out1);
+  ref_stride2(a, b, out2);
+
+  return (out1[0] != out2[0]) || (out1[1] != out2[1]) ||
+         (out1[2] != out2[2]) || (out1[3] != out2[3]);
+}
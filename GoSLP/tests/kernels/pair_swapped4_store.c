@@ -0,0 +1,29 @@
+__attribute__((noinline))
+void foo_swapped4(const float *a, const float *b, float *c) {
+  float x0 = a[0] * b[0] + a[0];
+  float x1 = b[1] * a[1] + a[1];
+  float x2 = a[2] + b[2] * a[2];
+  float x3 = a[3] + a[3] * b[3];
+  c[0] = x0;
+  c[1] = x1;
+  c[2] = x2;
+  c[3] = x3;
+}
+
+static void ref_swapped4(const float *a, const float *b, float *c) {
+  for (int i = 0; i < 4; ++i)
+    c[i] = a[i] * b[i] + a[i];
+}
+
+int main(void) {
+  float a[4] = {1.5f, -2.0f, 3.25f, 0.5f};
+  float b[4] = {4.0f, 0.25f, -1.5f, 2.0f};
+  float out1[4] = {0, 0, 0, 0};
+  float out2[4] = {0, 0, 0, 0};
+
+  foo_swapped4(a, b, out1);
+  ref_swapped4(a, b, out2);
+
+  return (out1[0] != out2[0]) || (out1[1] != out2[1]) ||
+         (out1[2] != out2[2]) || (out1[3] != out2[3]);
+}
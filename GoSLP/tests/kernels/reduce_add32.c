@@ -0,0 +1,21 @@
+__attribute__((noinline))
+int foo_reduce_add32(const int *restrict a) {
+  return a[0] + a[1] + a[2] + a[3] + a[4] + a[5] + a[6] + a[7] + a[8] +
+         a[9] + a[10] + a[11] + a[12] + a[13] + a[14] + a[15] + a[16] +
+         a[17] + a[18] + a[19] + a[20] + a[21] + a[22] + a[23] + a[24] +
+         a[25] + a[26] + a[27] + a[28] + a[29] + a[30] + a[31];
+}
+
+static int ref_reduce_add32(const int *a) {
+  int s = 0;
+  for (int i = 0; i < 32; ++i)
+    s += a[i];
+  return s;
+}
+
+int main(void) {
+  int a[32];
+  for (int i = 0; i < 32; ++i)
+    a[i] = (i * 37) % 101 - 50;
+  return foo_reduce_add32(a) != ref_reduce_add32(a);
+}
@@ -0,0 +1,22 @@
+__attribute__((noinline))
+int foo_reduce_dot4_alias(const signed char *a, const signed char *restrict b,
+                          signed char *c) {
+  int a0 = a[0], a1 = a[1], a2 = a[2], a3 = a[3];
+  c[1] = 0;
+  return a0 * b[0] + a1 * b[1] + a2 * b[2] + a3 * b[3];
+}
+
+static int ref_reduce_dot4_alias(const signed char *a, const signed char *b) {
+  int s = 0;
+  for (int i = 0; i < 4; ++i)
+    s += a[i] * b[i];
+  return s;
+}
+
+int main(void) {
+  signed char a[4] = {-100, 50, 127, -128};
+  signed char b[4] = {3, -7, 100, -128};
+  int expected = ref_reduce_dot4_alias(a, b);
+  // c aliases a: the store must not reach the sum.
+  return foo_reduce_dot4_alias(a, b, a) != expected;
+}
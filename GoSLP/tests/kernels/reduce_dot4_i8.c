@@ -0,0 +1,18 @@
+__attribute__((noinline))
+int foo_reduce_dot4_i8(const signed char *restrict a,
+                       const signed char *restrict b) {
+  return a[0] * b[0] + a[1] * b[1] + a[2] * b[2] + a[3] * b[3];
+}
+
+static int ref_reduce_dot4_i8(const signed char *a, const signed char *b) {
+  int s = 0;
+  for (int i = 0; i < 4; ++i)
+    s += a[i] * b[i];
+  return s;
+}
+
+int main(void) {
+  signed char a[4] = {-100, 50, 127, -128};
+  signed char b[4] = {3, -7, 100, -128};
+  return foo_reduce_dot4_i8(a, b) != ref_reduce_dot4_i8(a, b);
+}
@@ -0,0 +1,30 @@
+__attribute__((noinline))
+int foo_reduce_smax8(const int *restrict a) {
+  int m = a[0];
+  m = a[1] > m ? a[1] : m;
+  m = a[2] > m ? a[2] : m;
+  m = a[3] > m ? a[3] : m;
+  m = a[4] > m ? a[4] : m;
+  m = a[5] > m ? a[5] : m;
+  m = a[6] > m ? a[6] : m;
+  m = a[7] > m ? a[7] : m;
+  return m;
+}
+
+static int ref_reduce_smax8(const int *a) {
+  int m = a[0];
+  for (int i = 1; i < 8; ++i)
+    if (a[i] > m)
+      m = a[i];
+  return m;
+}
+
+int main(void) {
+  int inputs[3][8] = {{5, -3, 17, 2, -40, 9, 11, -1},
+                      {-8, -7, -6, -5, -4, -3, -2, -9},
+                      {0, 0, 0, 0, 0, 0, 0, 42}};
+  for (int k = 0; k < 3; ++k)
+    if (foo_reduce_smax8(inputs[k]) != ref_reduce_smax8(inputs[k]))
+      return 1;
+  return 0;
+}
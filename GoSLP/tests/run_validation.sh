@@ -13,11 +13,18 @@ fi
 TMP_DIR="$(mktemp -d /tmp/goslp-validation.XXXXXX)"
 trap 'rm -rf "${TMP_DIR}"' EXIT
 
+# An optional fifth argument pins the target for cost-dependent patterns
+# (e.g. "--target=x86_64-apple-macos -mavx2"). Such cases only check the IR,
+# since the host may not run code for that target.
 run_case() {
   local name="$1"
   local func="$2"
   local expect_pattern="$3"
   local reject_pattern="$4"
+  local target_flags=()
+  if [[ -n "${5:-}" ]]; then
+    read -r -a target_flags <<< "$5"
+  fi
 
   local src="${ROOT}/tests/kernels/${name}.c"
   local ll="${TMP_DIR}/${name}.ll"
@@ -26,7 +33,7 @@ run_case() {
   local goslp_exe="${TMP_DIR}/${name}.goslp.exe"
 
   clang -O3 -fno-slp-vectorize -fno-vectorize -ffp-contract=off \
-    -emit-llvm -S "${src}" -o "${ll}"
+    ${target_flags[@]+"${target_flags[@]}"} -emit-llvm -S "${src}" -o "${ll}"
 
   opt -load-pass-plugin="${PLUGIN}" \
     -passes="GoSLPPass(func:${func})" \
@@ -46,6 +53,11 @@ run_case() {
     fi
   fi
 
+  if [[ ${#target_flags[@]} -gt 0 ]]; then
+    echo "[PASS] ${name} (${target_flags[*]}, IR only)"
+    return
+  fi
+
   clang -O3 -fno-slp-vectorize -fno-vectorize -ffp-contract=off \
     "${src}" -o "${base_exe}"
   "${base_exe}"
@@ -57,8 +69,86 @@ run_case() {
   echo "[PASS] ${name}"
 }
 
+# Extra pattern that a case already run by run_case must contain.
+expect_ir() {
+  local name="$1"
+  local expect_pattern="$2"
+
+  if ! rg -q "${expect_pattern}" "${TMP_DIR}/${name}.goslp.ll"; then
+    echo "[FAIL] ${name}: expected IR pattern not found: ${expect_pattern}" >&2
+    exit 1
+  fi
+}
+
+# Runs the pass again on the input of a case already run by run_case. Pack
+# selection must be bit-reproducible, so the two outputs have to match even
+# though the second process allocates the IR at different addresses.
+expect_reproducible() {
+  local name="$1"
+  local func="$2"
+  local again_ll="${TMP_DIR}/${name}.again.ll"
+
+  opt -load-pass-plugin="${PLUGIN}" \
+    -passes="GoSLPPass(func:${func})" \
+    -S "${TMP_DIR}/${name}.ll" -o "${again_ll}" >/dev/null 2>&1
+
+  if ! diff -q "${TMP_DIR}/${name}.goslp.ll" "${again_ll}" >/dev/null; then
+    echo "[FAIL] ${name}: output differs between two runs of the pass" >&2
+    exit 1
+  fi
+}
+
+# Pattern that the function of a case already run by run_case must not
+# contain; the rest of the module is not searched.
+reject_ir() {
+  local name="$1"
+  local func="$2"
+  local reject_pattern="$3"
+
+  if sed -n "/^define .*@${func}(/,/^}/p" "${TMP_DIR}/${name}.goslp.ll" |
+      rg -q "${reject_pattern}"; then
+    echo "[FAIL] ${name}: unexpected IR pattern found in ${func}: ${reject_pattern}" >&2
+    exit 1
+  fi
+}
+
 run_case pair_add_store foo_add2 "add <2 x i32>" ""
-run_case pair_add4_store foo_add4 "store <2 x i32>" ""
-run_case mismatch_ops foo_mismatch2 "" "(add|sub) <2 x i32>"
+run_case pair_add4_store foo_add4 "store <4 x i32>" "extractelement"
+run_case pair_fma4_store foo_fma4 "llvm.fma.v4f32" ""
+run_case pair_cvt4_store foo_cvt4 "sitofp <4 x i32>" ""
+run_case pair_minabs4_store foo_minabs4 "llvm.minnum.v4f32" ""
+run_case pair_stride2_load foo_stride2 "load <7 x i32>" ""
+run_case pair_aos3_store foo_aos3 "store <12 x float>" ""
+run_case pair_swapped4_store foo_swapped4 "fmul <4 x float>" "shufflevector"
+run_case pair_scale4_store foo_scale4 "fmul <4 x float>" "goslp.ins"
+run_case pair_mixsrc4_store foo_mixsrc4 "add <[24] x i32>" ""
+run_case pair_mixsrc4_store foo_mixsrc4 "add <4 x i32>" "goslp.ins" \
+  "--target=x86_64-apple-macos -mavx2"
+expect_ir pair_mixsrc4_store "= mul <3 x i32>"
+expect_ir pair_mixsrc4_store "shufflevector <3 x i32> %goslp\.vec[0-9]*, <3 x i32> %[.a-z0-9]+, <4 x i32>"
+run_case pair_dscale8_store foo_dscale8 "fmul <[248] x double>" ""
+run_case pair_dscale8_store foo_dscale8 "fmul <4 x double>" "<8 x double>" \
+  "--target=arm64-apple-macos -mcpu=apple-m1"
+run_case pair_rgb3_store foo_rgb3 "fmul <[23] x float>" ""
+run_case pair_rgb3_store foo_rgb3 "fmul <3 x float>" "fmul <2 x float>" \
+  "--target=x86_64-apple-macos -march=x86-64"
+run_case pair_guard4_store foo_guard4 "fmul <4 x float>" "fmul <2 x float>"
+run_case pair_pred4_store foo_pred4 "" ""
+run_case pair_pred4_store foo_pred4 "llvm.masked.store.v4f32" "" \
+  "--target=x86_64-apple-macos -march=skylake-avx512"
+expect_ir pair_pred4_store "llvm.masked.load.v4f32"
+reject_ir pair_pred4_store foo_pred4 "br i1"
+run_case loop_scale_store foo_loop_scale "fmul <[48] x float>" ""
+run_case loop_accum4 foo_loop_accum4 "phi <4 x float>" ""
+run_case reduce_smax8 foo_reduce_smax8 "llvm.vector.reduce.smax" ""
+run_case reduce_dot4_i8 foo_reduce_dot4_i8 "sext <4 x i8>" "goslp.red.ins"
+expect_ir reduce_dot4_i8 "mul <4 x i32>"
+expect_ir reduce_dot4_i8 "llvm.vector.reduce.add.v4i32"
+run_case reduce_dot4_alias foo_reduce_dot4_alias "llvm.vector.reduce.add.v4i32" ""
+expect_ir reduce_dot4_alias "goslp.red.ins"
+run_case reduce_add32 foo_reduce_add32 "llvm.vector.reduce.add" "goslp.red.tail"
+run_case mismatch_ops foo_mismatch2 "sub <2 x i32>" ""
+run_case pair_mixtypes_store foo_mixtypes "fmul <[248] x float>" ""
+expect_reproducible pair_mixtypes_store foo_mixtypes
 
 echo "All GoSLP validation cases passed."